@@ -0,0 +1,47 @@
+# Generates a C++ header embedding SPIR-V binaries as constexpr uint32_t
+# arrays, plus a registry to look them up by name.
+#
+# Usage: cmake -DOUTPUT=<header> -DSPV_FILES=<a.spv|b.spv|...> -P embed_spirv.cmake
+
+string(REPLACE "|" ";" SPV_FILES "${SPV_FILES}")
+
+# Eight words per line
+set(WORD_PATTERN "")
+foreach(IDX RANGE 1 8)
+  string(APPEND WORD_PATTERN "0x[0-9a-f]+u, ")
+endforeach()
+
+set(CONTENTS "// Generated by cmake/embed_spirv.cmake from src/*.glsl, do not edit.\n")
+string(APPEND CONTENTS "#pragma once\n\n#include <cstddef>\n#include <cstdint>\n\n")
+string(APPEND CONTENTS "namespace vkc {\n\n")
+string(APPEND CONTENTS "struct ShaderCode {\n  const char *name;\n  const uint32_t *code;\n  size_t size; // bytes\n};\n\n")
+string(APPEND CONTENTS "namespace shaders {\n")
+
+set(REGISTRY "")
+foreach(SPV ${SPV_FILES})
+  get_filename_component(NAME ${SPV} NAME_WE)
+  file(READ ${SPV} HEX HEX)
+  string(LENGTH "${HEX}" HEX_LENGTH)
+  math(EXPR REMAINDER "${HEX_LENGTH} % 8")
+  if(HEX_LENGTH EQUAL 0 OR NOT REMAINDER EQUAL 0)
+    message(FATAL_ERROR "${SPV} is not a valid SPIR-V binary")
+  endif()
+  # SPIR-V words are little endian
+  string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u, " WORDS "${HEX}")
+  string(REGEX REPLACE "(${WORD_PATTERN})" "\\1\n    " WORDS "${WORDS}")
+  string(REGEX REPLACE "[ \n]+$" "" WORDS "${WORDS}")
+  string(APPEND CONTENTS "\ninline constexpr uint32_t ${NAME}[] = {\n    ${WORDS}};\n")
+  string(APPEND REGISTRY "    {\"${NAME}\", shaders::${NAME}, sizeof(shaders::${NAME})},\n")
+endforeach()
+
+string(APPEND CONTENTS "\n} // namespace shaders\n\n")
+string(APPEND CONTENTS "inline constexpr ShaderCode shader_registry[] = {\n${REGISTRY}};\n\n")
+string(APPEND CONTENTS "} // namespace vkc\n")
+
+# Only touch the header when it changes to avoid needless rebuilds
+if(EXISTS ${OUTPUT})
+  file(READ ${OUTPUT} PREVIOUS)
+endif()
+if(NOT "${PREVIOUS}" STREQUAL "${CONTENTS}")
+  file(WRITE ${OUTPUT} "${CONTENTS}")
+endif()
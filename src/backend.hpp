@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu_softmax.hpp"
+#include "multi_device.hpp"
+#include "vkcompute.hpp"
+
+namespace vkc {
+
+enum class Backend { Auto, Gpu, Cpu };
+
+/**
+ * @brief How SoftmaxRunner picks a backend.
+ */
+struct RunnerOptions {
+  Backend backend = Backend::Auto;
+  // Auto runs smaller batches on the CPU, where they finish before a GPU
+  // submission (upload, dispatch, readback) would pay for itself
+  size_t min_gpu_elements = 1 << 18;
+  // Comma separated device names or UUIDs, see select_physical_devices
+  std::string devices = "";
+  // CPU threads, 0 for one per core
+  size_t cpu_threads = 0;
+};
+
+/**
+ * @brief Row softmax through whichever backend suits the call.
+ *
+ * The constructor looks for Vulkan devices. If there is no instance or no
+ * usable device it logs a warning and every call runs on the CPU
+ * (CpuSoftmax), so the same code works on hosts without a GPU. With devices,
+ * Backend::Auto sends batches of at least `min_gpu_elements` to the GPU and
+ * smaller ones to the CPU. Forcing Backend::Gpu without a device throws.
+ *
+ * On the GPU, rows are sharded across every selected device by a
+ * MultiDeviceSoftmax that lives as long as the runner, so each device keeps
+ * its logical device, buffers and pipelines between calls and only grows
+ * them for a larger batch or compiles one for a new workgroup size.
+ *
+ * Calls may come from several threads; GPU calls run one at a time.
+ */
+class SoftmaxRunner {
+public:
+  explicit SoftmaxRunner(const RunnerOptions &options = {})
+      : options(options),
+        pool(options.cpu_threads > 0 ? options.cpu_threads
+                                     : std::thread::hardware_concurrency()) {
+    if (options.backend == Backend::Cpu) {
+      return;
+    }
+    try {
+      instance =
+          create_vulkan_instance(VK_MAKE_API_VERSION(1, 3, 236, 0));
+      instance_owner = UniqueInstance(instance);
+      gpu = std::make_unique<MultiDeviceSoftmax>(
+          instance, select_physical_devices(instance, options.devices));
+    } catch (const std::exception &e) {
+      if (options.backend == Backend::Gpu) {
+        throw;
+      }
+      spdlog::warn("No usable Vulkan device ({}), softmax runs on the CPU",
+                   e.what());
+      gpu.reset();
+    }
+  }
+
+  SoftmaxRunner(const SoftmaxRunner &) = delete;
+  SoftmaxRunner &operator=(const SoftmaxRunner &) = delete;
+
+  /**
+   * @brief Softmax of each row of the row-major `[rows, cols]` `input` into
+   * `output`, returning the backend it ran on.
+   */
+  Backend run(const float *input, float *output, uint32_t rows, uint32_t cols,
+              float temperature = 1.0f) {
+    if (rows == 0 || cols == 0) {
+      throw std::invalid_argument("Softmax needs rows and columns.");
+    }
+    Backend backend = choose(size_t(rows) * cols);
+    if (backend == Backend::Cpu) {
+      CpuSoftmax(rows, cols, temperature, pool).run(input, output);
+    } else {
+      std::lock_guard<std::mutex> lock(gpu_mutex);
+      gpu->run(input, output, rows, cols, temperature);
+    }
+    last.store(backend);
+    return backend;
+  }
+
+  std::vector<float> run(const std::vector<float> &input, uint32_t rows,
+                         uint32_t cols, float temperature = 1.0f) {
+    if (input.size() != size_t(rows) * cols) {
+      throw std::invalid_argument("Softmax input size mismatch.");
+    }
+    std::vector<float> output(input.size());
+    run(input.data(), output.data(), rows, cols, temperature);
+    return output;
+  }
+
+  bool gpu_available() const { return gpu != nullptr; }
+  /* Backend of the most recent run(), Auto before the first. */
+  Backend last_backend() const { return last.load(); }
+
+private:
+  Backend choose(size_t elements) const {
+    switch (options.backend) {
+    case Backend::Cpu:
+      return Backend::Cpu;
+    case Backend::Gpu:
+      if (!gpu_available()) {
+        throw std::runtime_error("GPU backend requested without a device.");
+      }
+      return Backend::Gpu;
+    default:
+      return gpu_available() && elements >= options.min_gpu_elements
+                 ? Backend::Gpu
+                 : Backend::Cpu;
+    }
+  }
+
+  RunnerOptions options;
+  // Declared before the devices created from it, so it is destroyed last
+  VkInstance instance = VK_NULL_HANDLE;
+  UniqueInstance instance_owner;
+  std::unique_ptr<MultiDeviceSoftmax> gpu; // null without a device
+  std::mutex gpu_mutex;
+  ThreadPool pool;
+  std::atomic<Backend> last{Backend::Auto};
+};
+
+} // namespace vkc
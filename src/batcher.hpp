@@ -0,0 +1,343 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "vkcompute.hpp"
+
+namespace vkc {
+
+/**
+ * @brief When SoftmaxBatcher dispatches a batch.
+ */
+struct BatcherOptions {
+  // Longest a request waits for others to join its batch
+  std::chrono::microseconds window{200};
+  // A batch is dispatched as soon as it reaches either limit, which also
+  // size the batch buffers
+  size_t max_elements = 1 << 20;
+  size_t max_rows = 1024;
+  float temperature = 1.0f;
+};
+
+/**
+ * @brief Batch fill and queueing delay of a SoftmaxBatcher, see
+ * SoftmaxBatcher::metrics().
+ */
+struct BatcherMetrics {
+  size_t batches = 0;
+  size_t requests = 0;
+  size_t elements = 0;
+  double mean_fill = 0;           // elements / max_elements per batch
+  double mean_rows = 0;           // requests per batch
+  double mean_queue_delay_us = 0; // submit() to dispatch
+  double max_queue_delay_us = 0;
+};
+
+/**
+ * @brief Softmax of many small independent vectors, batched.
+ *
+ * submit() queues a request on a lock-free queue and returns a future. A
+ * scheduler thread collects requests until the oldest has waited
+ * `options.window` or the batch reaches `max_elements` or `max_rows`, then
+ * packs them back to back into one ragged batch buffer with an offsets
+ * table, runs a single softmax_ragged dispatch and scatters each row to its
+ * caller's future. The fixed cost of a submission (upload, submit, wait,
+ * readback) is paid once per batch instead of once per vector.
+ *
+ * Batch buffers are allocated once, in device-local memory with host visible
+ * staging buffers if it is not host visible. One batch is in flight at a
+ * time; requests arriving meanwhile form the next batch. Nothing else may
+ * use `queue` from other threads without its own synchronization.
+ */
+class SoftmaxBatcher {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  SoftmaxBatcher(DeviceResource &resource, AsyncQueue &queue,
+                 MemoryArena &arena, const BatcherOptions &options = {},
+                 PipelineCache *cache = nullptr)
+      : resource(resource), queue(queue), options(options),
+        command_pools(resource.device, resource.queue_family) {
+    if (options.max_elements == 0 || options.max_rows == 0) {
+      throw std::invalid_argument("Batch limits must be > 0.");
+    }
+    VkPhysicalDevice &physical_device = resource.physical_device;
+    uint32_t device_type =
+        query_memory_type(physical_device, MemoryUsage::DeviceLocal).value();
+    input = Tensor(resource.device, arena, device_type, {options.max_elements});
+    output =
+        Tensor(resource.device, arena, device_type, {options.max_elements});
+    offsets = Tensor(resource.device, arena, device_type,
+                     {options.max_rows + 1}, DType::u32);
+    // The cached set binds the batch buffers
+    input.track(descriptor_cache(resource));
+    if (!input.allocation.mapped || !offsets.allocation.mapped) {
+      uint32_t upload_type =
+          query_memory_type(physical_device, MemoryUsage::Upload).value();
+      input_staging = Tensor(resource.device, arena, upload_type,
+                             {options.max_elements}, DType::f32,
+                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+      offsets_staging = Tensor(resource.device, arena, upload_type,
+                               {options.max_rows + 1}, DType::u32,
+                               VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+    }
+    if (!output.allocation.mapped) {
+      readback = Tensor(
+          resource.device, arena,
+          query_memory_type(physical_device, MemoryUsage::Readback).value(),
+          {options.max_elements}, DType::f32,
+          VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    }
+    softmax = create_softmax_ragged(
+        resource.device, physical_device, input.buffer, output.buffer,
+        offsets.buffer, static_cast<uint32_t>(options.max_rows), 128, cache,
+        &descriptor_cache(resource));
+    softmax.temperature = options.temperature;
+    thread = std::thread([this] { run(); });
+  }
+
+  SoftmaxBatcher(const SoftmaxBatcher &) = delete;
+  SoftmaxBatcher &operator=(const SoftmaxBatcher &) = delete;
+
+  /* Runs the requests already queued, then stops the scheduler. */
+  ~SoftmaxBatcher() {
+    stopping.store(true);
+    wake();
+    thread.join();
+  }
+
+  /**
+   * @brief Queue the softmax of `count` elements. The input is copied before
+   * returning. Throws if the vector alone exceeds `max_elements`.
+   */
+  std::future<std::vector<float>> submit(const float *data, size_t count) {
+    if (count == 0 || count > options.max_elements) {
+      throw std::invalid_argument("Softmax request size out of range.");
+    }
+    Request request{std::vector<float>(data, data + count), Clock::now(), {}};
+    std::future<std::vector<float>> future = request.promise.get_future();
+    requests.push(std::move(request));
+    wake();
+    return future;
+  }
+
+  std::future<std::vector<float>> submit(const std::vector<float> &data) {
+    return submit(data.data(), data.size());
+  }
+
+  BatcherMetrics metrics() const {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    BatcherMetrics result = totals;
+    if (totals.batches > 0) {
+      result.mean_fill = fill_sum / totals.batches;
+      result.mean_rows = static_cast<double>(totals.requests) / totals.batches;
+    }
+    if (totals.requests > 0) {
+      result.mean_queue_delay_us = delay_sum_us / totals.requests;
+    }
+    return result;
+  }
+
+private:
+  struct Request {
+    std::vector<float> input;
+    Clock::time_point arrival;
+    std::promise<std::vector<float>> promise;
+  };
+
+  // Same handshake as BatchSubmitter: the scheduler publishes `waiting`
+  // before re-checking the queue and producers check it after pushing.
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready.notify_one();
+    }
+  }
+
+  /* Sleep until a request arrives, the batcher stops, or `deadline` if
+   * given. */
+  void sleep(std::optional<Clock::time_point> deadline = {}) {
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto woken = [&] { return !requests.empty() || stopping.load(); };
+    if (deadline) {
+      ready.wait_until(lock, deadline.value(), woken);
+    } else {
+      ready.wait(lock, woken);
+    }
+    waiting.store(false);
+  }
+
+  void run() {
+    std::vector<Request> pending;
+    while (true) {
+      bool stop = stopping.load();
+      requests.drain(pending);
+      if (pending.empty()) {
+        if (stop) {
+          return;
+        }
+        sleep();
+        continue;
+      }
+      size_t n = batch_size(pending);
+      Clock::time_point deadline = pending.front().arrival + options.window;
+      if (!stop && n == pending.size() && !full(pending) &&
+          Clock::now() < deadline) {
+        sleep(deadline);
+        continue;
+      }
+      run_batch(pending, n);
+      pending.erase(pending.begin(), pending.begin() + n);
+    }
+  }
+
+  /* Number of leading requests that fit in one batch. */
+  size_t batch_size(const std::vector<Request> &pending) const {
+    size_t elements = 0;
+    size_t n = 0;
+    while (n < pending.size() && n < options.max_rows &&
+           elements + pending[n].input.size() <= options.max_elements) {
+      elements += pending[n++].input.size();
+    }
+    return n;
+  }
+
+  bool full(const std::vector<Request> &pending) const {
+    size_t elements = 0;
+    for (const Request &request : pending) {
+      elements += request.input.size();
+    }
+    return pending.size() >= options.max_rows ||
+           elements >= options.max_elements;
+  }
+
+  void run_batch(std::vector<Request> &pending, size_t n) {
+    Clock::time_point dispatch = Clock::now();
+    try {
+      // Pack the rows and the offsets table
+      Tensor &input_host = input_staging.buffer != VK_NULL_HANDLE
+                               ? input_staging
+                               : input;
+      Tensor &offsets_host = offsets_staging.buffer != VK_NULL_HANDLE
+                                 ? offsets_staging
+                                 : offsets;
+      auto *packed = static_cast<float *>(input_host.allocation.mapped);
+      auto *table = static_cast<uint32_t *>(offsets_host.allocation.mapped);
+      uint32_t elements = 0;
+      for (size_t idx = 0; idx < n; ++idx) {
+        const std::vector<float> &row = pending[idx].input;
+        table[idx] = elements;
+        std::memcpy(packed + elements, row.data(), row.size() * sizeof(float));
+        elements += static_cast<uint32_t>(row.size());
+      }
+      table[n] = elements;
+      VkDeviceSize bytes = VkDeviceSize(elements) * sizeof(float);
+      VkDeviceSize table_bytes = (n + 1) * sizeof(uint32_t);
+      flush_allocation(resource.device, input_host.allocation, 0, bytes);
+      flush_allocation(resource.device, offsets_host.allocation, 0,
+                       table_bytes);
+
+      ThreadCommandPools::CommandBuffer pooled = command_pools.acquire();
+      VkCommandBuffer command_buffer = pooled;
+      VkCommandBufferBeginInfo begin_info{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+      };
+      check(vkBeginCommandBuffer(command_buffer, &begin_info),
+            "Begin batch command buffer.");
+      if (&input_host != &input) {
+        record_upload(command_buffer, input_staging.buffer, input.buffer,
+                      bytes);
+        record_upload(command_buffer, offsets_staging.buffer, offsets.buffer,
+                      table_bytes);
+      }
+      record_softmax_ragged(command_buffer, softmax, static_cast<uint32_t>(n),
+                            elements);
+      if (readback.buffer != VK_NULL_HANDLE) {
+        record_readback(command_buffer, output.buffer, readback.buffer, bytes);
+      } else {
+        host_read_barrier(command_buffer);
+      }
+      check(vkEndCommandBuffer(command_buffer), "End batch command buffer.");
+      queue.submit(command_buffer).wait();
+      command_pools.release(pooled);
+
+      // Scatter each row back to its caller
+      Tensor &output_host =
+          readback.buffer != VK_NULL_HANDLE ? readback : output;
+      invalidate_allocation(resource.device, output_host.allocation, 0, bytes);
+      auto *result = static_cast<const float *>(output_host.allocation.mapped);
+      for (size_t idx = 0; idx < n; ++idx) {
+        const float *row = result + table[idx];
+        pending[idx].promise.set_value(
+            std::vector<float>(row, row + pending[idx].input.size()));
+      }
+      record_metrics(pending, n, elements, dispatch);
+    } catch (...) {
+      for (size_t idx = 0; idx < n; ++idx) {
+        try {
+          pending[idx].promise.set_exception(std::current_exception());
+        } catch (const std::future_error &) {
+          // Already given its result before the failure
+        }
+      }
+    }
+  }
+
+  void record_metrics(const std::vector<Request> &pending, size_t n,
+                      size_t elements, Clock::time_point dispatch) {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    totals.batches++;
+    totals.requests += n;
+    totals.elements += elements;
+    fill_sum += static_cast<double>(elements) / options.max_elements;
+    for (size_t idx = 0; idx < n; ++idx) {
+      double delay_us = std::chrono::duration<double, std::micro>(
+                            dispatch - pending[idx].arrival)
+                            .count();
+      delay_sum_us += delay_us;
+      totals.max_queue_delay_us =
+          std::max(totals.max_queue_delay_us, delay_us);
+    }
+  }
+
+  DeviceResource &resource;
+  AsyncQueue &queue;
+  BatcherOptions options;
+  ThreadCommandPools command_pools;
+  Tensor input;
+  Tensor output;
+  Tensor offsets;
+  Tensor input_staging;   // empty if input and offsets are host visible
+  Tensor offsets_staging;
+  Tensor readback;        // empty if output is host visible
+  SoftmaxRaggedResource softmax;
+
+  MpscQueue<Request> requests;
+  std::atomic<bool> stopping{false};
+  std::atomic<bool> waiting{false};
+  std::mutex mutex;
+  std::condition_variable ready;
+
+  mutable std::mutex metrics_mutex;
+  BatcherMetrics totals;
+  double fill_sum = 0;
+  double delay_sum_us = 0;
+
+  std::thread thread;
+};
+
+} // namespace vkc
@@ -0,0 +1,629 @@
+
+#define VK_ENABLE_BETA_EXTENSIONS // VK_KHR_portability_subset
+#include <vulkan/vulkan.hpp>
+#include <vulkan/vulkan_beta.h>
+#include <vulkan/vulkan_macos.h>
+
+#include "spdlog/spdlog.h"
+
+#include <cstdio>
+#include <set>
+#include <thread>
+
+#include "backend.hpp"
+#include "batcher.hpp"
+#include "cpu_softmax.hpp"
+#include "multi_device.hpp"
+#include "submit.hpp"
+#include "vkcompute.hpp"
+
+/*
+ * Benchmarks for softmax throughput, host/device transfer bandwidth and
+ * setup latency. Results are logged and written as JSON (or CSV if the output
+ * path ends in .csv) so they can be tracked over time.
+ *
+ * Usage: vkcompute_bench [--output build/bench.json] [--max-size 100000000]
+ *                        [--iterations 10] [--devices name,uuid,...]
+ *                        [--shards 0]
+ *
+ * Nothing here depends on GPU specific features, so it also runs on software
+ * implementations such as lavapipe or SwiftShader (select one with
+ * VK_ICD_FILENAMES). GPU times are reported when the queue supports
+ * timestamps.
+ *
+ * The sharded row softmax runs on every suitable device, or those named by
+ * --devices, and with --shards N cycles through them to make N shards. Give a
+ * single software device several shards to exercise the sharding without
+ * multiple GPUs.
+ *
+ * GPU row softmax results are checked against the CPU backend (CpuSoftmax)
+ * and reported as max_abs_error.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+struct BenchResult {
+  std::string benchmark;
+  std::string config;
+  std::string metric;
+  double value;
+  std::string unit;
+};
+
+struct BenchOptions {
+  std::string output = "build/bench.json";
+  size_t max_size = 100'000'000;
+  int iterations = 10;
+  std::string devices = "";  // comma separated names or UUIDs
+  size_t shards = 0;         // 0 for one shard per device
+};
+
+BenchOptions parse_options(int argc, char **argv) {
+  BenchOptions options;
+  for (int idx = 1; idx < argc; ++idx) {
+    std::string arg = argv[idx];
+    if (idx + 1 >= argc) {
+      throw std::runtime_error("Missing value for " + arg);
+    }
+    if (arg == "--output") {
+      options.output = argv[++idx];
+    } else if (arg == "--max-size") {
+      options.max_size = std::stoull(argv[++idx]);
+    } else if (arg == "--iterations") {
+      options.iterations = std::max(1, std::stoi(argv[++idx]));
+    } else if (arg == "--devices") {
+      options.devices = argv[++idx];
+    } else if (arg == "--shards") {
+      options.shards = std::stoull(argv[++idx]);
+    } else {
+      throw std::runtime_error("Unknown argument " + arg);
+    }
+  }
+  return options;
+}
+
+class Bench {
+public:
+  Bench(vkc::DeviceResource &resource, vkc::MemoryArena &arena,
+        const BenchOptions &options)
+      : resource(resource), arena(arena), options(options),
+        queue(resource),
+        profiler(resource.device, resource.physical_device,
+                 resource.queue_family) {
+    vkGetPhysicalDeviceProperties(resource.physical_device, &properties);
+    device_type = vkc::query_memory_type(resource.physical_device,
+                                         vkc::MemoryUsage::DeviceLocal)
+                      .value();
+  }
+
+  void add(const std::string &benchmark, const std::string &config,
+           const std::string &metric, double value, const std::string &unit) {
+    fmt::print("{} [{}] {}: {:.3f} {}\n", benchmark, config, metric, value,
+               unit);
+    results.push_back({benchmark, config, metric, value, unit});
+  }
+
+  /* Whether `bytes` fit in one storage buffer binding. */
+  bool fits(size_t bytes, const std::string &config) {
+    if (bytes <= properties.limits.maxStorageBufferRange) {
+      return true;
+    }
+    spdlog::warn("Skipping {}: {} bytes exceeds maxStorageBufferRange", config,
+                 bytes);
+    return false;
+  }
+
+  /**
+   * @brief Submit a command buffer recorded by `record` for warmup and timed
+   * iterations, adding wall clock and (if available) GPU time results.
+   */
+  template <typename Fn>
+  void time_commands(const std::string &benchmark, const std::string &config,
+                     size_t elements, Fn &&record) {
+    VkCommandBuffer command_buffer =
+        vkc::create_command_buffer(resource.device, resource.command_pool);
+    VkCommandBufferBeginInfo begin_info{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    };
+    vkc::check(vkBeginCommandBuffer(command_buffer, &begin_info),
+               "Begin bench command buffer.");
+    profiler.begin_frame(command_buffer);
+    record(command_buffer);
+    vkc::check(vkEndCommandBuffer(command_buffer),
+               "End bench command buffer.");
+
+    queue.submit(command_buffer).wait(); // warmup
+    profiler.clear();
+    std::vector<double> wall_ms;
+    for (int iteration = 0; iteration < options.iterations; ++iteration) {
+      auto start = Clock::now();
+      queue.submit(command_buffer).wait();
+      wall_ms.push_back(elapsed_ms(start));
+      profiler.collect();
+    }
+    vkFreeCommandBuffers(resource.device, resource.command_pool, 1,
+                         &command_buffer);
+
+    std::sort(wall_ms.begin(), wall_ms.end());
+    double p50_ms = wall_ms[wall_ms.size() / 2];
+    add(benchmark, config, "wall_p50", p50_ms, "ms");
+    add(benchmark, config, "throughput", elements / (p50_ms * 1e3),
+        "Melem/s");
+    double gpu_ns = 0;
+    uint64_t gpu_bytes = 0;
+    for (const vkc::KernelStats &kernel : profiler.stats()) {
+      add(benchmark, config + " " + kernel.name, "gpu_p50", kernel.p50_ns / 1e3,
+          "us");
+      add(benchmark, config + " " + kernel.name, "bandwidth",
+          kernel.bandwidth(), "GB/s");
+      gpu_ns += kernel.p50_ns;
+      gpu_bytes += kernel.bytes / kernel.count;
+    }
+    if (gpu_ns > 0) {
+      add(benchmark, config, "gpu_p50", gpu_ns / 1e3, "us");
+      add(benchmark, config, "gpu_bandwidth", gpu_bytes / gpu_ns, "GB/s");
+    }
+  }
+
+  void softmax(size_t size) {
+    std::string config = fmt::format("n={}", size);
+    if (!fits(size * sizeof(float), config)) {
+      return;
+    }
+    {
+      vkc::Tensor input(resource.device, arena, device_type, {size});
+      vkc::Tensor output(resource.device, arena, device_type, {size});
+      vkc::copy_to_gpu(resource, input, random_input(size));
+      vkc::SoftmaxResource softmax =
+          vkc::create_softmax(resource.device, resource.physical_device, input,
+                              output, arena, device_type);
+      time_commands("softmax", config, size, [&](VkCommandBuffer &cmd) {
+        vkc::record_softmax(cmd, softmax, &profiler);
+      });
+    }
+    arena.trim();
+  }
+
+  void softmax_rows(uint32_t rows, uint32_t cols) {
+    std::string config = fmt::format("rows={} cols={}", rows, cols);
+    size_t size = static_cast<size_t>(rows) * cols;
+    if (!fits(size * sizeof(float), config)) {
+      return;
+    }
+    {
+      vkc::Tensor input(resource.device, arena, device_type, {rows, cols});
+      vkc::Tensor output(resource.device, arena, device_type, {rows, cols});
+      vkc::copy_to_gpu(resource, input, random_input(size));
+      vkc::SoftmaxRowsResource softmax = vkc::create_softmax_rows(
+          resource.device, resource.physical_device, resource.capabilities,
+          input, output);
+      time_commands("softmax_rows", config, size, [&](VkCommandBuffer &cmd) {
+        vkc::record_softmax_rows(cmd, softmax, &profiler);
+      });
+      std::vector<float> result(size);
+      vkc::copy_to_cpu(resource, output.buffer, output.allocation,
+                       result.data(), output.bytes());
+      add("softmax_rows", config, "max_abs_error",
+          vkc::max_abs_error(result, cpu_reference(rows, cols)), "");
+    }
+    arena.trim();
+  }
+
+  /* Row softmax on the CPU backend, vectorized and on every core. */
+  void cpu_softmax_rows(uint32_t rows, uint32_t cols) {
+    std::string config = fmt::format("rows={} cols={} width={} threads={}",
+                                     rows, cols, vkc::simd::width,
+                                     vkc::default_thread_pool().size());
+    size_t size = static_cast<size_t>(rows) * cols;
+    std::vector<float> input = random_input(size);
+    std::vector<float> output(size);
+    vkc::CpuSoftmax softmax(rows, cols);
+    softmax.run(input.data(), output.data()); // warmup
+    std::vector<double> wall_ms;
+    for (int iteration = 0; iteration < options.iterations; ++iteration) {
+      auto start = Clock::now();
+      softmax.run(input.data(), output.data());
+      wall_ms.push_back(elapsed_ms(start));
+    }
+    std::sort(wall_ms.begin(), wall_ms.end());
+    double p50_ms = wall_ms[wall_ms.size() / 2];
+    add("cpu_softmax_rows", config, "wall_p50", p50_ms, "ms");
+    add("cpu_softmax_rows", config, "throughput", size / (p50_ms * 1e3),
+        "Melem/s");
+  }
+
+  /**
+   * @brief End to end wall time of `runner` with each backend forced, for
+   * choosing RunnerOptions::min_gpu_elements.
+   */
+  void backend_crossover(size_t size) {
+    uint32_t cols = static_cast<uint32_t>(std::min<size_t>(size, 1024));
+    uint32_t rows = static_cast<uint32_t>(size / cols);
+    std::vector<float> input = random_input(size_t(rows) * cols);
+    std::vector<float> output(input.size());
+    for (vkc::Backend backend : {vkc::Backend::Cpu, vkc::Backend::Gpu}) {
+      std::string config =
+          fmt::format("rows={} cols={} backend={}", rows, cols,
+                      backend == vkc::Backend::Cpu ? "cpu" : "gpu");
+      vkc::SoftmaxRunner runner({.backend = backend,
+                                 .devices = options.devices});
+      runner.run(input.data(), output.data(), rows, cols); // warmup
+      std::vector<double> wall_ms;
+      for (int iteration = 0; iteration < options.iterations; ++iteration) {
+        auto start = Clock::now();
+        runner.run(input.data(), output.data(), rows, cols);
+        wall_ms.push_back(elapsed_ms(start));
+      }
+      std::sort(wall_ms.begin(), wall_ms.end());
+      add("backend_crossover", config, "wall_p50", wall_ms[wall_ms.size() / 2],
+          "ms");
+    }
+  }
+
+  /**
+   * @brief End to end (upload, compute, readback) row softmax sharded across
+   * 1 to `devices.size()` devices.
+   */
+  void sharded_softmax_rows(const std::vector<VkPhysicalDevice> &devices,
+                            uint32_t rows, uint32_t cols) {
+    size_t size = static_cast<size_t>(rows) * cols;
+    std::vector<float> input = random_input(size);
+    std::vector<float> output(size);
+    for (size_t n = 1; n <= devices.size(); ++n) {
+      std::string config =
+          fmt::format("rows={} cols={} shards={}", rows, cols, n);
+      vkc::MultiDeviceSoftmax softmax(
+          resource.instance,
+          std::vector<VkPhysicalDevice>(devices.begin(), devices.begin() + n),
+          rows, cols);
+      softmax.run(input.data(), output.data()); // warmup
+      std::vector<double> wall_ms;
+      for (int iteration = 0; iteration < options.iterations; ++iteration) {
+        auto start = Clock::now();
+        softmax.run(input.data(), output.data());
+        wall_ms.push_back(elapsed_ms(start));
+      }
+      std::sort(wall_ms.begin(), wall_ms.end());
+      double p50_ms = wall_ms[wall_ms.size() / 2];
+      add("sharded_softmax_rows", config, "wall_p50", p50_ms, "ms");
+      add("sharded_softmax_rows", config, "throughput",
+          size / (p50_ms * 1e3), "Melem/s");
+      add("sharded_softmax_rows", config, "max_abs_error",
+          vkc::max_abs_error(output, cpu_reference(rows, cols)), "");
+    }
+  }
+
+  /**
+   * @brief Request throughput with `n_threads` workers each recording small
+   * command buffers from their own pool and submitting them through a
+   * BatchSubmitter.
+   */
+  void batched_submission(size_t n_threads, size_t per_thread = 1000) {
+    std::string config = fmt::format("threads={}", n_threads);
+    vkc::ThreadCommandPools pools(resource.device, resource.queue_family);
+    double ms;
+    size_t n_submits;
+    {
+      vkc::BatchSubmitter submitter(queue);
+      auto worker = [&] {
+        std::vector<vkc::ThreadCommandPools::CommandBuffer> command_buffers;
+        std::vector<std::future<vkc::Submission>> futures;
+        for (size_t idx = 0; idx < per_thread; ++idx) {
+          vkc::ThreadCommandPools::CommandBuffer command_buffer =
+              pools.acquire();
+          VkCommandBuffer handle = command_buffer;
+          VkCommandBufferBeginInfo begin_info{
+              .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+              .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+          };
+          vkc::check(vkBeginCommandBuffer(handle, &begin_info),
+                     "Begin bench command buffer.");
+          vkc::host_read_barrier(handle);
+          vkc::check(vkEndCommandBuffer(handle), "End bench command buffer.");
+          futures.push_back(submitter.submit(handle));
+          command_buffers.push_back(command_buffer);
+        }
+        for (auto &future : futures) {
+          future.get().wait();
+        }
+        for (auto &command_buffer : command_buffers) {
+          pools.release(command_buffer);
+        }
+      };
+      auto start = Clock::now();
+      std::vector<std::thread> threads;
+      for (size_t idx = 0; idx < n_threads; ++idx) {
+        threads.emplace_back(worker);
+      }
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+      ms = elapsed_ms(start);
+      n_submits = submitter.submit_count();
+    }
+    size_t n_requests = n_threads * per_thread;
+    add("batched_submission", config, "throughput", n_requests / ms * 1e3,
+        "requests/s");
+    add("batched_submission", config, "batch_size",
+        static_cast<double>(n_requests) / std::max<size_t>(1, n_submits),
+        "requests");
+  }
+
+  /**
+   * @brief Throughput and latency of small softmax requests (256 to 4096
+   * elements) from `n_clients` threads through a SoftmaxBatcher. A window of
+   * 0 dispatches whatever is queued as soon as the scheduler sees it.
+   */
+  void micro_batching(size_t n_clients, std::chrono::microseconds window,
+                      size_t per_client = 500) {
+    std::string config = fmt::format("clients={} window={}us", n_clients,
+                                     window.count());
+    std::vector<float> data = random_input(4096);
+    vkc::BatcherMetrics metrics;
+    std::vector<double> latency_us(n_clients * per_client);
+    auto start = Clock::now();
+    {
+      vkc::SoftmaxBatcher batcher(resource, queue, arena,
+                                  {.window = window,
+                                   .max_elements = 1 << 18,
+                                   .max_rows = 256});
+      std::vector<std::thread> clients;
+      for (size_t client = 0; client < n_clients; ++client) {
+        clients.emplace_back([&, client] {
+          for (size_t idx = 0; idx < per_client; ++idx) {
+            size_t size = 256 << ((client + idx) % 5);
+            auto request_start = Clock::now();
+            batcher.submit(data.data(), size).get();
+            latency_us[client * per_client + idx] =
+                elapsed_ms(request_start) * 1e3;
+          }
+        });
+      }
+      for (std::thread &thread : clients) {
+        thread.join();
+      }
+      metrics = batcher.metrics();
+    }
+    double ms = elapsed_ms(start);
+    arena.trim();
+    std::sort(latency_us.begin(), latency_us.end());
+    add("micro_batching", config, "throughput",
+        metrics.requests / ms * 1e3, "requests/s");
+    add("micro_batching", config, "latency_p50",
+        latency_us[latency_us.size() / 2], "us");
+    add("micro_batching", config, "latency_p99",
+        latency_us[latency_us.size() * 99 / 100], "us");
+    add("micro_batching", config, "batch_rows", metrics.mean_rows,
+        "requests");
+    add("micro_batching", config, "batch_fill", metrics.mean_fill * 100, "%");
+    add("micro_batching", config, "queue_delay", metrics.mean_queue_delay_us,
+        "us");
+  }
+
+  /**
+   * @brief Host to device and device to host bandwidth of copy_to_gpu and
+   * copy_to_cpu for each memory type selected by query_memory_type.
+   */
+  void transfers(size_t bytes) {
+    const std::pair<vkc::MemoryUsage, const char *> usages[] = {
+        {vkc::MemoryUsage::DeviceLocal, "device_local"},
+        {vkc::MemoryUsage::Upload, "upload"},
+        {vkc::MemoryUsage::Readback, "readback"},
+    };
+    std::set<uint32_t> measured;
+    size_t size = bytes / sizeof(float);
+    std::vector<float> data = random_input(size);
+    for (auto &[usage, usage_name] : usages) {
+      std::optional<uint32_t> memory_type =
+          vkc::query_memory_type(resource.physical_device, usage);
+      if (!memory_type || !measured.insert(memory_type.value()).second) {
+        continue;
+      }
+      std::string config =
+          fmt::format("{} (type {}) bytes={}", usage_name,
+                      memory_type.value(), size * sizeof(float));
+      {
+        vkc::Tensor tensor(resource.device, arena, memory_type.value(),
+                           {size});
+        vkc::copy_to_gpu(resource, tensor, data); // warmup
+        double upload_ms = 0;
+        double readback_ms = 0;
+        for (int iteration = 0; iteration < options.iterations; ++iteration) {
+          auto start = Clock::now();
+          vkc::copy_to_gpu(resource, tensor, data);
+          upload_ms += elapsed_ms(start);
+          start = Clock::now();
+          vkc::copy_to_cpu(resource, tensor, data);
+          readback_ms += elapsed_ms(start);
+        }
+        double total_bytes =
+            static_cast<double>(tensor.bytes()) * options.iterations;
+        add("transfer", config, "host_to_device", total_bytes / upload_ms / 1e6,
+            "GB/s");
+        add("transfer", config, "device_to_host",
+            total_bytes / readback_ms / 1e6, "GB/s");
+      }
+      arena.trim();
+    }
+  }
+
+  /* Pipeline creation latency without a cache, and cold and warm with one. */
+  void pipeline_creation() {
+    vkc::Tensor input(resource.device, arena, device_type, {1024});
+    vkc::Tensor output(resource.device, arena, device_type, {1024});
+    auto time_creation = [&](const char *config, vkc::PipelineCache *cache) {
+      auto start = Clock::now();
+      vkc::create_softmax(resource.device, resource.physical_device, input,
+                          output, arena, device_type, cache);
+      add("setup", config, "softmax_pipelines", elapsed_ms(start), "ms");
+    };
+    time_creation("no cache", nullptr);
+    const std::string cache_path = "build/bench_pipeline_cache.bin";
+    std::remove(cache_path.c_str());
+    vkc::PipelineCache cache(resource.device, resource.physical_device,
+                             cache_path);
+    time_creation("cold cache", &cache);
+    time_creation("warm cache", &cache);
+  }
+
+  void write(const std::string &path) const {
+    const VkPhysicalDeviceProperties &props = properties;
+    bool csv =
+        path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    std::string text;
+    if (csv) {
+      text = "benchmark,config,metric,value,unit\n";
+      for (const BenchResult &result : results) {
+        text += fmt::format("{},\"{}\",{},{:.6g},{}\n", result.benchmark,
+                            result.config, result.metric, result.value,
+                            result.unit);
+      }
+    } else {
+      text = fmt::format(
+          "{{\"device\": \"{}\", \"driver_version\": {}, \"api_version\": "
+          "\"{}.{}.{}\", \"iterations\": {}, \"results\": [",
+          props.deviceName, props.driverVersion,
+          VK_API_VERSION_MAJOR(props.apiVersion),
+          VK_API_VERSION_MINOR(props.apiVersion),
+          VK_API_VERSION_PATCH(props.apiVersion), options.iterations);
+      for (size_t idx = 0; idx < results.size(); ++idx) {
+        const BenchResult &result = results[idx];
+        text += fmt::format(
+            "{}\n  {{\"benchmark\": \"{}\", \"config\": \"{}\", \"metric\": "
+            "\"{}\", \"value\": {:.6g}, \"unit\": \"{}\"}}",
+            idx ? "," : "", result.benchmark, result.config, result.metric,
+            result.value, result.unit);
+      }
+      text += "\n]}\n";
+    }
+    std::ofstream file(path);
+    if (!file.is_open()) {
+      throw std::runtime_error("Failed to open bench output: " + path);
+    }
+    file << text;
+    fmt::print("Wrote {} results to {}\n", results.size(), path);
+  }
+
+  std::vector<BenchResult> results;
+
+private:
+  /* CPU softmax of random_input(rows * cols), the expected GPU result. */
+  std::vector<float> cpu_reference(uint32_t rows, uint32_t cols) {
+    return vkc::CpuSoftmax(rows, cols).run(random_input(size_t(rows) * cols));
+  }
+
+  std::vector<float> random_input(size_t size) {
+    std::vector<float> data(size);
+    uint32_t state = 1;
+    for (float &x : data) {
+      state = state * 1664525u + 1013904223u; // LCG, deterministic
+      x = static_cast<float>(state >> 8) / static_cast<float>(1u << 24) * 8.0f;
+    }
+    return data;
+  }
+
+  vkc::DeviceResource &resource;
+  vkc::MemoryArena &arena;
+  const BenchOptions &options;
+  vkc::AsyncQueue queue;
+  vkc::Profiler profiler;
+  VkPhysicalDeviceProperties properties;
+  uint32_t device_type;
+};
+
+int main(int argc, char **argv) {
+  // Results are printed to stdout, setup messages are not
+  vkc::setup_logging({.level = spdlog::level::warn});
+  BenchOptions options = parse_options(argc, argv);
+
+  /*
+   * Setup latency of the instance and device, measured as the program sees
+   * it.
+   */
+
+  auto start = Clock::now();
+  VkInstance instance =
+      vkc::create_vulkan_instance(VK_MAKE_API_VERSION(1, 3, 236, 0));
+  vkc::UniqueInstance instance_owner(instance);
+  double instance_ms = elapsed_ms(start);
+  start = Clock::now();
+  VkPhysicalDevice physical_device = vkc::select_physical_device(instance);
+  uint32_t qfidx = vkc::find_queue_family(physical_device);
+  vkc::DeviceCapabilities capabilities;
+  VkDevice device =
+      vkc::create_logical_device(physical_device, qfidx, &capabilities);
+  vkc::UniqueDevice device_owner(device);
+  double device_ms = elapsed_ms(start);
+
+  VkQueue queue;
+  vkGetDeviceQueue(device, qfidx, 0, &queue);
+  VkCommandPool command_pool = vkc::create_command_pool(device, qfidx);
+  vkc::UniqueCommandPool command_pool_owner(device, command_pool);
+  vkc::DeviceResource resource{
+      .instance = instance,
+      .physical_device = physical_device,
+      .device = device,
+      .queue_family = qfidx,
+      .queue = queue,
+      .command_pool = command_pool,
+      .capabilities = capabilities,
+  };
+
+  {
+    vkc::MemoryArena arena(device, physical_device, vkc::ArenaMode::FreeList);
+    Bench bench(resource, arena, options);
+    bench.add("setup", "", "instance", instance_ms, "ms");
+    bench.add("setup", "", "device", device_ms, "ms");
+    bench.pipeline_creation();
+
+    for (size_t size = 1'000; size <= options.max_size; size *= 10) {
+      bench.softmax(size);
+    }
+    const std::pair<uint32_t, uint32_t> batch_shapes[] = {
+        {32768, 128}, {4096, 1024}, {1024, 4096}, {64, 65536}, {8, 1 << 20},
+    };
+    for (auto &[rows, cols] : batch_shapes) {
+      if (static_cast<size_t>(rows) * cols <= options.max_size) {
+        bench.softmax_rows(rows, cols);
+        bench.cpu_softmax_rows(rows, cols);
+      }
+    }
+    for (size_t size = 1 << 10; size <= std::min<size_t>(options.max_size,
+                                                        1 << 24);
+         size *= 4) {
+      bench.backend_crossover(size);
+    }
+    bench.transfers(std::min<size_t>(64 << 20, options.max_size * 4));
+    for (size_t n_threads = 1;
+         n_threads <= std::max(1u, std::thread::hardware_concurrency());
+         n_threads *= 2) {
+      bench.batched_submission(n_threads);
+    }
+    for (size_t n_clients : {1, 8, 64}) {
+      for (auto window : {std::chrono::microseconds(0),
+                          std::chrono::microseconds(200)}) {
+        bench.micro_batching(n_clients, window);
+      }
+    }
+
+    std::vector<VkPhysicalDevice> devices =
+        vkc::select_physical_devices(instance, options.devices);
+    std::vector<VkPhysicalDevice> shard_devices = devices;
+    if (options.shards > 0) {
+      shard_devices.clear();
+      for (size_t idx = 0; idx < options.shards; ++idx) {
+        shard_devices.push_back(devices[idx % devices.size()]);
+      }
+    }
+    if (options.max_size >= 4096 * 1024) {
+      bench.sharded_softmax_rows(shard_devices, 4096, 1024);
+    }
+    bench.write(options.output);
+  }
+  return 0;
+}
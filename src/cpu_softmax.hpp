@@ -0,0 +1,396 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace vkc {
+
+/**
+ * @brief Fixed width float vectors for the CPU softmax.
+ *
+ * Built on the GCC/Clang vector extensions, which the compiler lowers to
+ * AVX-512, AVX2, SSE or NEON instructions, so one implementation serves every
+ * target. The width follows the instruction set the translation unit is
+ * compiled for (see VKCOMPUTE_NATIVE_ARCH in CMakeLists.txt).
+ */
+namespace simd {
+
+#if defined(__AVX512F__)
+constexpr size_t width = 16;
+#elif defined(__AVX__)
+constexpr size_t width = 8;
+#else
+constexpr size_t width = 4; // SSE2, NEON
+#endif
+
+typedef float f32x __attribute__((vector_size(width * sizeof(float))));
+typedef int32_t i32x __attribute__((vector_size(width * sizeof(int32_t))));
+
+f32x load(const float *data) {
+  f32x v;
+  std::memcpy(&v, data, sizeof(v));
+  return v;
+}
+
+void store(float *data, f32x v) { std::memcpy(data, &v, sizeof(v)); }
+
+f32x splat(float x) { return f32x{} + x; }
+
+/* Lanes of `a` where `mask` is set, of `b` elsewhere. */
+f32x select(i32x mask, f32x a, f32x b) {
+  return (f32x)((mask & (i32x)a) | (~mask & (i32x)b));
+}
+
+f32x max(f32x a, f32x b) { return select(a > b, a, b); }
+f32x min(f32x a, f32x b) { return select(a < b, a, b); }
+
+float reduce_max(f32x v) {
+  float m = v[0];
+  for (size_t idx = 1; idx < width; ++idx) {
+    m = std::max(m, v[idx]);
+  }
+  return m;
+}
+
+float reduce_add(f32x v) {
+  float s = 0;
+  for (size_t idx = 0; idx < width; ++idx) {
+    s += v[idx];
+  }
+  return s;
+}
+
+/**
+ * @brief exp(x) with a degree 6 polynomial after range reduction to
+ * [-ln2/2, ln2/2] (the Cephes expf coefficients), about 2 ulp. Inputs are
+ * clamped to [-87.3, 88.3], so results stay normal floats.
+ */
+f32x exp(f32x x) {
+  x = min(max(x, splat(-87.3f)), splat(88.3f));
+  // n = floor(x / ln2 + 1/2); truncation rounds negative values up
+  f32x fx = x * splat(1.44269504088896341f) + splat(0.5f);
+  i32x n = __builtin_convertvector(fx, i32x);
+  n += __builtin_convertvector(n, f32x) > fx; // true is -1
+  f32x fn = __builtin_convertvector(n, f32x);
+  // r = x - n ln2, with ln2 split in two for precision
+  f32x r = x - fn * splat(0.693359375f) + fn * splat(2.12194440e-4f);
+  f32x p = splat(1.9875691500e-4f);
+  p = p * r + splat(1.3981999507e-3f);
+  p = p * r + splat(8.3334519073e-3f);
+  p = p * r + splat(4.1665795894e-2f);
+  p = p * r + splat(1.6666665459e-1f);
+  p = p * r + splat(5.0000001201e-1f);
+  p = p * r * r + r + splat(1.0f);
+  // Scale by 2^n through the exponent bits
+  return p * (f32x)((n + 127) << 23);
+}
+
+} // namespace simd
+
+/* Largest element of `data[0..n)`. */
+float cpu_max(const float *data, size_t n) {
+  simd::f32x m = simd::splat(-3.402823466e+38f);
+  size_t idx = 0;
+  for (; idx + simd::width <= n; idx += simd::width) {
+    m = simd::max(m, simd::load(data + idx));
+  }
+  float result = simd::reduce_max(m);
+  for (; idx < n; ++idx) {
+    result = std::max(result, data[idx]);
+  }
+  return result;
+}
+
+/* out[i] = exp(in[i] * scale - shift) for i < n, returning their sum. */
+float cpu_exp_sum(const float *in, float *out, size_t n, float scale,
+                  float shift) {
+  const simd::f32x scale_v = simd::splat(scale);
+  const simd::f32x shift_v = simd::splat(shift);
+  simd::f32x sum = simd::splat(0.0f);
+  size_t idx = 0;
+  for (; idx + simd::width <= n; idx += simd::width) {
+    simd::f32x e = simd::exp(simd::load(in + idx) * scale_v - shift_v);
+    simd::store(out + idx, e);
+    sum += e;
+  }
+  float result = simd::reduce_add(sum);
+  if (idx < n) {
+    // The tail goes through the same exp, so every element matches
+    float tail[simd::width] = {};
+    std::memcpy(tail, in + idx, (n - idx) * sizeof(float));
+    simd::f32x e = simd::exp(simd::load(tail) * scale_v - shift_v);
+    simd::store(tail, e);
+    for (size_t lane = 0; lane < n - idx; ++lane) {
+      out[idx + lane] = tail[lane];
+      result += tail[lane];
+    }
+  }
+  return result;
+}
+
+/* data[i] *= factor for i < n. */
+void cpu_scale(float *data, size_t n, float factor) {
+  const simd::f32x factor_v = simd::splat(factor);
+  size_t idx = 0;
+  for (; idx + simd::width <= n; idx += simd::width) {
+    simd::store(data + idx, simd::load(data + idx) * factor_v);
+  }
+  for (; idx < n; ++idx) {
+    data[idx] *= factor;
+  }
+}
+
+/* Softmax of one row of `n` elements on the calling thread. */
+void cpu_softmax(const float *in, float *out, size_t n,
+                 float temperature = 1.0f) {
+  const float scale = 1.0f / temperature;
+  const float sum = cpu_exp_sum(in, out, n, scale, cpu_max(in, n) * scale);
+  cpu_scale(out, n, 1.0f / sum);
+}
+
+/**
+ * @brief A fixed set of worker threads running parallel loops.
+ *
+ * parallel_for hands out indices from a shared counter to the workers and
+ * the calling thread, and returns once all of them are done. Calls from
+ * several threads are run one at a time.
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t n_threads = std::thread::hardware_concurrency()) {
+    for (size_t idx = 1; idx < std::max<size_t>(1, n_threads); ++idx) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    start.notify_all();
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  /* Threads running each loop, including the caller. */
+  size_t size() const { return workers.size() + 1; }
+
+  /**
+   * @brief Run `fn(idx)` for every idx in [0, n) and wait for all of them.
+   * Rethrows the first exception thrown by `fn`.
+   */
+  void parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+    if (n <= 1 || workers.empty()) {
+      for (size_t idx = 0; idx < n; ++idx) {
+        fn(idx);
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> call_lock(call_mutex);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &fn;
+      job_size = n;
+      next.store(0);
+      active = workers.size();
+      error = nullptr;
+      generation++;
+    }
+    start.notify_all();
+    run_job(fn, n);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return active == 0; });
+    job = nullptr;
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  void run_job(const std::function<void(size_t)> &fn, size_t n) {
+    for (size_t idx = next++; idx < n; idx = next++) {
+      try {
+        fn(idx);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+  }
+
+  void work() {
+    uint64_t seen = 0;
+    while (true) {
+      const std::function<void(size_t)> *fn;
+      size_t n;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        start.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = generation;
+        fn = job;
+        n = job_size;
+      }
+      run_job(*fn, n);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        active--;
+      }
+      done.notify_one();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex call_mutex; // one parallel_for at a time
+  std::mutex mutex;
+  std::condition_variable start;
+  std::condition_variable done;
+  const std::function<void(size_t)> *job = nullptr;
+  size_t job_size = 0;
+  std::atomic<size_t> next{0};
+  size_t active = 0;
+  uint64_t generation = 0;
+  bool stopping = false;
+  std::exception_ptr error;
+};
+
+/* A pool with one thread per core, created on first use. */
+ThreadPool &default_thread_pool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+/**
+ * @brief Softmax of each row of a row-major [rows, cols] buffer on the CPU.
+ *
+ * With at least as many rows as threads, each thread takes a block of whole
+ * rows. Fewer, longer rows are split into chunks: the chunks' maxima are
+ * found in parallel, then each chunk writes its exponentials and partial sum,
+ * and a last parallel pass scales by the row's total. Inputs under
+ * `min_parallel` elements stay on the calling thread.
+ */
+void cpu_softmax_rows(ThreadPool &pool, const float *in, float *out,
+                      size_t rows, size_t cols, float temperature = 1.0f,
+                      size_t min_parallel = 1 << 15) {
+  const size_t elements = rows * cols;
+  if (elements < min_parallel || pool.size() == 1) {
+    for (size_t row = 0; row < rows; ++row) {
+      cpu_softmax(in + row * cols, out + row * cols, cols, temperature);
+    }
+    return;
+  }
+
+  if (rows >= pool.size()) {
+    // A few blocks per thread balances rows finishing at different times
+    const size_t n_blocks = std::min(rows, pool.size() * 4);
+    pool.parallel_for(n_blocks, [&](size_t block) {
+      for (size_t row = block * rows / n_blocks;
+           row < (block + 1) * rows / n_blocks; ++row) {
+        cpu_softmax(in + row * cols, out + row * cols, cols, temperature);
+      }
+    });
+    return;
+  }
+
+  const size_t chunk = std::max<size_t>(
+      1 << 14,
+      (cols / (pool.size() * 2) + simd::width - 1) / simd::width *
+          simd::width);
+  const size_t n_chunks = (cols + chunk - 1) / chunk;
+  const float scale = 1.0f / temperature;
+  std::vector<float> partial(n_chunks);
+  for (size_t row = 0; row < rows; ++row) {
+    const float *x = in + row * cols;
+    float *y = out + row * cols;
+    auto chunk_size = [&](size_t idx) {
+      return std::min(chunk, cols - idx * chunk);
+    };
+    pool.parallel_for(n_chunks, [&](size_t idx) {
+      partial[idx] = cpu_max(x + idx * chunk, chunk_size(idx));
+    });
+    const float shift =
+        *std::max_element(partial.begin(), partial.end()) * scale;
+    pool.parallel_for(n_chunks, [&](size_t idx) {
+      partial[idx] = cpu_exp_sum(x + idx * chunk, y + idx * chunk,
+                                 chunk_size(idx), scale, shift);
+    });
+    float sum = 0;
+    for (float s : partial) {
+      sum += s;
+    }
+    pool.parallel_for(n_chunks, [&](size_t idx) {
+      cpu_scale(y + idx * chunk, chunk_size(idx), 1.0f / sum);
+    });
+  }
+}
+
+/**
+ * @brief Row softmax over a [rows, cols] batch on the CPU, with the same
+ * host API as MultiDeviceSoftmax so either can serve a call, see
+ * SoftmaxRunner. Also a fast reference for checking GPU results.
+ */
+class CpuSoftmax {
+public:
+  CpuSoftmax(uint32_t rows, uint32_t cols, float temperature = 1.0f,
+             ThreadPool &pool = default_thread_pool())
+      : n_rows(rows), n_cols(cols), temperature(temperature), pool(pool) {
+    if (rows == 0 || cols == 0) {
+      throw std::invalid_argument("CPU softmax needs rows and columns.");
+    }
+  }
+
+  void run(const float *input, float *output) {
+    cpu_softmax_rows(pool, input, output, n_rows, n_cols, temperature);
+  }
+
+  std::vector<float> run(const std::vector<float> &input) {
+    if (input.size() != size_t(n_rows) * n_cols) {
+      throw std::invalid_argument("CPU softmax input size mismatch.");
+    }
+    std::vector<float> output(input.size());
+    run(input.data(), output.data());
+    return output;
+  }
+
+  uint32_t rows() const { return n_rows; }
+  uint32_t cols() const { return n_cols; }
+
+private:
+  uint32_t n_rows;
+  uint32_t n_cols;
+  float temperature;
+  ThreadPool &pool;
+};
+
+/* Largest element-wise difference, e.g. of GPU results from CpuSoftmax. */
+float max_abs_error(const std::vector<float> &a, const std::vector<float> &b) {
+  if (a.size() != b.size()) {
+    throw std::invalid_argument("Compared results differ in size.");
+  }
+  float error = 0;
+  for (size_t idx = 0; idx < a.size(); ++idx) {
+    error = std::max(error, std::fabs(a[idx] - b[idx]));
+  }
+  return error;
+}
+
+} // namespace vkc
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "vkcompute.hpp"
+
+namespace vkc {
+
+/**
+ * @brief How a graph node uses a buffer.
+ */
+enum class Access { Read, Write, ReadWrite };
+
+struct BufferAccess {
+  VkBuffer buffer;
+  Access access;
+};
+
+/**
+ * @brief A compute dispatch in a ComputeGraph.
+ *
+ * `buffers` lists every buffer the kernel reads or writes through
+ * `descriptor_set`; the graph derives its barriers from them. The descriptor
+ * set is not copied and must outlive the graph. `bytes` is only used for the
+ * profiler's bandwidth figures.
+ */
+struct GraphKernel {
+  std::string name;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  const DescriptorSet *descriptor_set = nullptr;
+  std::vector<BufferAccess> buffers;
+  std::array<uint32_t, 3> workgroups = {1, 1, 1};
+  uint64_t bytes = 0;
+};
+
+/**
+ * @brief A fixed sequence of kernels and buffer copies recorded once into a
+ * reusable command buffer and replayed with submit().
+ *
+ * Nodes run in the order they are added. Dependencies are not declared:
+ * before each node the graph inserts a single vkCmdPipelineBarrier covering
+ * every read-after-write, write-after-write and write-after-read hazard on
+ * the node's buffers, and no barrier at all when there is none, so
+ * independent kernels can overlap. A barrier orders its sources before, and
+ * makes their writes visible to, every stage the graph uses (compute and
+ * transfer), so each buffer barrier is emitted once even if several later
+ * nodes of either kind read the buffer. After the last node, pending writes
+ * are made visible to the host.
+ *
+ * Pipeline and descriptor set binds are skipped when a node uses the same
+ * ones as the previous node.
+ */
+class ComputeGraph {
+public:
+  explicit ComputeGraph(DeviceResource &resource) : resource(resource) {}
+
+  ComputeGraph(const ComputeGraph &) = delete;
+  ComputeGraph &operator=(const ComputeGraph &) = delete;
+
+  ~ComputeGraph() {
+    last_submission.wait();
+    if (command_buffer != VK_NULL_HANDLE) {
+      vkFreeCommandBuffers(resource.device, resource.command_pool, 1,
+                           &command_buffer);
+    }
+  }
+
+  /* Add a dispatch of `kernel`. Returns the node index. */
+  size_t add(GraphKernel kernel) {
+    Node node;
+    node.kernel = std::move(kernel);
+    node.stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    node.buffers = node.kernel.buffers;
+    return add(std::move(node));
+  }
+
+  /* Add a dispatch of `kernel` with `params` as its push constants. */
+  template <typename T> size_t add(GraphKernel kernel, const T &params) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Push constants are copied byte for byte.");
+    static_assert(sizeof(T) <= 128, "Push constants are limited to 128 bytes.");
+    Node node;
+    node.kernel = std::move(kernel);
+    node.stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    node.buffers = node.kernel.buffers;
+    node.push_constants.resize(sizeof(T));
+    std::memcpy(node.push_constants.data(), &params, sizeof(T));
+    return add(std::move(node));
+  }
+
+  /* Add a copy of the first `bytes` bytes of `src` to `dst`. */
+  size_t add_copy(const std::string &name, VkBuffer src, VkBuffer dst,
+                  VkDeviceSize bytes) {
+    Node node;
+    node.kernel.name = name;
+    node.kernel.bytes = 2 * bytes;
+    node.stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    node.buffers = {{src, Access::Read}, {dst, Access::Write}};
+    node.copy_bytes = bytes;
+    return add(std::move(node));
+  }
+
+  /**
+   * @brief Record the graph into `command_buffer`, which must be in the
+   * recording state. With a `profiler`, each node is timed as its own
+   * kernel; the caller starts the profiler frame.
+   */
+  void record(VkCommandBuffer command_buffer, Profiler *profiler = nullptr) {
+    // Replays of the graph may follow each other without a host wait, so
+    // the previous replay's writes are ordered before this one's accesses.
+    const VkPipelineStageFlags graph_stages =
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+    const VkAccessFlags graph_access =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+        VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    VkMemoryBarrier replay_barrier{
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask =
+            VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = graph_access,
+    };
+    vkCmdPipelineBarrier(command_buffer, graph_stages, graph_stages, 0, 1,
+                         &replay_barrier, 0, nullptr, 0, nullptr);
+
+    std::map<VkBuffer, BufferState> states;
+    VkPipelineStageFlags epoch_stages = 0; // stages run since the last barrier
+    uint64_t epoch = 1;
+    VkPipeline bound_pipeline = VK_NULL_HANDLE;
+    const DescriptorSet *bound_set = nullptr;
+    n_barriers = 0;
+
+    for (Node &node : nodes) {
+      std::vector<VkBufferMemoryBarrier> barriers;
+      VkPipelineStageFlags src_stages = epoch_stages;
+      bool execution_dependency = false;
+      // Barriers target every graph stage rather than just this node's, so
+      // a write made visible here is visible to later nodes of any stage,
+      // and reads before the barrier are ordered before all of them
+      for (const BufferAccess &access : node.buffers) {
+        BufferState &state = states[access.buffer];
+        if (state.write_access != 0) {
+          // RAW or WAW, the write must be made visible
+          src_stages |= state.write_stage;
+          barriers.push_back({
+              .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+              .srcAccessMask = state.write_access,
+              .dstAccessMask = graph_access,
+              .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+              .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+              .buffer = access.buffer,
+              .offset = 0,
+              .size = VK_WHOLE_SIZE,
+          });
+          state.write_access = 0;
+        } else if (access.access != Access::Read &&
+                   state.read_epoch == epoch) {
+          // WAR only needs the reads to finish first
+          execution_dependency = true;
+        }
+      }
+      if (!barriers.empty() || execution_dependency) {
+        vkCmdPipelineBarrier(command_buffer, src_stages, graph_stages, 0, 0,
+                             nullptr, static_cast<uint32_t>(barriers.size()),
+                             barriers.data(), 0, nullptr);
+        n_barriers++;
+        epoch++;
+        epoch_stages = 0;
+      }
+      for (const BufferAccess &access : node.buffers) {
+        BufferState &state = states[access.buffer];
+        if (access.access != Access::Read) {
+          state.write_access = access_mask(node.stage, Access::Write);
+          state.write_stage = node.stage;
+        }
+        if (access.access != Access::Write) {
+          state.read_epoch = epoch;
+        }
+      }
+      epoch_stages |= node.stage;
+
+      uint32_t scope = profiler ? profiler->begin(command_buffer,
+                                                  node.kernel.name,
+                                                  node.kernel.bytes)
+                                : 0;
+      if (node.stage == VK_PIPELINE_STAGE_TRANSFER_BIT) {
+        VkBufferCopy region{.srcOffset = 0, .dstOffset = 0,
+                            .size = node.copy_bytes};
+        vkCmdCopyBuffer(command_buffer, node.buffers[0].buffer,
+                        node.buffers[1].buffer, 1, &region);
+      } else {
+        const GraphKernel &kernel = node.kernel;
+        if (kernel.pipeline != bound_pipeline) {
+          vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            kernel.pipeline);
+          bound_pipeline = kernel.pipeline;
+        }
+        if (kernel.descriptor_set != bound_set) {
+          bind_descriptor_set(command_buffer, kernel.pipeline_layout,
+                              *kernel.descriptor_set);
+          bound_set = kernel.descriptor_set;
+        }
+        if (!node.push_constants.empty()) {
+          vkCmdPushConstants(command_buffer, kernel.pipeline_layout,
+                             VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                             static_cast<uint32_t>(node.push_constants.size()),
+                             node.push_constants.data());
+        }
+        vkCmdDispatch(command_buffer, kernel.workgroups[0],
+                      kernel.workgroups[1], kernel.workgroups[2]);
+      }
+      if (profiler) {
+        profiler->end(command_buffer, scope);
+      }
+    }
+
+    // One barrier making every output readable by the host
+    VkAccessFlags pending_writes = 0;
+    for (auto &[buffer, state] : states) {
+      pending_writes |= state.write_access;
+    }
+    if (pending_writes != 0) {
+      host_read_barrier(command_buffer, graph_stages, pending_writes);
+      n_barriers++;
+    }
+  }
+
+  /**
+   * @brief Record the graph into its own command buffer. Called by submit()
+   * when nodes were added since the last compile. The profiler given to the
+   * first compile is kept for later ones.
+   */
+  void compile(Profiler *profiler = nullptr) {
+    last_submission.wait();
+    if (profiler) {
+      graph_profiler = profiler;
+    }
+    profiler = graph_profiler;
+    // The command pool may lack RESET_COMMAND_BUFFER_BIT, so a recompile
+    // records into a new buffer rather than resetting the old one
+    if (command_buffer != VK_NULL_HANDLE) {
+      vkFreeCommandBuffers(resource.device, resource.command_pool, 1,
+                           &command_buffer);
+      command_buffer = VK_NULL_HANDLE;
+    }
+    command_buffer =
+        create_command_buffer(resource.device, resource.command_pool);
+    VkCommandBufferBeginInfo begin_info{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT,
+    };
+    check(vkBeginCommandBuffer(command_buffer, &begin_info),
+          "Begin graph command buffer.");
+    if (profiler) {
+      profiler->begin_frame(command_buffer);
+    }
+    record(command_buffer, profiler);
+    check(vkEndCommandBuffer(command_buffer), "End graph command buffer.");
+    compiled = true;
+    SPDLOG_DEBUG("Compute graph of {} nodes with {} barriers", nodes.size(),
+                 n_barriers);
+  }
+
+  /* Replay the recorded graph, compiling it first if needed. */
+  Submission submit(AsyncQueue &queue,
+                    const std::vector<Submission> &dependencies = {}) {
+    if (!compiled) {
+      compile();
+    }
+    last_submission = queue.submit(command_buffer, dependencies);
+    return last_submission;
+  }
+
+  size_t size() const { return nodes.size(); }
+  /* Barriers in the last recording, including the host read barrier. */
+  size_t barrier_count() const { return n_barriers; }
+
+private:
+  struct Node {
+    GraphKernel kernel;
+    VkPipelineStageFlags stage;
+    std::vector<BufferAccess> buffers;
+    std::vector<uint8_t> push_constants;
+    VkDeviceSize copy_bytes = 0;
+  };
+
+  struct BufferState {
+    VkAccessFlags write_access = 0; // write not yet made visible
+    VkPipelineStageFlags write_stage = 0;
+    uint64_t read_epoch = 0;        // epoch of the last read
+  };
+
+  static VkAccessFlags access_mask(VkPipelineStageFlags stage, Access access) {
+    const bool transfer = stage == VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkAccessFlags mask = 0;
+    if (access != Access::Write) {
+      mask |=
+          transfer ? VK_ACCESS_TRANSFER_READ_BIT : VK_ACCESS_SHADER_READ_BIT;
+    }
+    if (access != Access::Read) {
+      mask |=
+          transfer ? VK_ACCESS_TRANSFER_WRITE_BIT : VK_ACCESS_SHADER_WRITE_BIT;
+    }
+    return mask;
+  }
+
+  size_t add(Node node) {
+    if (node.stage == VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT &&
+        (node.kernel.pipeline == VK_NULL_HANDLE ||
+         node.kernel.descriptor_set == nullptr)) {
+      throw std::invalid_argument("Graph kernel needs a pipeline and "
+                                  "descriptor set.");
+    }
+    nodes.push_back(std::move(node));
+    compiled = false;
+    return nodes.size() - 1;
+  }
+
+  DeviceResource &resource;
+  std::vector<Node> nodes;
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  bool compiled = false;
+  size_t n_barriers = 0;
+  Profiler *graph_profiler = nullptr;
+  Submission last_submission;
+};
+
+/**
+ * @brief Add the three softmax passes over `input` into `output`. The
+ * barriers between them follow from their use of the partials buffer.
+ */
+void add_softmax(ComputeGraph &graph, const SoftmaxResource &softmax,
+                 VkBuffer input, VkBuffer output) {
+  SoftmaxParams params{
+      .n = static_cast<uint32_t>(softmax.size),
+      .n_partials = softmax.n_workgroups,
+      .temperature = softmax.temperature,
+  };
+  const uint64_t bytes = softmax.size * sizeof(float);
+  const uint64_t partial_bytes = 2 * sizeof(float) * softmax.n_workgroups;
+  VkBuffer partials = softmax.partials.buffer;
+  GraphKernel kernel{
+      .pipeline_layout = softmax.pipeline_layout,
+      .descriptor_set = &softmax.descriptor_set,
+  };
+
+  // Buffers read by the fused elementwise ops
+  std::vector<BufferAccess> fused;
+  for (VkBuffer buffer : {softmax.fusion.bias_vector, softmax.fusion.mask}) {
+    if (buffer != VK_NULL_HANDLE) {
+      fused.push_back({buffer, Access::Read});
+    }
+  }
+
+  kernel.name = "softmax_reduce";
+  kernel.pipeline = softmax.reduce;
+  kernel.buffers = {{input, Access::Read}, {partials, Access::Write}};
+  kernel.buffers.insert(kernel.buffers.end(), fused.begin(), fused.end());
+  kernel.workgroups = {softmax.n_workgroups, 1, 1};
+  kernel.bytes = bytes + partial_bytes;
+  graph.add(kernel, params);
+
+  kernel.name = "softmax_combine";
+  kernel.pipeline = softmax.combine;
+  kernel.buffers = {{partials, Access::ReadWrite}};
+  kernel.workgroups = {1, 1, 1};
+  kernel.bytes = 2 * partial_bytes;
+  graph.add(kernel, params);
+
+  kernel.name = "softmax_normalize";
+  kernel.pipeline = softmax.normalize;
+  kernel.buffers = {{input, Access::Read},
+                    {partials, Access::Read},
+                    {output, Access::Write}};
+  kernel.buffers.insert(kernel.buffers.end(), fused.begin(), fused.end());
+  kernel.workgroups = {softmax.n_workgroups, 1, 1};
+  kernel.bytes = 2 * bytes;
+  graph.add(kernel, params);
+}
+
+/**
+ * @brief Add the batched row softmax over `input` into `output`.
+ */
+void add_softmax_rows(ComputeGraph &graph, const SoftmaxRowsResource &softmax,
+                      VkBuffer input, VkBuffer output) {
+  SoftmaxRowsParams params{
+      .rows = static_cast<uint32_t>(softmax.rows),
+      .cols = static_cast<uint32_t>(softmax.cols),
+      .row_stride = static_cast<uint32_t>(softmax.row_stride),
+      .temperature = softmax.temperature,
+  };
+  GraphKernel kernel{
+      .name = softmax.subgroups ? "softmax_rows_online" : "softmax_rows",
+      .pipeline = softmax.pipeline,
+      .pipeline_layout = softmax.pipeline_layout,
+      .descriptor_set = &softmax.descriptor_set,
+      .buffers = {{input, Access::Read}, {output, Access::Write}},
+      .workgroups = {softmax.n_workgroups, 1, 1},
+      .bytes = 2 * sizeof(float) * softmax.rows * softmax.cols,
+  };
+  for (VkBuffer buffer : {softmax.fusion.bias_vector, softmax.fusion.mask,
+                          softmax.mode.lengths}) {
+    if (buffer != VK_NULL_HANDLE) {
+      kernel.buffers.push_back({buffer, Access::Read});
+    }
+  }
+  graph.add(kernel, params);
+}
+
+} // namespace vkc
@@ -0,0 +1,54 @@
+// Elementwise ops fused into the softmax kernels, see vkc::SoftmaxFusion.
+//
+// The prologue is applied to each input element before the softmax and the
+// epilogue to each output element, in the order of the op bits. Ops are
+// selected with specialization constants, so unused ones are compiled out.
+// The including shader defines BIAS_BINDING and MASK_BINDING; when an op is
+// not used the host binds the input buffer there.
+
+const uint OP_SCALE = 1;       // x * scale
+const uint OP_BIAS = 2;        // x + bias
+const uint OP_BIAS_VECTOR = 4; // x + bias_vector[j]
+const uint OP_MASK = 8;        // x + mask[i]
+
+layout (constant_id = 3) const uint prologue_ops = 0;
+layout (constant_id = 4) const float prologue_scale = 1.0;
+layout (constant_id = 5) const float prologue_bias = 0.0;
+layout (constant_id = 6) const uint epilogue_ops = 0;
+layout (constant_id = 7) const float epilogue_scale = 1.0;
+layout (constant_id = 8) const float epilogue_bias = 0.0;
+
+layout(std430, binding = BIAS_BINDING) readonly buffer BiasVector {
+	float data[];
+} bias_vector;
+
+layout(std430, binding = MASK_BINDING) readonly buffer Mask {
+	float data[];
+} mask;
+
+// Input element x at buffer index i, broadcasting the bias vector over j.
+float prologue(float x, uint i, uint j) {
+  if ((prologue_ops & OP_SCALE) != 0) {
+    x *= prologue_scale;
+  }
+  if ((prologue_ops & OP_BIAS) != 0) {
+    x += prologue_bias;
+  }
+  if ((prologue_ops & OP_BIAS_VECTOR) != 0) {
+    x += bias_vector.data[j];
+  }
+  if ((prologue_ops & OP_MASK) != 0) {
+    x += mask.data[i];
+  }
+  return x;
+}
+
+float epilogue(float y) {
+  if ((epilogue_ops & OP_SCALE) != 0) {
+    y *= epilogue_scale;
+  }
+  if ((epilogue_ops & OP_BIAS) != 0) {
+    y += epilogue_bias;
+  }
+  return y;
+}
@@ -0,0 +1,58 @@
+// Softmax variants selected by a specialization constant, see
+// vkc::SoftmaxMode.
+//
+// Masked columns are never read or exponentiated. Their outputs are filled
+// with 0 (-inf for log-softmax) unless MODE_KEEP_MASKED leaves them
+// unwritten. Row shaders define LENGTHS_BINDING for MODE_LENGTHS.
+
+const uint MODE_LOG = 1;         // log-softmax, x - max - log(sum)
+const uint MODE_CAUSAL = 2;      // row r of each [cols, cols] block keeps
+                                 // columns 0..r
+const uint MODE_LENGTHS = 4;     // row r keeps its first lengths[r] columns
+const uint MODE_KEEP_MASKED = 8; // do not write masked outputs
+
+layout (constant_id = 9) const uint softmax_mode = 0;
+
+#ifdef LENGTHS_BINDING
+layout(std430, binding = LENGTHS_BINDING) readonly buffer Lengths {
+	uint data[];
+} lengths;
+#endif
+
+const bool log_softmax = (softmax_mode & MODE_LOG) != 0;
+
+// Number of leading columns of `row` that are not masked.
+uint valid_cols(uint row, uint cols) {
+  uint n = cols;
+  if ((softmax_mode & MODE_CAUSAL) != 0) {
+    n = min(n, row % cols + 1);
+  }
+#ifdef LENGTHS_BINDING
+  if ((softmax_mode & MODE_LENGTHS) != 0) {
+    n = min(n, lengths.data[row]);
+  }
+#endif
+  return n;
+}
+
+float masked_output() {
+  return log_softmax ? uintBitsToFloat(0xff800000u) : 0.0;
+}
+
+// Per-row factor for softmax_output: 1 / sum, or log(sum) for log-softmax.
+// The sum is at least 1 unless every column is masked (e.g. an additive
+// mask of -inf), when it is 0 and the factor is 0 (+inf for log-softmax).
+float softmax_norm(float sum) {
+  if (sum == 0.0) {
+    return log_softmax ? uintBitsToFloat(0x7f800000u) : 0.0;
+  }
+  return log_softmax ? log(sum) : 1.0 / sum;
+}
+
+// A fully masked row gives masked_output() rather than 0 * inf = NaN.
+float softmax_output(float x, float row_max, float norm) {
+  if (log_softmax ? isinf(norm) : norm == 0.0) {
+    return masked_output();
+  }
+  return log_softmax ? x - row_max - norm : exp(x - row_max) * norm;
+}
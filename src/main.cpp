@@ -4,24 +4,21 @@
 #include <vulkan/vulkan_beta.h>
 #include <vulkan/vulkan_macos.h>
 
-#include "spdlog/sinks/basic_file_sink.h"
-#include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 
-#include "vkcompute.hpp"
+#include <numeric>
+#include <thread>
 
-void setup_logging() {
-  spdlog::set_level(spdlog::level::trace);
-  spdlog::set_pattern("[%^%l%$] [%H:%M:%S] %v");
-  auto file_logger =
-      spdlog::basic_logger_mt("basic_logger", "logs/vulkan_log.txt");
-  auto console = spdlog::stdout_color_mt("console");
-  spdlog::set_default_logger(console);
-  spdlog::flush_every(std::chrono::seconds(3));
-}
+#include "graph.hpp"
+#include "stream.hpp"
+#include "vkcompute.hpp"
 
 int main() {
-  setup_logging();
+  vkc::setup_logging({
+      .level = spdlog::level::info,
+      .async = true,
+      .file = "logs/vulkan_log.txt",
+  });
 
   /*
    * Setup vulkan instance, physical and logical devices.
@@ -29,118 +26,123 @@ int main() {
 
   VkInstance instance =
       vkc::create_vulkan_instance(VK_MAKE_API_VERSION(1, 3, 236, 0));
+  // Owners are declared before everything created from the handles, so they
+  // are destroyed last, in reverse order.
+  vkc::UniqueInstance instance_owner(instance);
   VkPhysicalDevice physical_device = vkc::select_physical_device(instance);
-  uint32_t qfidx = vkc::find_queue_family(physical_device);
-  VkDevice device = vkc::create_logical_device(physical_device, qfidx);
+  // Every queue of the compute family, and a dedicated transfer queue if the
+  // device has one
+  vkc::QueueFamilies queue_families = vkc::find_queue_families(physical_device);
+  uint32_t qfidx = queue_families.compute;
+  vkc::DeviceCapabilities capabilities;
+  VkDevice device = vkc::create_logical_device(physical_device, queue_families,
+                                               &capabilities);
+  vkc::UniqueDevice device_owner(device);
 
   /*
-   * Create host-side array resources (C++ arrays), vkBuffer handles to them,
-   * and device memory handles for associated GPU memory.
+   * Create a queue for submitting command buffers to the GPU and a command
+   * pool to allocate command buffers from. The queue is created from the
+   * device and the queue family index.
    */
 
-  constexpr size_t size = 8;
-  std::array<float, size> input_a{};
+  VkQueue queue;
+  const uint32_t queue_index = 0;
+  vkGetDeviceQueue(device, qfidx, queue_index, &queue);
+  VkCommandPool command_pool = vkc::create_command_pool(device, qfidx);
+  vkc::UniqueCommandPool command_pool_owner(device, command_pool);
+  vkc::DeviceResource resource{
+      .instance = instance,
+      .physical_device = physical_device,
+      .device = device,
+      .queue_family = qfidx,
+      .queue = queue,
+      .command_pool = command_pool,
+      .capabilities = capabilities,
+  };
+
+  /*
+   * Create the host-side input, and GPU tensors owning vkBuffer handles and
+   * the device memory backing them. Tensor sizes are only needed at runtime.
+   */
+
+  const size_t size = 8;
+  std::vector<float> input_a(size);
   for (size_t i = 0; i < size; i++) {
     // for test input values, fill the array with increasing values from 0 to
     // size
     input_a[i] = static_cast<float>(i);
   }
-  std::array<float, size> output{};
-  VkBuffer buffer_in = vkc::create_buffer(input_a.size(), device,
-                                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                                              VK_BUFFER_USAGE_TRANSFER_DST_BIT);
-  VkBuffer buffer_out = vkc::create_buffer(
-      output.size(), device,
-      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-          VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-  auto memory_type = vkc::query_memory_type(physical_device);
+  // Compute buffers live in device-local memory where available. Transfers
+  // go through a host visible staging buffer unless the device-local memory
+  // is itself host visible, as on unified memory devices.
+  auto memory_type =
+      vkc::query_memory_type(physical_device, vkc::MemoryUsage::DeviceLocal);
   if (!memory_type) {
     spdlog::error("Failed to find memory type");
-    std::runtime_error("Failed to find memory type");
+    throw std::runtime_error("Failed to find memory type");
   }
-  VkDeviceMemory memory_in =
-      vkc::bind_buffer(device, buffer_in, memory_type.value(), input_a.size());
-  VkDeviceMemory memory_out =
-      vkc::bind_buffer(device, buffer_out, memory_type.value(), output.size());
-  vkc::copy_to_gpu<size>(device, memory_in, input_a);
-
-  /*
-   * Create descriptor set layout, descriptor pool, and descriptor set for
-   * binding the input and output buffers to the compute shader.
-   */
-
-  constexpr size_t n_bindings = 2; // 2 bindings: input and output
-  VkPipelineLayout pipeline_layout =
-      vkc::create_pipeline_layout<n_bindings>(device);
-  VkDescriptorSetLayout descriptor_set_layout =
-      vkc::create_descriptor_set_layout<n_bindings>(device);
-  std::array<VkDescriptorSetLayout, 1> descriptor_set_layouts = {
-      descriptor_set_layout};
-  VkDescriptorPool descriptor_pool = vkc::create_descriptor_pool(device);
-  VkDescriptorSet descriptor_set = vkc::create_descriptor_set(
-      device, descriptor_pool, descriptor_set_layouts);
-  VkDescriptorBufferInfo bufferinfo_in =
-      vkc::create_descriptor_buffer_info(buffer_in);
-  VkDescriptorBufferInfo bufferinfo_out =
-      vkc::create_descriptor_buffer_info(buffer_out);
-  std::array<VkWriteDescriptorSet, n_bindings> descriptorWrites =
-      vkc::create_descriptor_writes<n_bindings>(descriptor_set);
-  descriptorWrites[0].pBufferInfo = &bufferinfo_in;
-  descriptorWrites[1].pBufferInfo = &bufferinfo_out;
-  vkUpdateDescriptorSets(device, n_bindings, descriptorWrites.data(), 0,
-                         nullptr);
-  spdlog::info("Created descriptor set.");
-
-  /*
-   * Create shader module and pipeline for computation.
-   */
-
-  uint32_t wgsize = static_cast<uint32_t>(output.size());
-  std::array<uint32_t, 3> workgroup_size = {wgsize, 1, 1};
-  VkShaderModule shader =
-      vkc::create_shader_module(device, "build/softmax.spv");
-  VkPipeline pipeline =
-      vkc::create_pipeline(device, pipeline_layout, shader, workgroup_size);
+  // Tensor memory is sub-allocated from large blocks held by an arena rather
+  // than allocated with one vkAllocateMemory call per buffer.
+  vkc::MemoryArena arena(device, physical_device, vkc::ArenaMode::FreeList);
+  vkc::Tensor tensor_in(device, arena, memory_type.value(), {size});
+  vkc::Tensor tensor_out(device, arena, memory_type.value(), {size});
+
+  // Submissions return a handle instead of blocking, so the host is free to
+  // record or submit more work until it needs the result. Each thread submits
+  // compute work to its own queue, and uploads go through the transfer queue
+  // (a DMA engine, if the device has one) concurrently with compute.
+  vkc::QueueManager queues(resource, queue_families);
+  vkc::AsyncQueue &async_queue = queues.compute();
+  vkc::Submission uploaded =
+      queues.upload(tensor_in, input_a.data(), tensor_in.bytes());
+
+  // Host visible arena memory stays mapped, so the output is read in place
+  // through a typed view. If the output tensor is not host visible it is
+  // copied to a mapped readback tensor at the end of each submission.
+  vkc::Tensor tensor_readback;
+  if (!tensor_out.allocation.mapped) {
+    tensor_readback = vkc::Tensor(
+        device, arena,
+        vkc::query_memory_type(physical_device, vkc::MemoryUsage::Readback)
+            .value(),
+        {size}, vkc::DType::f32, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+  }
+  vkc::Tensor &tensor_host =
+      tensor_out.allocation.mapped ? tensor_out : tensor_readback;
+  vkc::MappedSpan<float> output = tensor_host.view<float>();
 
   /*
-   * Create a command buffer and corresponding command pool for submitting
-   * commands to the GPU.
+   * Create the multi-pass softmax pipelines. This sets up the descriptor set
+   * binding the input and output buffers (plus a scratch buffer of
+   * per-workgroup partial results) and one pipeline per pass.
    */
 
-  VkCommandPool command_pool = vkc::create_command_pool(device, qfidx);
-  VkCommandBuffer command_buffer =
-      vkc::create_command_buffer(device, command_pool);
+  // Pipelines are compiled through a cache persisted across runs, so warm
+  // starts skip shader compilation in the driver.
+  vkc::PipelineCache pipeline_cache(device, physical_device,
+                                    "build/pipeline_cache.bin");
+  vkc::SoftmaxResource softmax =
+      vkc::create_softmax(device, physical_device, tensor_in, tensor_out,
+                          arena, memory_type.value(), &pipeline_cache,
+                          &vkc::descriptor_cache(resource));
 
   /*
-   * Record commands to the command buffer.
+   * Describe the work as a compute graph: the softmax passes, then a copy to
+   * the readback tensor if the output is not host visible. The graph inserts
+   * the barriers between them and records everything once into a reusable
+   * command buffer.
    */
 
-  VkCommandBufferBeginInfo beginInfo{
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .flags =
-          VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT, // Allow command buffer
-                                                        // to be executed
-                                                        // multiple times
-  };
-  VkResult result = vkBeginCommandBuffer(command_buffer, &beginInfo);
-  vkc::check(result, "Begin command buffer.");
-
-  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
-  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
-  vkCmdDispatch(command_buffer, size / workgroup_size[0], 1, 1);
-
-  result = vkEndCommandBuffer(command_buffer);
-  vkc::check(result, "End command buffer.");
-
-  /*
-   * Create a queue for submitting command buffers to the GPU.
-   * The queue is created from the device and the queue family index.
-   */
+  vkc::ComputeGraph graph(resource);
+  vkc::add_softmax(graph, softmax, tensor_in.buffer, tensor_out.buffer);
+  if (&tensor_host != &tensor_out) {
+    graph.add_copy("readback", tensor_out.buffer, tensor_readback.buffer,
+                   tensor_out.bytes());
+  }
 
-  VkQueue queue;
-  const uint32_t queue_index = 0;
-  vkGetDeviceQueue(device, qfidx, queue_index, &queue);
+  // Each node is timed with GPU timestamps
+  vkc::Profiler profiler(device, physical_device, qfidx);
+  graph.compile(&profiler);
 
   /*
    * Main execution loop - submit the computation to the queue, copy the results
@@ -150,36 +152,56 @@ int main() {
 
   std::string input = "";
   while (input != "q") {
-    const VkSubmitInfo submitInfo = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &command_buffer,
-    };
-    result = vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkc::check(result, "Submit command buffer.");
-
-    result = vkQueueWaitIdle(queue);
-    vkc::check(result, "Wait for queue to become idle.");
-
-    // Print input and output to the screen
-    vkc::copy_to_cpu<size>(device, memory_out, output);
-    spdlog::info("Input: ");
-    int idx = 0;
-    for (auto &x : input_a) {
-      spdlog::info("{} : {}", idx, x);
-      idx++;
-    }
-    spdlog::info("Output: ");
-    idx = 0;
-    for (auto &x : output) {
-      spdlog::info("{} : {}", idx, x);
-      idx++;
-    }
+    vkc::Submission submission = graph.submit(async_queue, {uploaded});
+    submission.wait();
+    profiler.collect();
+
+    // Summarize the output rather than printing every element
+    vkc::invalidate_allocation(device, tensor_host.allocation);
+    auto max_output = std::max_element(output.begin(), output.end());
+    spdlog::info("Softmax of {} elements: sum {:.6f}, max {:.6f} at {}", size,
+                 std::accumulate(output.begin(), output.end(), 0.0),
+                 *max_output, max_output - output.begin());
 
     // Test re-using the computation or let the user quit
     std::cout << "Enter q to quit, anything else to re-run computation > ";
     std::getline(std::cin, input);
   }
 
+  /*
+   * Streaming - a producer thread pushes a sequence of input chunks while the
+   * main thread pops their softmax, with up to three chunks in flight.
+   */
+
+  {
+    const size_t n_chunks = 16;
+    vkc::SoftmaxStream stream(resource, async_queue, arena, size, 3,
+                              &pipeline_cache);
+    std::thread producer([&] {
+      std::vector<float> chunk(size);
+      for (size_t k = 0; k < n_chunks; k++) {
+        for (size_t i = 0; i < size; i++) {
+          chunk[i] = static_cast<float>(i + k);
+        }
+        stream.push(chunk);
+      }
+      stream.close();
+    });
+    std::vector<float> chunk_output;
+    size_t n_popped = 0;
+    while (stream.pop(chunk_output)) {
+      n_popped++;
+    }
+    producer.join();
+    spdlog::info("Streamed {} chunks of {} elements", n_popped, size);
+  }
+
+  profiler.log();
+  profiler.write("build/profile.json");
+
+  vkc::ArenaStats arena_stats = arena.stats();
+  spdlog::info("Arena: {} blocks, {} of {} bytes used, fragmentation {:.2f}",
+               arena_stats.block_count, arena_stats.used, arena_stats.reserved,
+               arena_stats.fragmentation());
   spdlog::info("Done");
 }
@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "vkcompute.hpp"
+
+namespace vkc {
+
+/**
+ * @brief Split `rows` into at most `n_shards` contiguous (first row, row
+ * count) ranges whose sizes differ by at most one. Fewer ranges are returned
+ * when there are fewer rows than shards, so no range is empty.
+ */
+std::vector<std::pair<uint32_t, uint32_t>> shard_rows(uint32_t rows,
+                                                      size_t n_shards) {
+  std::vector<std::pair<uint32_t, uint32_t>> shards;
+  if (n_shards == 0) {
+    return shards;
+  }
+  uint32_t n = static_cast<uint32_t>(std::min<size_t>(n_shards, rows));
+  uint32_t first = 0;
+  for (uint32_t idx = 0; idx < n; ++idx) {
+    uint32_t count = rows / n + (idx < rows % n ? 1 : 0);
+    shards.emplace_back(first, count);
+    first += count;
+  }
+  return shards;
+}
+
+/**
+ * @brief A thread running the jobs posted to it one at a time, in order.
+ * Jobs still queued when the worker is destroyed are run first.
+ */
+class Worker {
+public:
+  Worker() : thread([this] { loop(); }) {}
+
+  Worker(const Worker &) = delete;
+  Worker &operator=(const Worker &) = delete;
+
+  ~Worker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+  }
+
+  /* Queue `job`, returning a future that rethrows anything it throws. */
+  std::future<void> post(std::function<void()> job) {
+    std::packaged_task<void()> task(std::move(job));
+    std::future<void> done = task.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(task));
+    }
+    wake.notify_one();
+    return done;
+  }
+
+private:
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [&] { return !jobs.empty() || stopping; });
+      if (jobs.empty()) {
+        return;
+      }
+      std::packaged_task<void()> task = std::move(jobs.front());
+      jobs.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::packaged_task<void()>> jobs;
+  bool stopping = false;
+  // Last, so it starts once the members it uses are constructed
+  std::thread thread;
+};
+
+/**
+ * @brief Row softmax over `[rows, cols]` batches sharded across several
+ * physical devices.
+ *
+ * Each shard is a contiguous range of rows (see shard_rows) computed on its
+ * own VkDevice and queue, with its own tensors and row softmax pipelines.
+ * run() uploads each shard's rows, dispatches the softmax and reads the rows
+ * back in one submission per shard, with every shard driven from its own
+ * Worker thread so the devices compute concurrently. The workers live as
+ * long as the shards, so repeated runs reuse their threads and per-thread
+ * command pools.
+ *
+ * The shape can be fixed at construction, which sizes the buffers and
+ * compiles the pipelines up front, or given to each run(). Shape and
+ * temperature are push constants, so a shard only grows its buffers (at
+ * least doubling them) when a batch is its largest so far, and compiles a
+ * pipeline the first time its workgroup size (from the column count, at most
+ * 256) is needed. One run() may execute at a time.
+ *
+ * `devices` may list the same physical device more than once, in which case
+ * it gets one logical device per entry. This is how the sharding is exercised
+ * on a machine with a single (or a software) device. select_physical_devices
+ * picks every suitable device.
+ */
+class MultiDeviceSoftmax {
+public:
+  /* A shard per device, for batches whose shape is given to run(). */
+  MultiDeviceSoftmax(VkInstance instance,
+                     const std::vector<VkPhysicalDevice> &devices) {
+    if (devices.empty()) {
+      throw std::invalid_argument("Sharded softmax needs devices.");
+    }
+    for (VkPhysicalDevice device : devices) {
+      shards.push_back(std::make_unique<Shard>(instance, device));
+    }
+  }
+
+  /* A shard per device (at most one per row) for `[rows, cols]` batches. */
+  MultiDeviceSoftmax(VkInstance instance,
+                     const std::vector<VkPhysicalDevice> &devices,
+                     uint32_t rows, uint32_t cols, float temperature = 1.0f)
+      : n_rows(rows), n_cols(cols), temperature(temperature) {
+    if (devices.empty() || rows == 0 || cols == 0) {
+      throw std::invalid_argument(
+          "Sharded softmax needs devices, rows and columns.");
+    }
+    auto ranges = shard_rows(rows, devices.size());
+    for (size_t idx = 0; idx < ranges.size(); ++idx) {
+      shards.push_back(std::make_unique<Shard>(instance, devices[idx]));
+      shards.back()->prepare(ranges[idx].second, cols);
+    }
+    spdlog::info("Sharded softmax of {}x{} across {} devices", rows, cols,
+                 shards.size());
+  }
+
+  MultiDeviceSoftmax(const MultiDeviceSoftmax &) = delete;
+  MultiDeviceSoftmax &operator=(const MultiDeviceSoftmax &) = delete;
+
+  /**
+   * @brief Softmax of each row of the row-major `[rows, cols]` `input` into
+   * `output`. Rethrows the first error raised by a shard.
+   */
+  void run(const float *input, float *output, uint32_t rows, uint32_t cols,
+           float temperature = 1.0f) {
+    if (rows == 0 || cols == 0) {
+      throw std::invalid_argument("Softmax needs rows and columns.");
+    }
+    auto ranges = shard_rows(rows, shards.size());
+    std::vector<std::future<void>> pending;
+    for (size_t idx = 0; idx < ranges.size(); ++idx) {
+      size_t offset = size_t(ranges[idx].first) * cols;
+      uint32_t count = ranges[idx].second;
+      Shard *shard = shards[idx].get();
+      pending.push_back(shard->worker.post([=] {
+        shard->run(input + offset, output + offset, count, cols,
+                   temperature);
+      }));
+    }
+    // Wait for every shard before rethrowing, so none is left running
+    for (auto &future : pending) {
+      future.wait();
+    }
+    for (auto &future : pending) {
+      future.get();
+    }
+  }
+
+  /* Softmax of a batch of the shape given to the constructor. */
+  void run(const float *input, float *output) {
+    run(input, output, n_rows, n_cols, temperature);
+  }
+
+  std::vector<float> run(const std::vector<float> &input) {
+    if (input.size() != size_t(n_rows) * n_cols) {
+      throw std::invalid_argument("Sharded softmax input size mismatch.");
+    }
+    std::vector<float> output(input.size());
+    run(input.data(), output.data());
+    return output;
+  }
+
+  /* The shape given to the constructor, 0 if none. */
+  uint32_t rows() const { return n_rows; }
+  uint32_t cols() const { return n_cols; }
+  size_t shard_count() const { return shards.size(); }
+  /* The (first row, row count) range each shard computes of rows() rows. */
+  std::vector<std::pair<uint32_t, uint32_t>> shard_ranges() const {
+    return shard_rows(n_rows, shards.size());
+  }
+
+private:
+  /* One device's share of the batch. Members are destroyed in reverse
+   * order, so the worker is joined first and the device and command pool
+   * owners go last. */
+  struct Shard {
+    Shard(VkInstance instance, VkPhysicalDevice physical_device) {
+      uint32_t qfidx = find_queue_family(physical_device);
+      DeviceCapabilities capabilities;
+      VkDevice device =
+          create_logical_device(physical_device, qfidx, &capabilities);
+      device_owner = UniqueDevice(device);
+      VkQueue queue;
+      vkGetDeviceQueue(device, qfidx, 0, &queue);
+      VkCommandPool command_pool = create_command_pool(device, qfidx);
+      command_pool_owner = UniqueCommandPool(device, command_pool);
+      resource = DeviceResource{
+          .instance = instance,
+          .physical_device = physical_device,
+          .device = device,
+          .queue_family = qfidx,
+          .queue = queue,
+          .command_pool = command_pool,
+          .capabilities = capabilities,
+      };
+      arena = std::make_unique<MemoryArena>(device, physical_device,
+                                            ArenaMode::FreeList);
+      command_pools = std::make_unique<ThreadCommandPools>(device, qfidx);
+      async_queue = std::make_unique<AsyncQueue>(resource);
+    }
+
+    /* Size the buffers for `rows` x `cols` and compile its pipeline. */
+    void prepare(uint32_t rows, uint32_t cols) {
+      reserve(size_t(rows) * cols);
+      pipeline(cols);
+    }
+
+    void run(const float *in, float *out, uint32_t rows, uint32_t cols,
+             float temperature) {
+      const size_t count = size_t(rows) * cols;
+      const VkDeviceSize bytes = count * sizeof(float);
+      reserve(count);
+      SoftmaxRowsResource &softmax = pipeline(cols);
+
+      Tensor &input_host =
+          input_staging.buffer != VK_NULL_HANDLE ? input_staging : input;
+      std::memcpy(input_host.allocation.mapped, in, bytes);
+      flush_allocation(resource.device, input_host.allocation, 0, bytes);
+
+      ThreadCommandPools::CommandBuffer pooled = command_pools->acquire();
+      VkCommandBuffer command_buffer = pooled;
+      VkCommandBufferBeginInfo begin_info{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+      };
+      check(vkBeginCommandBuffer(command_buffer, &begin_info),
+            "Begin shard command buffer.");
+      if (&input_host != &input) {
+        record_upload(command_buffer, input_staging.buffer, input.buffer,
+                      bytes);
+      }
+      record_softmax_rows(command_buffer, softmax,
+                          {.rows = rows,
+                           .cols = cols,
+                           .row_stride = cols,
+                           .temperature = temperature});
+      if (readback.buffer != VK_NULL_HANDLE) {
+        record_readback(command_buffer, output.buffer, readback.buffer, bytes);
+      } else {
+        host_read_barrier(command_buffer);
+      }
+      check(vkEndCommandBuffer(command_buffer), "End shard command buffer.");
+      async_queue->submit(command_buffer).wait();
+      command_pools->release(pooled);
+
+      Tensor &output_host =
+          readback.buffer != VK_NULL_HANDLE ? readback : output;
+      invalidate_allocation(resource.device, output_host.allocation, 0, bytes);
+      std::memcpy(out, output_host.allocation.mapped, bytes);
+    }
+
+    /* Grow the buffers to hold `count` elements, at least doubling them. */
+    void reserve(size_t count) {
+      if (count <= capacity) {
+        return;
+      }
+      capacity = std::max(count, 2 * capacity);
+      VkPhysicalDevice &physical_device = resource.physical_device;
+      uint32_t device_type =
+          query_memory_type(physical_device, MemoryUsage::DeviceLocal)
+              .value();
+      // Release the old buffers (and the sets binding them) before
+      // allocating larger ones
+      input = Tensor();
+      output = Tensor();
+      input_staging = Tensor();
+      readback = Tensor();
+      input = Tensor(resource.device, *arena, device_type, {capacity});
+      output = Tensor(resource.device, *arena, device_type, {capacity});
+      input.track(descriptor_cache(resource));
+      if (!input.allocation.mapped) {
+        input_staging = Tensor(
+            resource.device, *arena,
+            query_memory_type(physical_device, MemoryUsage::Upload).value(),
+            {capacity}, DType::f32, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+      }
+      if (!output.allocation.mapped) {
+        readback = Tensor(
+            resource.device, *arena,
+            query_memory_type(physical_device, MemoryUsage::Readback)
+                .value(),
+            {capacity}, DType::f32, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+      }
+      for (auto &[workgroup_size, softmax] : pipelines) {
+        rebind_softmax_rows(softmax, descriptor_cache(resource),
+                            input.buffer, output.buffer);
+      }
+    }
+
+    /* The pipeline for rows of `cols` elements, compiled on first use. */
+    SoftmaxRowsResource &pipeline(uint32_t cols) {
+      // create_softmax_rows sizes workgroups to the next power of two
+      uint32_t workgroup_size = 1;
+      while (workgroup_size < cols && workgroup_size < 256) {
+        workgroup_size *= 2;
+      }
+      auto it = pipelines.find(workgroup_size);
+      if (it == pipelines.end()) {
+        // Rows are push constants, so the dispatch may use every workgroup
+        it = pipelines
+                 .emplace(workgroup_size,
+                          create_softmax_rows(
+                              resource.device, resource.physical_device,
+                              resource.capabilities, input.buffer,
+                              output.buffer,
+                              std::numeric_limits<uint32_t>::max(),
+                              workgroup_size, 0, 256, nullptr,
+                              &descriptor_cache(resource)))
+                 .first;
+      }
+      return it->second;
+    }
+
+    UniqueDevice device_owner;
+    UniqueCommandPool command_pool_owner;
+    DeviceResource resource{};
+    std::unique_ptr<MemoryArena> arena;
+    std::unique_ptr<ThreadCommandPools> command_pools;
+    std::unique_ptr<AsyncQueue> async_queue;
+    size_t capacity = 0; // elements the buffers hold
+    Tensor input;
+    Tensor output;
+    Tensor input_staging; // empty if input is host visible
+    Tensor readback;      // empty if output is host visible
+    std::map<uint32_t, SoftmaxRowsResource> pipelines; // by workgroup size
+    Worker worker;
+  };
+
+  uint32_t n_rows = 0;
+  uint32_t n_cols = 0;
+  float temperature = 1.0f;
+  std::vector<std::unique_ptr<Shard>> shards;
+};
+
+} // namespace vkc
@@ -0,0 +1,65 @@
+#version 450
+
+// Pass 2 of the multi-pass softmax: a single workgroup folds the per-workgroup
+// (max, sum) pairs into the global pair, stored in the slot after them.
+
+layout (local_size_x_id = 0, local_size_y_id = 1, local_size_z_id = 2) in;
+
+layout(std430, binding = 0) buffer Data {
+	float data[];
+} data_in;
+
+layout(std430, binding = 1) buffer Out {
+	float data[];
+} data_out;
+
+layout(std430, binding = 2) buffer Partials {
+	vec2 data[];
+} partials;
+
+// Per-dispatch parameters, see vkc::SoftmaxParams
+layout(push_constant) uniform Params {
+  uint n;          // elements
+  uint n_partials; // workgroups of the reduce pass
+  float temperature;
+} params;
+
+shared float s_max[gl_WorkGroupSize.x];
+shared float s_sum[gl_WorkGroupSize.x];
+
+const float lowest = -3.402823466e+38;
+
+void combine(inout float m, inout float s, float m_other, float s_other) {
+  const float m_new = max(m, m_other);
+  s = s * exp(m - m_new) + s_other * exp(m_other - m_new);
+  m = m_new;
+}
+
+void main () {
+  const uint n_partials = params.n_partials;
+  const uint local_idx = gl_LocalInvocationID.x;
+  const uint workgroup_size = gl_WorkGroupSize.x;
+
+  float m = lowest;
+  float s = 0.0;
+  for (uint i = local_idx; i < n_partials; i += workgroup_size) {
+    const vec2 partial = partials.data[i];
+    combine(m, s, partial.x, partial.y);
+  }
+  s_max[local_idx] = m;
+  s_sum[local_idx] = s;
+  barrier();
+
+  for (uint offset = workgroup_size / 2; offset > 0; offset /= 2) {
+    if (local_idx < offset) {
+      combine(m, s, s_max[local_idx + offset], s_sum[local_idx + offset]);
+      s_max[local_idx] = m;
+      s_sum[local_idx] = s;
+    }
+    barrier();
+  }
+
+  if (local_idx == 0) {
+    partials.data[n_partials] = vec2(m, s);
+  }
+}
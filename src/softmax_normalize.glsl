@@ -0,0 +1,45 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+// Pass 3 of the multi-pass softmax: scale every element by the global
+// (max, sum) pair produced by softmax_combine.
+
+layout (local_size_x_id = 0, local_size_y_id = 1, local_size_z_id = 2) in;
+
+#define BIAS_BINDING 3
+#define MASK_BINDING 4
+#include "elementwise.glsl"
+#include "softmax_mode.glsl"
+
+layout(std430, binding = 0) buffer Data {
+	float data[];
+} data_in;
+
+layout(std430, binding = 1) buffer Out {
+	float data[];
+} data_out;
+
+layout(std430, binding = 2) buffer Partials {
+	vec2 data[];
+} partials;
+
+// Per-dispatch parameters, see vkc::SoftmaxParams
+layout(push_constant) uniform Params {
+  uint n;          // elements
+  uint n_partials; // workgroups of the reduce pass
+  float temperature;
+} params;
+
+void main () {
+  const uint n = params.n;
+  const float inv_temperature = 1.0 / params.temperature;
+  const uint stride = gl_WorkGroupSize.x * gl_NumWorkGroups.x;
+  const vec2 total = partials.data[params.n_partials];
+  const float norm = softmax_norm(total.y);
+
+  for (uint i = gl_GlobalInvocationID.x; i < n; i += stride) {
+    const float x = prologue(data_in.data[i], i, i) * inv_temperature;
+    data_out.data[i] = epilogue(softmax_output(x, total.x, norm));
+  }
+}
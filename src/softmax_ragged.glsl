@@ -0,0 +1,77 @@
+#version 450
+
+// Softmax over a ragged batch of rows packed back to back: row r is
+// data[offsets[r] .. offsets[r + 1]). Each workgroup owns one row at a time
+// and strides over rows by the number of workgroups, as in softmax_rows.glsl,
+// so requests of different lengths share one dispatch without padding.
+
+layout (local_size_x_id = 0, local_size_y_id = 1, local_size_z_id = 2) in;
+
+// Per-dispatch parameters, see vkc::SoftmaxRaggedParams
+layout(push_constant) uniform Params {
+  uint rows;
+  float temperature;
+} params;
+
+layout(std430, binding = 0) buffer Data {
+	float data[];
+} data_in;
+
+layout(std430, binding = 1) buffer Out {
+	float data[];
+} data_out;
+
+// rows + 1 entries, offsets[rows] is the total element count
+layout(std430, binding = 2) readonly buffer Offsets {
+	uint data[];
+} offsets;
+
+shared float s_max[gl_WorkGroupSize.x];
+shared float s_sum[gl_WorkGroupSize.x];
+
+const float lowest = -3.402823466e+38;
+
+void combine(inout float m, inout float s, float m_other, float s_other) {
+  const float m_new = max(m, m_other);
+  s = s * exp(m - m_new) + s_other * exp(m_other - m_new);
+  m = m_new;
+}
+
+void main () {
+  const float inv_temperature = 1.0 / params.temperature;
+  const uint local_idx = gl_LocalInvocationID.x;
+  const uint workgroup_size = gl_WorkGroupSize.x;
+
+  for (uint row = gl_WorkGroupID.x; row < params.rows;
+       row += gl_NumWorkGroups.x) {
+    const uint begin = offsets.data[row];
+    const uint end = offsets.data[row + 1];
+
+    float m = lowest;
+    float s = 0.0;
+    for (uint i = begin + local_idx; i < end; i += workgroup_size) {
+      combine(m, s, data_in.data[i] * inv_temperature, 1.0);
+    }
+    s_max[local_idx] = m;
+    s_sum[local_idx] = s;
+    barrier();
+
+    for (uint offset = workgroup_size / 2; offset > 0; offset /= 2) {
+      if (local_idx < offset) {
+        combine(m, s, s_max[local_idx + offset], s_sum[local_idx + offset]);
+        s_max[local_idx] = m;
+        s_sum[local_idx] = s;
+      }
+      barrier();
+    }
+
+    const float row_max = s_max[0];
+    const float inv_sum = 1.0 / s_sum[0];
+    for (uint i = begin + local_idx; i < end; i += workgroup_size) {
+      data_out.data[i] =
+          exp(data_in.data[i] * inv_temperature - row_max) * inv_sum;
+    }
+    // Shared memory is reused by the next row
+    barrier();
+  }
+}
@@ -0,0 +1,73 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+// Pass 1 of the multi-pass softmax: each workgroup reduces a grid-strided
+// slice of the input to a (max, sum of exp(x - max)) pair.
+
+layout (local_size_x_id = 0, local_size_y_id = 1, local_size_z_id = 2) in;
+
+#define BIAS_BINDING 3
+#define MASK_BINDING 4
+#include "elementwise.glsl"
+
+layout(std430, binding = 0) buffer Data {
+	float data[];
+} data_in;
+
+layout(std430, binding = 1) buffer Out {
+	float data[];
+} data_out;
+
+layout(std430, binding = 2) buffer Partials {
+	vec2 data[];
+} partials;
+
+// Per-dispatch parameters, see vkc::SoftmaxParams
+layout(push_constant) uniform Params {
+  uint n;          // elements
+  uint n_partials; // workgroups of the reduce pass
+  float temperature;
+} params;
+
+shared float s_max[gl_WorkGroupSize.x];
+shared float s_sum[gl_WorkGroupSize.x];
+
+const float lowest = -3.402823466e+38;
+
+// Merge two (max, sum) pairs, rescaling both sums to the larger max.
+void combine(inout float m, inout float s, float m_other, float s_other) {
+  const float m_new = max(m, m_other);
+  s = s * exp(m - m_new) + s_other * exp(m_other - m_new);
+  m = m_new;
+}
+
+void main () {
+  const uint n = params.n;
+  const float inv_temperature = 1.0 / params.temperature;
+  const uint local_idx = gl_LocalInvocationID.x;
+  const uint workgroup_size = gl_WorkGroupSize.x;
+  const uint stride = workgroup_size * gl_NumWorkGroups.x;
+
+  float m = lowest;
+  float s = 0.0;
+  for (uint i = gl_GlobalInvocationID.x; i < n; i += stride) {
+    combine(m, s, prologue(data_in.data[i], i, i) * inv_temperature, 1.0);
+  }
+  s_max[local_idx] = m;
+  s_sum[local_idx] = s;
+  barrier();
+
+  for (uint offset = workgroup_size / 2; offset > 0; offset /= 2) {
+    if (local_idx < offset) {
+      combine(m, s, s_max[local_idx + offset], s_sum[local_idx + offset]);
+      s_max[local_idx] = m;
+      s_sum[local_idx] = s;
+    }
+    barrier();
+  }
+
+  if (local_idx == 0) {
+    partials.data[gl_WorkGroupID.x] = vec2(m, s);
+  }
+}
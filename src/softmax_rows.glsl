@@ -0,0 +1,90 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+// Batched row-wise softmax over a row-major [rows, cols] buffer. Each
+// workgroup owns one row at a time and strides over rows by the number of
+// workgroups, so a single dispatch covers the whole batch.
+
+layout (local_size_x_id = 0, local_size_y_id = 1, local_size_z_id = 2) in;
+
+#define BIAS_BINDING 2
+#define MASK_BINDING 3
+#include "elementwise.glsl"
+#define LENGTHS_BINDING 4
+#include "softmax_mode.glsl"
+
+// Per-dispatch parameters, see vkc::SoftmaxRowsParams
+layout(push_constant) uniform Params {
+  uint rows;
+  uint cols;
+  uint row_stride; // elements between the starts of consecutive rows
+  float temperature;
+} params;
+
+layout(std430, binding = 0) buffer Data {
+	float data[];
+} data_in;
+
+layout(std430, binding = 1) buffer Out {
+	float data[];
+} data_out;
+
+shared float s_max[gl_WorkGroupSize.x];
+shared float s_sum[gl_WorkGroupSize.x];
+
+const float lowest = -3.402823466e+38;
+
+void combine(inout float m, inout float s, float m_other, float s_other) {
+  const float m_new = max(m, m_other);
+  s = s * exp(m - m_new) + s_other * exp(m_other - m_new);
+  m = m_new;
+}
+
+void main () {
+  const uint rows = params.rows;
+  const uint cols = params.cols;
+  const uint row_stride = params.row_stride;
+  const float inv_temperature = 1.0 / params.temperature;
+  const uint local_idx = gl_LocalInvocationID.x;
+  const uint workgroup_size = gl_WorkGroupSize.x;
+
+  for (uint row = gl_WorkGroupID.x; row < rows; row += gl_NumWorkGroups.x) {
+    const uint base = row * row_stride;
+    const uint valid = valid_cols(row, cols);
+
+    float m = lowest;
+    float s = 0.0;
+    for (uint i = local_idx; i < valid; i += workgroup_size) {
+      const float x = prologue(data_in.data[base + i], base + i, i);
+      combine(m, s, x * inv_temperature, 1.0);
+    }
+    s_max[local_idx] = m;
+    s_sum[local_idx] = s;
+    barrier();
+
+    for (uint offset = workgroup_size / 2; offset > 0; offset /= 2) {
+      if (local_idx < offset) {
+        combine(m, s, s_max[local_idx + offset], s_sum[local_idx + offset]);
+        s_max[local_idx] = m;
+        s_sum[local_idx] = s;
+      }
+      barrier();
+    }
+
+    const float row_max = s_max[0];
+    const float norm = softmax_norm(s_sum[0]);
+    for (uint i = local_idx; i < valid; i += workgroup_size) {
+      const float x = prologue(data_in.data[base + i], base + i, i);
+      data_out.data[base + i] =
+          epilogue(softmax_output(x * inv_temperature, row_max, norm));
+    }
+    if ((softmax_mode & MODE_KEEP_MASKED) == 0) {
+      for (uint i = valid + local_idx; i < cols; i += workgroup_size) {
+        data_out.data[base + i] = masked_output();
+      }
+    }
+    // Shared memory is reused by the next row
+    barrier();
+  }
+}
@@ -0,0 +1,116 @@
+#version 450
+
+// Subgroup variant of softmax_rows.glsl. Each invocation keeps a running max
+// and a sum rescaled whenever the max grows ("online" softmax), subgroups
+// reduce with subgroupMax/subgroupAdd, and shared memory is only used to
+// combine the per-subgroup results. Selected by create_softmax_rows when the
+// device supports subgroup arithmetic in compute shaders.
+
+#extension GL_KHR_shader_subgroup_basic : enable
+#extension GL_KHR_shader_subgroup_arithmetic : enable
+#extension GL_GOOGLE_include_directive : require
+
+layout (local_size_x_id = 0, local_size_y_id = 1, local_size_z_id = 2) in;
+
+#define BIAS_BINDING 2
+#define MASK_BINDING 3
+#include "elementwise.glsl"
+#define LENGTHS_BINDING 4
+#include "softmax_mode.glsl"
+
+// Per-dispatch parameters, see vkc::SoftmaxRowsParams
+layout(push_constant) uniform Params {
+  uint rows;
+  uint cols;
+  uint row_stride; // elements between the starts of consecutive rows
+  float temperature;
+} params;
+
+layout(std430, binding = 0) buffer Data {
+	float data[];
+} data_in;
+
+layout(std430, binding = 1) buffer Out {
+	float data[];
+} data_out;
+
+// One slot per invocation covers any subgroup count: drivers may run a
+// workgroup with subgroups smaller than the reported subgroup size
+shared float s_max[gl_WorkGroupSize.x];
+shared float s_sum[gl_WorkGroupSize.x];
+shared float s_row_max;
+shared float s_row_sum;
+
+const float lowest = -3.402823466e+38;
+
+// Reduce a (max, sum) pair across the subgroup.
+void subgroup_combine(inout float m, inout float s) {
+  const float m_subgroup = subgroupMax(m);
+  s = subgroupAdd(s * exp(m - m_subgroup));
+  m = m_subgroup;
+}
+
+void main () {
+  const uint rows = params.rows;
+  const uint cols = params.cols;
+  const uint row_stride = params.row_stride;
+  const float inv_temperature = 1.0 / params.temperature;
+  const uint local_idx = gl_LocalInvocationID.x;
+  const uint workgroup_size = gl_WorkGroupSize.x;
+
+  for (uint row = gl_WorkGroupID.x; row < rows; row += gl_NumWorkGroups.x) {
+    const uint base = row * row_stride;
+    const uint valid = valid_cols(row, cols);
+
+    float m = lowest;
+    float s = 0.0;
+    for (uint i = local_idx; i < valid; i += workgroup_size) {
+      const float x =
+          prologue(data_in.data[base + i], base + i, i) * inv_temperature;
+      if (x > m) {
+        s = s * exp(m - x) + 1.0;
+        m = x;
+      } else {
+        s += exp(x - m);
+      }
+    }
+    subgroup_combine(m, s);
+    if (subgroupElect()) {
+      s_max[gl_SubgroupID] = m;
+      s_sum[gl_SubgroupID] = s;
+    }
+    barrier();
+
+    if (gl_SubgroupID == 0) {
+      m = lowest;
+      s = 0.0;
+      for (uint i = gl_SubgroupInvocationID; i < gl_NumSubgroups;
+           i += gl_SubgroupSize) {
+        const float m_new = max(m, s_max[i]);
+        s = s * exp(m - m_new) + s_sum[i] * exp(s_max[i] - m_new);
+        m = m_new;
+      }
+      subgroup_combine(m, s);
+      if (subgroupElect()) {
+        s_row_max = m;
+        s_row_sum = s;
+      }
+    }
+    barrier();
+
+    const float row_max = s_row_max;
+    const float norm = softmax_norm(s_row_sum);
+    for (uint i = local_idx; i < valid; i += workgroup_size) {
+      const float x = prologue(data_in.data[base + i], base + i, i);
+      data_out.data[base + i] =
+          epilogue(softmax_output(x * inv_temperature, row_max, norm));
+    }
+    if ((softmax_mode & MODE_KEEP_MASKED) == 0) {
+      for (uint i = valid + local_idx; i < cols; i += workgroup_size) {
+        data_out.data[base + i] = masked_output();
+      }
+    }
+    // Shared memory is reused by the next row
+    barrier();
+  }
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "vkcompute.hpp"
+
+namespace vkc {
+
+/**
+ * @brief Softmax over a continuous stream of fixed size input chunks, with up
+ * to `n_frames` chunks in flight.
+ *
+ * The softmax pipelines are built once and shared by every frame. Each
+ * frame owns its input and output tensors, host visible staging tensors
+ * (when device-local memory is not host visible), the softmax partials and
+ * a descriptor set from the device's DescriptorCache, and a command buffer
+ * recorded once at construction. Frames are used in ring order, so while
+ * the GPU computes chunk k the producer can upload chunk k+1 into the next
+ * frame and the consumer can read back chunk k-1 from the previous one.
+ *
+ * push() blocks while every frame holds a chunk that has not been popped, so
+ * the producer never runs more than n_frames chunks ahead of the consumer.
+ * One producer thread and one consumer thread may use the stream
+ * concurrently.
+ */
+class SoftmaxStream {
+public:
+  SoftmaxStream(DeviceResource &resource, AsyncQueue &queue,
+                MemoryArena &arena, size_t chunk_size, size_t n_frames = 3,
+                PipelineCache *cache = nullptr)
+      : resource(resource), queue(queue), chunk_elements(chunk_size) {
+    if (chunk_size == 0 || n_frames == 0) {
+      throw std::invalid_argument("Stream chunk size and frames must be > 0.");
+    }
+    VkPhysicalDevice &physical_device = resource.physical_device;
+    uint32_t device_type =
+        query_memory_type(physical_device, MemoryUsage::DeviceLocal).value();
+    uint32_t upload_type =
+        query_memory_type(physical_device, MemoryUsage::Upload).value();
+    uint32_t readback_type =
+        query_memory_type(physical_device, MemoryUsage::Readback).value();
+
+    frames.resize(n_frames);
+    for (Frame &frame : frames) {
+      frame.input = Tensor(resource.device, arena, device_type, {chunk_size});
+      frame.output = Tensor(resource.device, arena, device_type, {chunk_size});
+      if (!frame.input.allocation.mapped) {
+        frame.staging =
+            Tensor(resource.device, arena, upload_type, {chunk_size},
+                   DType::f32, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+      }
+      if (!frame.output.allocation.mapped) {
+        frame.readback =
+            Tensor(resource.device, arena, readback_type, {chunk_size},
+                   DType::f32, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+      }
+    }
+
+    softmax = create_softmax(resource.device, physical_device,
+                             frames[0].input, frames[0].output, arena,
+                             device_type, cache, &descriptor_cache(resource));
+    frames[0].binding = {std::move(softmax.descriptor_set),
+                         std::move(softmax.partials)};
+    for (Frame &frame : frames) {
+      if (&frame != &frames[0]) {
+        frame.binding = bind_softmax(resource.device, softmax,
+                                     frame.input.buffer, frame.output.buffer,
+                                     arena, device_type,
+                                     &descriptor_cache(resource));
+      }
+      frame.command_buffer =
+          create_command_buffer(resource.device, resource.command_pool);
+      record(frame);
+    }
+    SPDLOG_DEBUG("Softmax stream of {} element chunks, {} frames{}",
+                 chunk_size, n_frames,
+                 frames[0].staging.buffer != VK_NULL_HANDLE
+                     ? ", staged transfers"
+                     : "");
+  }
+
+  SoftmaxStream(const SoftmaxStream &) = delete;
+  SoftmaxStream &operator=(const SoftmaxStream &) = delete;
+
+  ~SoftmaxStream() {
+    close();
+    for (Frame &frame : frames) {
+      frame.submission.wait();
+      vkFreeCommandBuffers(resource.device, resource.command_pool, 1,
+                           &frame.command_buffer);
+    }
+  }
+
+  /**
+   * @brief Upload and submit the next chunk of `count` == chunk_size()
+   * elements, blocking while all frames are pending. Returns false if the
+   * stream has been closed.
+   */
+  bool push(const float *data, size_t count) {
+    return push(data, count, true);
+  }
+
+  /* Like push(), but returns false instead of blocking when all frames are
+   * pending. */
+  bool try_push(const float *data, size_t count) {
+    return push(data, count, false);
+  }
+
+  bool push(const std::vector<float> &data) {
+    return push(data.data(), data.size());
+  }
+
+  /**
+   * @brief Wait for the oldest pending chunk and copy its softmax to
+   * `output`. Returns false once the stream is closed and drained.
+   */
+  bool pop(std::vector<float> &output) {
+    size_t idx;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      consumer_ready.wait(lock, [&] { return pending > 0 || closed; });
+      if (pending == 0) {
+        return false;
+      }
+      idx = tail;
+    }
+
+    Frame &frame = frames[idx];
+    frame.submission.wait();
+    Tensor &host = frame.readback.buffer != VK_NULL_HANDLE ? frame.readback
+                                                           : frame.output;
+    invalidate_allocation(resource.device, host.allocation);
+    MappedSpan<float> result = host.view<float>();
+    output.assign(result.begin(), result.end());
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tail = (tail + 1) % frames.size();
+      pending--;
+    }
+    producer_ready.notify_one();
+    return true;
+  }
+
+  /* Stop accepting chunks. Chunks already pushed can still be popped. */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    producer_ready.notify_all();
+    consumer_ready.notify_all();
+  }
+
+  size_t chunk_size() const { return chunk_elements; }
+  size_t n_frames() const { return frames.size(); }
+
+private:
+  struct Frame {
+    Tensor input;
+    Tensor output;
+    Tensor staging;  // empty if input is host visible
+    Tensor readback; // empty if output is host visible
+    SoftmaxBinding binding;
+    VkCommandBuffer command_buffer;
+    Submission submission;
+  };
+
+  void record(Frame &frame) {
+    VkCommandBufferBeginInfo begin_info{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    };
+    check(vkBeginCommandBuffer(frame.command_buffer, &begin_info),
+          "Begin stream command buffer.");
+    if (frame.staging.buffer != VK_NULL_HANDLE) {
+      record_upload(frame.command_buffer, frame.staging.buffer,
+                    frame.input.buffer, frame.input.bytes());
+    }
+    record_softmax(frame.command_buffer, softmax,
+                   frame.binding.descriptor_set, chunk_elements,
+                   softmax.temperature);
+    if (frame.readback.buffer != VK_NULL_HANDLE) {
+      record_readback(frame.command_buffer, frame.output.buffer,
+                      frame.readback.buffer, frame.output.bytes());
+    } else {
+      host_read_barrier(frame.command_buffer);
+    }
+    check(vkEndCommandBuffer(frame.command_buffer),
+          "End stream command buffer.");
+  }
+
+  bool push(const float *data, size_t count, bool block) {
+    if (count != chunk_elements) {
+      throw std::invalid_argument("Stream chunk size mismatch.");
+    }
+    size_t idx;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (block) {
+        producer_ready.wait(
+            lock, [&] { return pending < frames.size() || closed; });
+      }
+      if (closed || pending == frames.size()) {
+        return false;
+      }
+      idx = head;
+    }
+
+    // The frame is not pending, so its previous submission has been waited on
+    // by pop() and neither the GPU nor the consumer is using it.
+    Frame &frame = frames[idx];
+    Tensor &host = frame.staging.buffer != VK_NULL_HANDLE ? frame.staging
+                                                          : frame.input;
+    std::memcpy(host.allocation.mapped, data, count * sizeof(float));
+    flush_allocation(resource.device, host.allocation);
+    frame.submission = queue.submit(frame.command_buffer);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      head = (head + 1) % frames.size();
+      pending++;
+    }
+    consumer_ready.notify_one();
+    return true;
+  }
+
+  DeviceResource &resource;
+  AsyncQueue &queue;
+  size_t chunk_elements;
+  // Its own set and partials are moved to the first frame
+  SoftmaxResource softmax;
+  std::vector<Frame> frames;
+  size_t head = 0;    // next frame to fill
+  size_t tail = 0;    // next frame to pop
+  size_t pending = 0; // frames pushed but not popped
+  bool closed = false;
+  std::mutex mutex;
+  std::condition_variable producer_ready;
+  std::condition_variable consumer_ready;
+};
+
+} // namespace vkc
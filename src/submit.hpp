@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vkcompute.hpp"
+
+namespace vkc {
+
+/**
+ * @brief Batches command buffers recorded on many threads into a few
+ * vkQueueSubmit calls.
+ *
+ * Worker threads record into command buffers from their own pools
+ * (ThreadCommandPools) and hand them to submit(), which pushes them onto a
+ * lock-free queue and returns without waiting. A single submission thread
+ * owns the queue: each time it wakes it takes every request queued since the
+ * last batch and submits up to `max_batch` command buffers per
+ * vkQueueSubmit, so many small requests cost one submit and one semaphore
+ * signal instead of one each. Each request's future resolves to the
+ * Submission of its batch, which waits for the dependencies of every request
+ * in the batch.
+ *
+ * Typical use from a worker:
+ *
+ *   ThreadCommandPools::CommandBuffer cmd = pools.acquire();
+ *   ... record cmd ...
+ *   Submission done = submitter.submit(cmd).get();
+ *   done.then([&pools, cmd] { pools.release(cmd); });
+ *
+ * Nothing else may submit to the AsyncQueue while the submitter runs.
+ */
+class BatchSubmitter {
+public:
+  explicit BatchSubmitter(AsyncQueue &queue, size_t max_batch = 64)
+      : queue(queue), max_batch(std::max<size_t>(1, max_batch)),
+        thread([this] { run(); }) {}
+
+  BatchSubmitter(const BatchSubmitter &) = delete;
+  BatchSubmitter &operator=(const BatchSubmitter &) = delete;
+
+  /* Submits everything already queued, then stops the submission thread. */
+  ~BatchSubmitter() {
+    stopping.store(true);
+    wake();
+    thread.join();
+  }
+
+  std::future<Submission>
+  submit(VkCommandBuffer command_buffer,
+         std::vector<Submission> dependencies = {}) {
+    Request request{command_buffer, std::move(dependencies), {}};
+    std::future<Submission> future = request.promise.get_future();
+    requests.push(std::move(request));
+    wake();
+    return future;
+  }
+
+  /* vkQueueSubmit calls made so far. */
+  size_t submit_count() const { return n_submits.load(); }
+  /* Command buffers submitted so far. */
+  size_t request_count() const { return n_requests.load(); }
+
+private:
+  struct Request {
+    VkCommandBuffer command_buffer;
+    std::vector<Submission> dependencies;
+    std::promise<Submission> promise;
+  };
+
+  // The submission thread sets `waiting` before re-checking the queue, and
+  // producers check it after pushing, so one of them always sees the other
+  // and no wakeup is lost. Producers only lock when the thread is asleep.
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready.notify_one();
+    }
+  }
+
+  void run() {
+    std::vector<Request> batch;
+    while (true) {
+      bool stop = stopping.load();
+      requests.drain(batch);
+      if (batch.empty()) {
+        if (stop) {
+          return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        ready.wait(lock,
+                   [&] { return !requests.empty() || stopping.load(); });
+        waiting.store(false);
+        continue;
+      }
+      for (size_t first = 0; first < batch.size(); first += max_batch) {
+        size_t last = std::min(batch.size(), first + max_batch);
+        submit_batch(batch.begin() + first, batch.begin() + last);
+      }
+      batch.clear();
+    }
+  }
+
+  void submit_batch(std::vector<Request>::iterator begin,
+                    std::vector<Request>::iterator end) {
+    std::vector<VkCommandBuffer> command_buffers;
+    std::vector<Submission> dependencies;
+    for (auto it = begin; it != end; ++it) {
+      command_buffers.push_back(it->command_buffer);
+      dependencies.insert(dependencies.end(), it->dependencies.begin(),
+                          it->dependencies.end());
+    }
+    try {
+      Submission submission = queue.submit(command_buffers, dependencies);
+      for (auto it = begin; it != end; ++it) {
+        it->promise.set_value(submission);
+      }
+    } catch (...) {
+      for (auto it = begin; it != end; ++it) {
+        it->promise.set_exception(std::current_exception());
+      }
+    }
+    n_submits++;
+    n_requests += command_buffers.size();
+  }
+
+  AsyncQueue &queue;
+  size_t max_batch;
+  MpscQueue<Request> requests;
+  std::atomic<bool> stopping{false};
+  std::atomic<bool> waiting{false};
+  std::atomic<size_t> n_submits{0};
+  std::atomic<size_t> n_requests{0};
+  std::mutex mutex;
+  std::condition_variable ready;
+  // Started last, once everything it uses is constructed
+  std::thread thread;
+};
+
+} // namespace vkc
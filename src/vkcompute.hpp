@@ -1,21 +1,190 @@
+#pragma once
+
+#include "shaders.hpp" // generated from src/*.glsl at build time
+#include "spdlog/async.h"
+#include "spdlog/sinks/basic_file_sink.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <bitset>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
 
 namespace vkc {
 
-/* Generic function to check a VkResult and log success/fail condition */
-void check(const VkResult &result, const char *message) {
-  if (result != VK_SUCCESS) {
-    spdlog::error("Failed to execute: {}", message);
-    spdlog::error("Error code: {}", result);
-    std::runtime_error("Failed to execute: " + std::string(message));
+/**
+ * @brief Logging configuration for setup_logging.
+ *
+ * Debug and trace messages in the helpers (per buffer, per copy and per
+ * pipeline) are compiled out unless SPDLOG_ACTIVE_LEVEL is lowered, see
+ * VKCOMPUTE_LOG_LEVEL in CMakeLists.txt. `level` filters the rest at runtime.
+ */
+struct LogOptions {
+  spdlog::level::level_enum level = spdlog::level::info;
+  // Format and write messages on a background thread instead of the caller's
+  bool async = false;
+  // Also log to this file if not empty
+  std::string file = "";
+};
+
+void setup_logging(const LogOptions &options = {}) {
+  std::vector<spdlog::sink_ptr> sinks = {
+      std::make_shared<spdlog::sinks::stdout_color_sink_mt>()};
+  if (!options.file.empty()) {
+    sinks.push_back(
+        std::make_shared<spdlog::sinks::basic_file_sink_mt>(options.file));
+  }
+  std::shared_ptr<spdlog::logger> logger;
+  if (options.async) {
+    spdlog::init_thread_pool(8192, 1);
+    // Drop the oldest queued messages rather than block the caller when the
+    // logging thread falls behind.
+    logger = std::make_shared<spdlog::async_logger>(
+        "vkc", sinks.begin(), sinks.end(), spdlog::thread_pool(),
+        spdlog::async_overflow_policy::overrun_oldest);
   } else {
-    spdlog::info("Success: {}", message);
+    logger =
+        std::make_shared<spdlog::logger>("vkc", sinks.begin(), sinks.end());
+  }
+  logger->set_level(options.level);
+  logger->set_pattern("[%^%l%$] [%H:%M:%S] %v");
+  spdlog::set_default_logger(logger);
+  spdlog::flush_every(std::chrono::seconds(3));
+}
+
+[[noreturn]] void check_failed(VkResult result, const char *message) {
+  spdlog::error("Failed to execute: {} (error code {})", message,
+                static_cast<int>(result));
+  throw std::runtime_error(fmt::format("Failed to execute: {} (error code {})",
+                                       message, static_cast<int>(result)));
+}
+
+/**
+ * Check a VkResult, logging and throwing std::runtime_error on failure. On
+ * success nothing is formatted or logged, so it is cheap on hot paths.
+ */
+inline void check(const VkResult &result, const char *message) {
+  if (result != VK_SUCCESS) {
+    check_failed(result, message);
+  }
+}
+
+/**
+ * @brief Move-only owner of a Vulkan object created from a device, destroyed
+ * with `Destroy` (vkDestroy* or vkFree*) when the owner goes out of scope.
+ *
+ * Converts implicitly to the handle, so it can be passed to Vulkan calls
+ * taking the handle by value.
+ */
+template <typename T, auto Destroy> class Unique {
+public:
+  Unique() = default;
+  Unique(VkDevice device, T handle) : device(device), handle(handle) {}
+  Unique(const Unique &) = delete;
+  Unique &operator=(const Unique &) = delete;
+  Unique(Unique &&other) noexcept { *this = std::move(other); }
+  Unique &operator=(Unique &&other) noexcept {
+    if (this != &other) {
+      reset();
+      device = other.device;
+      handle = std::exchange(other.handle, VK_NULL_HANDLE);
+    }
+    return *this;
+  }
+  ~Unique() { reset(); }
+
+  T get() const { return handle; }
+  operator T() const { return handle; }
+  explicit operator bool() const { return handle != VK_NULL_HANDLE; }
+
+  /* Give up ownership without destroying the object. */
+  T release() { return std::exchange(handle, VK_NULL_HANDLE); }
+
+  void reset() {
+    if (handle != VK_NULL_HANDLE) {
+      Destroy(device, handle, nullptr);
+      handle = VK_NULL_HANDLE;
+    }
+  }
+
+private:
+  VkDevice device = VK_NULL_HANDLE;
+  T handle = VK_NULL_HANDLE;
+};
+
+using UniqueBuffer = Unique<VkBuffer, vkDestroyBuffer>;
+using UniqueMemory = Unique<VkDeviceMemory, vkFreeMemory>;
+using UniqueShaderModule = Unique<VkShaderModule, vkDestroyShaderModule>;
+using UniquePipeline = Unique<VkPipeline, vkDestroyPipeline>;
+using UniquePipelineLayout = Unique<VkPipelineLayout, vkDestroyPipelineLayout>;
+using UniqueDescriptorSetLayout =
+    Unique<VkDescriptorSetLayout, vkDestroyDescriptorSetLayout>;
+using UniqueDescriptorPool = Unique<VkDescriptorPool, vkDestroyDescriptorPool>;
+using UniqueCommandPool = Unique<VkCommandPool, vkDestroyCommandPool>;
+using UniqueFence = Unique<VkFence, vkDestroyFence>;
+
+/**
+ * @brief Move-only owner of an instance or device, the objects everything
+ * else is created from. Declare it before the objects created from it so it
+ * is destroyed after them.
+ */
+template <typename T, auto Destroy> class UniqueRoot {
+public:
+  UniqueRoot() = default;
+  explicit UniqueRoot(T handle) : handle(handle) {}
+  UniqueRoot(const UniqueRoot &) = delete;
+  UniqueRoot &operator=(const UniqueRoot &) = delete;
+  UniqueRoot(UniqueRoot &&other) noexcept { *this = std::move(other); }
+  UniqueRoot &operator=(UniqueRoot &&other) noexcept {
+    if (this != &other) {
+      reset();
+      handle = std::exchange(other.handle, VK_NULL_HANDLE);
+    }
+    return *this;
+  }
+  ~UniqueRoot() { reset(); }
+
+  T get() const { return handle; }
+  operator T() const { return handle; }
+
+  void reset() {
+    if (handle != VK_NULL_HANDLE) {
+      Destroy(handle, nullptr);
+      handle = VK_NULL_HANDLE;
+    }
   }
+
+private:
+  T handle = VK_NULL_HANDLE;
+};
+
+/* Wait for outstanding work before destroying a device. */
+void destroy_device(VkDevice device, const VkAllocationCallbacks *allocator) {
+  vkDeviceWaitIdle(device);
+  vkDestroyDevice(device, allocator);
 }
 
+using UniqueInstance = UniqueRoot<VkInstance, vkDestroyInstance>;
+using UniqueDevice = UniqueRoot<VkDevice, destroy_device>;
+
 /**
  * Create a vulkan instance with some beginner-friendly defaults.
  * Checks and enables VK_KHR_PORTABILITY_ENUMERATION_EXTENSION if it's
@@ -36,17 +205,17 @@ VkInstance create_vulkan_instance(uint32_t version) {
   auto extensions_list = vk::enumerateInstanceExtensionProperties();
   auto layers_list = vk::enumerateInstanceLayerProperties();
 
-  spdlog::info("Available extensions:");
+  SPDLOG_DEBUG("Available extensions:");
   for (const auto &extension : extensions_list) {
-    spdlog::info("\t{}", extension.extensionName);
+    SPDLOG_DEBUG("\t{}", extension.extensionName);
     if (strcmp(extension.extensionName,
                VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME) == 0) {
       extensions.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
     }
   }
-  spdlog::info("Available layers:");
+  SPDLOG_DEBUG("Available layers:");
   for (const auto &layer : layers) {
-    spdlog::info("\t{}", layer);
+    SPDLOG_DEBUG("\t{}", layer);
     if (strcmp(layer, "VK_LAYER_KHRONOS_validation") == 0) {
       layers.push_back("VK_LAYER_KHRONOS_validation");
     }
@@ -66,13 +235,13 @@ VkInstance create_vulkan_instance(uint32_t version) {
   };
 
   // Print enabled extensions
-  spdlog::info("Enabled layers :");
+  SPDLOG_DEBUG("Enabled layers :");
   for (uint32_t i = 0; i < createInfo.enabledLayerCount; i++) {
-    spdlog::info("\t{}", createInfo.ppEnabledLayerNames[i]);
+    SPDLOG_DEBUG("\t{}", createInfo.ppEnabledLayerNames[i]);
   }
-  spdlog::info("Enabled extensions:");
+  SPDLOG_DEBUG("Enabled extensions:");
   for (uint32_t i = 0; i < createInfo.enabledExtensionCount; i++) {
-    spdlog::info("\t{}", createInfo.ppEnabledExtensionNames[i]);
+    SPDLOG_DEBUG("\t{}", createInfo.ppEnabledExtensionNames[i]);
   }
 
   VkInstance instance{};
@@ -82,40 +251,206 @@ VkInstance create_vulkan_instance(uint32_t version) {
   return instance;
 }
 
-VkPhysicalDevice select_physical_device(VkInstance &instance) {
-  uint32_t device_count = 0;
-  vkEnumeratePhysicalDevices(instance, &device_count, nullptr);
+/**
+ * @brief A physical device and the properties it is ranked by.
+ */
+struct PhysicalDeviceInfo {
+  VkPhysicalDevice device = VK_NULL_HANDLE;
+  std::string name;
+  std::string uuid; // deviceUUID as 32 lowercase hex digits
+  VkPhysicalDeviceType type = VK_PHYSICAL_DEVICE_TYPE_OTHER;
+  VkDeviceSize device_local_bytes = 0; // largest device-local heap
+  uint32_t max_invocations = 0;        // maxComputeWorkGroupInvocations
+  bool compute = false;                // has a compute queue family
 
-  if (device_count == 0) {
-    throw std::runtime_error("Failed to find GPUs with Vulkan support.");
+  /* Discrete over integrated over virtual over CPU devices. */
+  int type_rank() const {
+    switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+      return 4;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+      return 3;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+      return 2;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+      return 1;
+    default:
+      return 0;
+    }
+  }
+
+  /* Ranking key, larger is better: type, then memory, then compute limits. */
+  std::tuple<int, VkDeviceSize, uint32_t> score() const {
+    return {type_rank(), device_local_bytes, max_invocations};
+  }
+};
+
+PhysicalDeviceInfo query_physical_device_info(VkPhysicalDevice device) {
+  VkPhysicalDeviceIDProperties id_properties{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+  };
+  VkPhysicalDeviceProperties2 properties{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+      .pNext = &id_properties,
+  };
+  vkGetPhysicalDeviceProperties2(device, &properties);
+
+  PhysicalDeviceInfo info;
+  info.device = device;
+  info.name = properties.properties.deviceName;
+  info.type = properties.properties.deviceType;
+  info.max_invocations =
+      properties.properties.limits.maxComputeWorkGroupInvocations;
+  for (uint8_t byte : id_properties.deviceUUID) {
+    info.uuid += fmt::format("{:02x}", byte);
+  }
+
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(device, &memory_properties);
+  for (uint32_t idx = 0; idx < memory_properties.memoryHeapCount; ++idx) {
+    const VkMemoryHeap &heap = memory_properties.memoryHeaps[idx];
+    if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+      info.device_local_bytes = std::max(info.device_local_bytes, heap.size);
+    }
+  }
+
+  uint32_t queue_family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count,
+                                           queue_families.data());
+  for (const VkQueueFamilyProperties &family : queue_families) {
+    info.compute |= (family.queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+                    family.queueCount > 0;
   }
+  return info;
+}
 
+/**
+ * @brief Devices with a compute queue, best first by
+ * PhysicalDeviceInfo::score. Devices that score the same keep the loader's
+ * order.
+ */
+std::vector<PhysicalDeviceInfo> rank_physical_devices(VkInstance &instance) {
+  uint32_t device_count = 0;
+  vkEnumeratePhysicalDevices(instance, &device_count, nullptr);
   std::vector<VkPhysicalDevice> devices(device_count);
   vkEnumeratePhysicalDevices(instance, &device_count, devices.data());
 
-  // Log devices found
-  for (size_t i = 0; i < devices.size(); ++i) {
-    spdlog::info("Device Found Index {}", i);
+  std::vector<PhysicalDeviceInfo> ranked;
+  for (VkPhysicalDevice device : devices) {
+    PhysicalDeviceInfo info = query_physical_device_info(device);
+    SPDLOG_DEBUG("Device {} ({}): type {}, {} MiB device-local, {} "
+                 "invocations{}",
+                 info.name, info.uuid, static_cast<int>(info.type),
+                 info.device_local_bytes >> 20, info.max_invocations,
+                 info.compute ? "" : ", no compute queue");
+    if (info.compute) {
+      ranked.push_back(std::move(info));
+    }
+  }
+  auto better = [](const PhysicalDeviceInfo &a, const PhysicalDeviceInfo &b) {
+    return a.score() > b.score();
+  };
+  std::stable_sort(ranked.begin(), ranked.end(), better);
+  return ranked;
+}
+
+/**
+ * @brief Whether `selector` names the device: a substring of its name, or its
+ * UUID in hex (case and dashes ignored).
+ */
+bool matches_device(const PhysicalDeviceInfo &info,
+                    const std::string &selector) {
+  std::string hex;
+  for (char c : selector) {
+    if (c != '-') {
+      hex += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+  }
+  return info.name.find(selector) != std::string::npos || hex == info.uuid;
+}
+
+/* The device selector from the VKCOMPUTE_DEVICE environment variable. */
+std::string device_selector_from_env() {
+  const char *selector = std::getenv("VKCOMPUTE_DEVICE");
+  return selector ? selector : "";
+}
+
+/**
+ * @brief Select the highest scoring physical device, or the first device
+ * (best first) matching `selector` if one is given. The selector defaults to
+ * the VKCOMPUTE_DEVICE environment variable.
+ */
+VkPhysicalDevice select_physical_device(
+    VkInstance &instance,
+    const std::string &selector = device_selector_from_env()) {
+  std::vector<PhysicalDeviceInfo> ranked = rank_physical_devices(instance);
+  if (ranked.empty()) {
+    throw std::runtime_error("Failed to find GPUs with Vulkan support.");
   }
 
-  // TODO - pick a device based on suitability criterion
-  // For now, just pick the first available device
-  VkPhysicalDevice selected_device = devices[0];
+  const PhysicalDeviceInfo *selected = &ranked[0];
+  if (!selector.empty()) {
+    auto it = std::find_if(ranked.begin(), ranked.end(),
+                           [&](const PhysicalDeviceInfo &info) {
+                             return matches_device(info, selector);
+                           });
+    if (it == ranked.end()) {
+      throw std::runtime_error("No device matches " + selector);
+    }
+    selected = &*it;
+  }
 
-  // Log selected device properties
   VkPhysicalDeviceProperties properties;
-  vkGetPhysicalDeviceProperties(selected_device, &properties);
+  vkGetPhysicalDeviceProperties(selected->device, &properties);
 
-  spdlog::info("Physical device count: {}", device_count);
+  spdlog::info("Physical device count: {}", ranked.size());
   spdlog::info("Selected device name: {}", properties.deviceName);
-  spdlog::info("Max workgroup count x: {}",
+  SPDLOG_DEBUG("Max workgroup count x: {}",
                properties.limits.maxComputeWorkGroupCount[0]);
-  spdlog::info("Max workgroup count y: {}",
+  SPDLOG_DEBUG("Max workgroup count y: {}",
                properties.limits.maxComputeWorkGroupCount[1]);
-  spdlog::info("Max workgroup count z: {}",
+  SPDLOG_DEBUG("Max workgroup count z: {}",
                properties.limits.maxComputeWorkGroupCount[2]);
 
-  return selected_device;
+  return selected->device;
+}
+
+/**
+ * @brief Every device suitable for sharding work across: those of the best
+ * device type present (so a discrete GPU is not held back by an integrated
+ * one), or those matching any of the comma separated `selectors`.
+ */
+std::vector<VkPhysicalDevice>
+select_physical_devices(VkInstance &instance,
+                        const std::string &selectors = "") {
+  std::vector<PhysicalDeviceInfo> ranked = rank_physical_devices(instance);
+  std::vector<VkPhysicalDevice> devices;
+  if (selectors.empty()) {
+    for (const PhysicalDeviceInfo &info : ranked) {
+      if (info.type_rank() == ranked[0].type_rank()) {
+        devices.push_back(info.device);
+      }
+    }
+  } else {
+    std::stringstream stream(selectors);
+    std::string selector;
+    while (std::getline(stream, selector, ',')) {
+      for (const PhysicalDeviceInfo &info : ranked) {
+        if (matches_device(info, selector) &&
+            std::find(devices.begin(), devices.end(), info.device) ==
+                devices.end()) {
+          devices.push_back(info.device);
+        }
+      }
+    }
+  }
+  if (devices.empty()) {
+    throw std::runtime_error("Failed to find GPUs with Vulkan support.");
+  }
+  return devices;
 }
 
 uint32_t find_queue_family(VkPhysicalDevice &physicalDevice,
@@ -128,14 +463,14 @@ uint32_t find_queue_family(VkPhysicalDevice &physicalDevice,
   vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queue_family_count,
                                            queue_families.data());
 
-  spdlog::info("Queue family count: {}", queue_family_count);
+  SPDLOG_DEBUG("Queue family count: {}", queue_family_count);
 
   for (uint32_t i = 0; i < queue_families.size(); ++i) {
     const auto &queue_family = queue_families[i];
-    spdlog::info("Queue family {} has {} queues", i, queue_family.queueCount);
+    SPDLOG_DEBUG("Queue family {} has {} queues", i, queue_family.queueCount);
 
     if ((queue_family.queueFlags & queueFlags) && queue_family.queueCount > 0) {
-      spdlog::info("Found compute queue family index {}", i);
+      SPDLOG_DEBUG("Found compute queue family index {}", i);
       return i;
     }
   }
@@ -143,6 +478,46 @@ uint32_t find_queue_family(VkPhysicalDevice &physicalDevice,
   throw std::runtime_error("Failed to find a suitable queue family.");
 }
 
+/**
+ * @brief The queue families a device is created with: every queue of the
+ * compute family, and one queue of a dedicated transfer family (transfer
+ * without compute or graphics, usually a DMA engine) if the device has one.
+ */
+struct QueueFamilies {
+  uint32_t compute = 0;
+  uint32_t compute_count = 1;
+  std::optional<uint32_t> transfer;
+};
+
+QueueFamilies find_queue_families(VkPhysicalDevice &physical_device) {
+  uint32_t queue_family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device,
+                                           &queue_family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(
+      physical_device, &queue_family_count, queue_families.data());
+
+  QueueFamilies families;
+  families.compute = find_queue_family(physical_device);
+  families.compute_count = queue_families[families.compute].queueCount;
+  for (uint32_t i = 0; i < queue_families.size(); ++i) {
+    VkQueueFlags flags = queue_families[i].queueFlags;
+    if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+        !(flags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT)) &&
+        queue_families[i].queueCount > 0) {
+      families.transfer = i;
+      break;
+    }
+  }
+  spdlog::info("Compute queue family {} with {} queues, {}", families.compute,
+               families.compute_count,
+               families.transfer
+                   ? fmt::format("transfer queue family {}",
+                                 families.transfer.value())
+                   : "no dedicated transfer queue family");
+  return families;
+}
+
 std::vector<VkExtensionProperties>
 get_supported_device_extensions(VkPhysicalDevice physical_device) {
   uint32_t extension_count = 0;
@@ -157,32 +532,94 @@ get_supported_device_extensions(VkPhysicalDevice physical_device) {
   return supported_extensions;
 }
 
+/**
+ * @brief Optional device features that kernels can be specialized for.
+ */
+struct DeviceCapabilities {
+  uint32_t subgroup_size = 1;
+  bool subgroup_arithmetic = false; // subgroupAdd/subgroupMax in compute
+  bool timeline_semaphore = false;  // Vulkan 1.2 timeline semaphores
+  bool push_descriptor = false;     // VK_KHR_push_descriptor enabled
+};
+
+DeviceCapabilities
+query_device_capabilities(VkPhysicalDevice &physical_device) {
+  VkPhysicalDeviceSubgroupProperties subgroup_properties{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+  };
+  VkPhysicalDeviceProperties2 properties{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+      .pNext = &subgroup_properties,
+  };
+  vkGetPhysicalDeviceProperties2(physical_device, &properties);
+
+  DeviceCapabilities capabilities{};
+  capabilities.subgroup_size = std::max(1u, subgroup_properties.subgroupSize);
+  capabilities.subgroup_arithmetic =
+      (subgroup_properties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+      (subgroup_properties.supportedOperations &
+       VK_SUBGROUP_FEATURE_ARITHMETIC_BIT);
+
+  // Timeline semaphores are core in 1.2, the feature struct is not valid
+  // to chain on older devices.
+  if (properties.properties.apiVersion >= VK_API_VERSION_1_2) {
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &timeline_features,
+    };
+    vkGetPhysicalDeviceFeatures2(physical_device, &features);
+    capabilities.timeline_semaphore = timeline_features.timelineSemaphore;
+  }
+  return capabilities;
+}
+
+/**
+ * @brief Create a logical device with the queues in `families`.
+ */
 VkDevice create_logical_device(VkPhysicalDevice &physical_device,
-                               uint32_t queue_family_index) {
+                               const QueueFamilies &families,
+                               DeviceCapabilities *capabilities = nullptr) {
 
   std::vector<const char *> extension_names;
   std::vector<VkExtensionProperties> extensions =
       get_supported_device_extensions(physical_device);
   bool portability_subset_found = false;
-  spdlog::info("Device extensions:");
+  bool push_descriptor_found = false;
+  SPDLOG_DEBUG("Device extensions:");
   for (auto extension : extensions) {
-    spdlog::info("{}", extension.extensionName);
+    SPDLOG_DEBUG("{}", extension.extensionName);
     if (strcmp(extension.extensionName,
                VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME) == 0) {
       portability_subset_found = true;
       extension_names.push_back(VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME);
     }
+    if (strcmp(extension.extensionName,
+               VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) == 0) {
+      push_descriptor_found = true;
+      extension_names.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    }
   }
 
-  float queue_priority = 1.0f;
-
-  VkDeviceQueueCreateInfo queue_create_info{};
-  queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queue_create_info.queueFamilyIndex = queue_family_index;
-  queue_create_info.queueCount = 1;
-  queue_create_info.pQueuePriorities = &queue_priority;
+  std::vector<float> queue_priorities(families.compute_count, 1.0f);
+  std::vector<VkDeviceQueueCreateInfo> queue_create_infos = {{
+      .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+      .queueFamilyIndex = families.compute,
+      .queueCount = families.compute_count,
+      .pQueuePriorities = queue_priorities.data(),
+  }};
+  if (families.transfer) {
+    queue_create_infos.push_back({
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = families.transfer.value(),
+        .queueCount = 1,
+        .pQueuePriorities = queue_priorities.data(),
+    });
+  }
 
-  spdlog::info("# of extensions: {}", extension_names.size());
+  SPDLOG_DEBUG("# of extensions: {}", extension_names.size());
   // print extensions
   for (auto extension : extension_names) {
     spdlog::info("Including extension in logical device: {}", extension);
@@ -190,8 +627,9 @@ VkDevice create_logical_device(VkPhysicalDevice &physical_device,
 
   VkDeviceCreateInfo create_info{};
   create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  create_info.queueCreateInfoCount = 1;
-  create_info.pQueueCreateInfos = &queue_create_info;
+  create_info.queueCreateInfoCount =
+      static_cast<uint32_t>(queue_create_infos.size());
+  create_info.pQueueCreateInfos = queue_create_infos.data();
   create_info.enabledLayerCount = 0;
   create_info.ppEnabledLayerNames = nullptr;
   create_info.enabledExtensionCount =
@@ -199,6 +637,17 @@ VkDevice create_logical_device(VkPhysicalDevice &physical_device,
   create_info.ppEnabledExtensionNames = extension_names.data();
   create_info.pEnabledFeatures = nullptr;
 
+  DeviceCapabilities device_capabilities =
+      query_device_capabilities(physical_device);
+  device_capabilities.push_descriptor = push_descriptor_found;
+  VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+      .timelineSemaphore = VK_TRUE,
+  };
+  if (device_capabilities.timeline_semaphore) {
+    create_info.pNext = &timeline_features;
+  }
+
   VkDevice device;
   VkResult result =
       vkCreateDevice(physical_device, &create_info, nullptr, &device);
@@ -207,14 +656,38 @@ VkDevice create_logical_device(VkPhysicalDevice &physical_device,
     throw std::runtime_error("Failed to create logical device.");
   }
 
+  spdlog::info("Subgroup size: {}, subgroup arithmetic: {}, timeline "
+               "semaphores: {}, push descriptors: {}",
+               device_capabilities.subgroup_size,
+               device_capabilities.subgroup_arithmetic,
+               device_capabilities.timeline_semaphore,
+               device_capabilities.push_descriptor);
+  if (capabilities) {
+    *capabilities = device_capabilities;
+  }
+
   return device;
 }
 
-VkBuffer create_buffer(int size, const VkDevice &device,
-                       VkBufferUsageFlags usage) {
+/**
+ * @brief Create a logical device with a single queue of `queue_family_index`.
+ */
+VkDevice create_logical_device(VkPhysicalDevice &physical_device,
+                               uint32_t queue_family_index,
+                               DeviceCapabilities *capabilities = nullptr) {
+  return create_logical_device(
+      physical_device, QueueFamilies{.compute = queue_family_index},
+      capabilities);
+}
+
+/**
+ * @brief Create a buffer of `bytes` bytes.
+ */
+VkBuffer create_buffer_bytes(VkDeviceSize bytes, const VkDevice &device,
+                             VkBufferUsageFlags usage) {
   VkBufferCreateInfo buffer_create_info{};
   buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  buffer_create_info.size = sizeof(float) * size;
+  buffer_create_info.size = bytes;
   buffer_create_info.usage = usage;
   buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   VkBuffer buffer;
@@ -226,6 +699,14 @@ VkBuffer create_buffer(int size, const VkDevice &device,
   return buffer;
 }
 
+/**
+ * @brief Create a buffer of `size` floats.
+ */
+VkBuffer create_buffer(int size, const VkDevice &device,
+                       VkBufferUsageFlags usage) {
+  return create_buffer_bytes(sizeof(float) * size, device, usage);
+}
+
 std::optional<uint32_t> query_memory_type(VkPhysicalDevice &physicalDevice) {
   // Find a memory type that satisfies the requirements
   VkPhysicalDeviceMemoryProperties memory_properties;
@@ -240,11 +721,11 @@ std::optional<uint32_t> query_memory_type(VkPhysicalDevice &physicalDevice) {
                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
     // Log memory type information
-    spdlog::info("Memory type {}: host_visible={}, host_coherent={}", i,
+    SPDLOG_DEBUG("Memory type {}: host_visible={}, host_coherent={}", i,
                  host_visible, host_coherent);
 
     if (host_visible && host_coherent) {
-      spdlog::info("Selected memory index: {}", i);
+      SPDLOG_DEBUG("Selected memory index: {}", i);
       return i;
     }
   }
@@ -254,6 +735,100 @@ std::optional<uint32_t> query_memory_type(VkPhysicalDevice &physicalDevice) {
   return std::nullopt;
 }
 
+/**
+ * @brief Intended use of a memory allocation, used to pick a memory type.
+ */
+enum class MemoryUsage {
+  DeviceLocal, // Only accessed by shaders, fastest device access
+  Upload,      // Written by the host, read by the device (staging)
+  Readback,    // Written by the device, read by the host
+};
+
+VkMemoryPropertyFlags memory_type_flags(VkPhysicalDevice &physicalDevice,
+                                        uint32_t memory_type) {
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memory_properties);
+  return memory_properties.memoryTypes[memory_type].propertyFlags;
+}
+
+bool is_host_visible(VkPhysicalDevice &physicalDevice, uint32_t memory_type) {
+  return memory_type_flags(physicalDevice, memory_type) &
+         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+/**
+ * @brief Select a memory type for the given intent.
+ *
+ * DeviceLocal prefers device-local memory that is not host visible; on
+ * unified memory devices where every device-local type is host visible, that
+ * type is returned and transfers map it directly. If there is no device-local
+ * memory at all, this falls back to host visible and coherent memory. Upload
+ * requires host visible memory and prefers coherent memory, Readback prefers
+ * host cached memory so that reads on the host are fast.
+ *
+ * @param type_bits optional VkMemoryRequirements::memoryTypeBits mask
+ */
+std::optional<uint32_t> query_memory_type(VkPhysicalDevice &physicalDevice,
+                                          MemoryUsage usage,
+                                          uint32_t type_bits = ~0u) {
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memory_properties);
+
+  VkMemoryPropertyFlags required = 0;
+  VkMemoryPropertyFlags preferred = 0;
+  VkMemoryPropertyFlags avoided = 0;
+  switch (usage) {
+  case MemoryUsage::DeviceLocal:
+    required = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    avoided = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    break;
+  case MemoryUsage::Upload:
+    required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    preferred = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    avoided = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    break;
+  case MemoryUsage::Readback:
+    required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    break;
+  }
+
+  std::optional<uint32_t> selected;
+  int best_score = -1;
+  for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+    VkMemoryPropertyFlags flags =
+        memory_properties.memoryTypes[i].propertyFlags;
+    if (!(type_bits & (1u << i)) || (flags & required) != required) {
+      continue;
+    }
+    // Preferred flags outweigh avoided ones, cached counts most for readback
+    int score =
+        2 * static_cast<int>(std::bitset<32>(flags & preferred).count()) +
+        ((flags & avoided) ? 0 : 1);
+    if (usage == MemoryUsage::Readback &&
+        (flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) {
+      score += 2;
+    }
+    if (score > best_score) {
+      best_score = score;
+      selected = i;
+    }
+  }
+
+  if (!selected && usage == MemoryUsage::DeviceLocal) {
+    spdlog::warn("No device local memory type found, using host memory.");
+    return query_memory_type(physicalDevice, MemoryUsage::Upload, type_bits);
+  }
+  if (selected) {
+    SPDLOG_DEBUG("Selected memory index {} for {}", selected.value(),
+                 static_cast<int>(usage));
+  } else {
+    spdlog::warn("No suitable memory type found.");
+  }
+  return selected;
+}
+
 VkDeviceMemory bind_buffer(const VkDevice &device, VkBuffer &buffer,
                            int memory_type, int size) {
   VkMemoryRequirements memory_requirements;
@@ -264,7 +839,7 @@ VkDeviceMemory bind_buffer(const VkDevice &device, VkBuffer &buffer,
   memory_allocate_info.allocationSize = memory_requirements.size;
   memory_allocate_info.memoryTypeIndex = memory_type;
 
-  spdlog::info("Memory requirements size: {}", memory_requirements.size);
+  SPDLOG_TRACE("Memory requirements size: {}", memory_requirements.size);
 
   VkDeviceMemory memory;
   VkResult result =
@@ -280,123 +855,662 @@ VkDeviceMemory bind_buffer(const VkDevice &device, VkBuffer &buffer,
     throw std::runtime_error("Failed to bind memory to buffers.");
   }
 
-  spdlog::info("Memory bound to buffers successfully");
+  SPDLOG_TRACE("Memory bound to buffers successfully");
   return memory;
 }
 
-template <size_t size>
-void copy_to_gpu(const VkDevice &device, VkDeviceMemory &memory,
-                 const std::array<float, size> &input) {
-  void *data;
-  VkResult result =
-      vkMapMemory(device, memory, 0, sizeof(float) * input.size(), 0, &data);
-  check(result, "Map data to GPU memory");
-  memcpy(data, input.data(), sizeof(float) * input.size());
-  vkUnmapMemory(device, memory);
-  spdlog::info("Memory copied successfully");
+/**
+ * @brief A range of device memory sub-allocated from a MemoryArena.
+ */
+struct Allocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  uint32_t memory_type = 0;
+  uint32_t block = 0;
+  void *mapped = nullptr; // persistent host pointer if host visible
+  VkDeviceSize non_coherent_atom_size = 0; // 0 if host coherent
+};
+
+/**
+ * @brief Flush host writes to `size` bytes at `offset` within a mapped,
+ * non-coherent allocation. A no-op for host coherent memory. Throws if
+ * `offset` is past the end of the allocation.
+ */
+void flush_allocation(const VkDevice &device, const Allocation &allocation,
+                      VkDeviceSize offset = 0,
+                      VkDeviceSize size = VK_WHOLE_SIZE) {
+  const VkDeviceSize atom = allocation.non_coherent_atom_size;
+  if (!allocation.mapped || atom == 0) {
+    return;
+  }
+  if (offset > allocation.size) {
+    throw std::invalid_argument("Flush offset exceeds the allocation.");
+  }
+  // Allocations in non-coherent memory are aligned and padded to the atom
+  // size, so the rounded range never leaves the allocation
+  size = std::min(size, allocation.size - offset);
+  VkDeviceSize begin = offset / atom * atom;
+  VkDeviceSize end =
+      std::min((offset + size + atom - 1) / atom * atom, allocation.size);
+  VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                            .memory = allocation.memory,
+                            .offset = allocation.offset + begin,
+                            .size = end - begin};
+  check(vkFlushMappedMemoryRanges(device, 1, &range), "Flush mapped memory");
 }
 
 /**
- * @brief A struct to hold GPU buffers, memory, and bufferinfos
- * @tparam size
+ * @brief Make device writes to `size` bytes at `offset` within a mapped,
+ * non-coherent allocation visible to the host. A no-op for host coherent
+ * memory. Throws if `offset` is past the end of the allocation.
  */
-template <size_t size> struct BufferResource {
-  BufferResource(size_t memory_type) : memory_type(memory_type), index(0) {}
-  std::array<VkBuffer, size> buffers;
-  std::array<VkDeviceMemory, size> memory;
-  std::array<VkDescriptorBufferInfo, size> bufferinfos;
-  uint32_t memory_type;
-  uint32_t index;
-  void insert(VkBuffer buffer, VkDeviceMemory mem,
-              VkDescriptorBufferInfo bufferinfo) {
-    buffers[index] = buffer;
-    memory[index] = mem;
-    bufferinfos[index] = bufferinfo;
-    index++;
+void invalidate_allocation(const VkDevice &device,
+                           const Allocation &allocation,
+                           VkDeviceSize offset = 0,
+                           VkDeviceSize size = VK_WHOLE_SIZE) {
+  const VkDeviceSize atom = allocation.non_coherent_atom_size;
+  if (!allocation.mapped || atom == 0) {
+    return;
   }
-};
+  if (offset > allocation.size) {
+    throw std::invalid_argument("Invalidate offset exceeds the allocation.");
+  }
+  size = std::min(size, allocation.size - offset);
+  VkDeviceSize begin = offset / atom * atom;
+  VkDeviceSize end =
+      std::min((offset + size + atom - 1) / atom * atom, allocation.size);
+  VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                            .memory = allocation.memory,
+                            .offset = allocation.offset + begin,
+                            .size = end - begin};
+  check(vkInvalidateMappedMemoryRanges(device, 1, &range),
+        "Invalidate mapped memory");
+}
 
-struct PipelineResource {
-  VkPipelineLayout pipeline_layout;
-  VkPipeline pipeline;
-  VkCommandBuffer command_buffer;
+/**
+ * @brief A typed view over persistently mapped memory.
+ */
+template <typename T> struct MappedSpan {
+  T *ptr = nullptr;
+  size_t count = 0;
+  T *data() const { return ptr; }
+  size_t size() const { return count; }
+  T *begin() const { return ptr; }
+  T *end() const { return ptr + count; }
+  T &operator[](size_t idx) const { return ptr[idx]; }
 };
 
-VkShaderModule create_shader_module(VkDevice &device,
-                                    const std::string &shader_file) {
-  // Read shader file
-  std::ifstream file(shader_file, std::ios::ate | std::ios::binary);
+/**
+ * @brief View `count` elements of a host visible allocation in place,
+ * defaulting to the whole allocation. Non-coherent memory still needs
+ * flush_allocation after writes and invalidate_allocation before reads.
+ */
+template <typename T>
+MappedSpan<T> mapped_span(const Allocation &allocation,
+                          size_t count = SIZE_MAX) {
+  if (!allocation.mapped) {
+    throw std::runtime_error("Allocation is not host visible.");
+  }
+  count = std::min(count, static_cast<size_t>(allocation.size / sizeof(T)));
+  return MappedSpan<T>{static_cast<T *>(allocation.mapped), count};
+}
 
-  if (!file.is_open()) {
-    throw std::runtime_error("Failed to open shader file: " + shader_file);
+/**
+ * @brief Usage statistics of a MemoryArena.
+ */
+struct ArenaStats {
+  size_t block_count = 0;
+  size_t allocation_count = 0;
+  size_t free_range_count = 0;
+  VkDeviceSize reserved = 0;     // bytes of VkDeviceMemory held
+  VkDeviceSize used = 0;         // bytes handed out, with atom padding
+  VkDeviceSize largest_free = 0; // largest contiguous free range
+  /* Fraction of free memory not usable by a single allocation (0 = none) */
+  double fragmentation() const {
+    VkDeviceSize free = reserved - used;
+    return free == 0 ? 0.0
+                     : 1.0 - static_cast<double>(largest_free) /
+                                 static_cast<double>(free);
   }
+};
 
-  size_t file_size = static_cast<size_t>(file.tellg());
-  std::vector<char> shader_data(file_size);
+enum class ArenaMode {
+  Linear,   // Bump allocation, freed all at once with reset()
+  FreeList, // First-fit allocation with individual free()
+};
 
-  file.seekg(0);
-  file.read(shader_data.data(), file_size);
-  file.close();
+/**
+ * @brief Sub-allocates buffer memory from large VkDeviceMemory blocks, one
+ * set of blocks per memory type, instead of one vkAllocateMemory per buffer.
+ *
+ * In Linear mode allocations bump a per-block offset and are released
+ * together with reset(), which suits per-step scratch buffers. In FreeList
+ * mode each block keeps a sorted list of free ranges that are coalesced on
+ * free(), which suits long-lived tensors. Both honor
+ * VkMemoryRequirements::alignment. Allocations larger than the block size get
+ * a dedicated block.
+ *
+ * Blocks in host visible memory are mapped once when they are created and
+ * stay mapped until they are freed; Allocation::mapped points into the
+ * mapping. In non-coherent memory, allocations are aligned and padded to
+ * nonCoherentAtomSize so that flushing or invalidating one never touches
+ * another.
+ */
+class MemoryArena {
+public:
+  MemoryArena(VkDevice device, VkPhysicalDevice physical_device,
+              ArenaMode mode, VkDeviceSize block_size = 64ull << 20)
+      : device(device), mode(mode), block_size(block_size) {
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    non_coherent_atom_size =
+        std::max<VkDeviceSize>(properties.limits.nonCoherentAtomSize, 1);
+  }
+  MemoryArena(const MemoryArena &) = delete;
+  MemoryArena &operator=(const MemoryArena &) = delete;
+  ~MemoryArena() { release(); }
 
-  // Create shader module
-  VkShaderModuleCreateInfo create_info{};
-  create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  create_info.codeSize = shader_data.size();
-  create_info.pCode = reinterpret_cast<const uint32_t *>(shader_data.data());
+  Allocation allocate(const VkMemoryRequirements &requirements,
+                      uint32_t memory_type) {
+    std::lock_guard<std::mutex> lock(mutex);
+    VkDeviceSize alignment = std::max<VkDeviceSize>(requirements.alignment, 1);
+    VkDeviceSize size = requirements.size;
+    if (atom_size(memory_type) > 0) {
+      alignment = std::max(alignment, non_coherent_atom_size);
+      size = align_up(size, non_coherent_atom_size);
+    }
+    for (uint32_t idx = 0; idx < blocks.size(); ++idx) {
+      Block &block = blocks[idx];
+      if (block.memory_type != memory_type || block.memory == VK_NULL_HANDLE) {
+        continue;
+      }
+      std::optional<VkDeviceSize> offset =
+          mode == ArenaMode::Linear
+              ? bump(block, size, alignment)
+              : first_fit(block, size, alignment);
+      if (offset) {
+        return record(idx, offset.value(), size);
+      }
+    }
 
-  VkShaderModule shader_module;
-  VkResult result =
-      vkCreateShaderModule(device, &create_info, nullptr, &shader_module);
+    uint32_t idx = create_block(std::max(block_size, size), memory_type);
+    std::optional<VkDeviceSize> offset =
+        mode == ArenaMode::Linear ? bump(blocks[idx], size, alignment)
+                                  : first_fit(blocks[idx], size, alignment);
+    return record(idx, offset.value(), size);
+  }
 
-  check(result, "Create shader module");
-  return shader_module;
-}
+  /* Return an allocation to its block. A no-op in Linear mode. */
+  void free(const Allocation &allocation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Block &block = blocks[allocation.block];
+    block.live--;
+    used -= allocation.size;
+    allocation_count--;
+    if (mode == ArenaMode::Linear) {
+      return;
+    }
+    auto [it, inserted] =
+        block.free_ranges.emplace(allocation.offset, allocation.size);
+    // Coalesce with the following and preceding free ranges
+    auto next = std::next(it);
+    if (next != block.free_ranges.end() &&
+        it->first + it->second == next->first) {
+      it->second += next->second;
+      block.free_ranges.erase(next);
+    }
+    if (it != block.free_ranges.begin()) {
+      auto prev = std::prev(it);
+      if (prev->first + prev->second == it->first) {
+        prev->second += it->second;
+        block.free_ranges.erase(it);
+      }
+    }
+  }
 
-template <size_t n_bindings>
-VkPipelineLayout create_pipeline_layout(VkDevice &device) {
-  VkPipelineLayout pipelineLayout{};
-  VkPipelineLayoutCreateInfo pipelineLayoutInfo{
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
-  // add the descriptor set layout
-  VkDescriptorSetLayout descriptor_set_layout{};
-  std::array<VkDescriptorSetLayoutBinding, n_bindings> uboLayoutBindings{};
+  /* Rewind every block, invalidating all outstanding allocations. */
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Block &block : blocks) {
+      block.head = 0;
+      block.live = 0;
+      block.free_ranges.clear();
+      block.free_ranges.emplace(0, block.size);
+    }
+    used = 0;
+    allocation_count = 0;
+  }
 
-  // create descriptor set layout for a compute shader pipeline
-  for (size_t idx = 0; idx < n_bindings; ++idx) {
-    uboLayoutBindings[idx] = {
-        .binding = static_cast<uint32_t>(idx),
-        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        .descriptorCount = 1,
-        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-        .pImmutableSamplers = nullptr // Optional
+  /* Free blocks without live allocations. */
+  void trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Block &block : blocks) {
+      if (block.memory != VK_NULL_HANDLE && block.live == 0) {
+        free_block(block);
+      }
+    }
+  }
+
+  /* Free all blocks, invalidating all outstanding allocations. */
+  void release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Block &block : blocks) {
+      if (block.memory != VK_NULL_HANDLE) {
+        free_block(block);
+      }
+    }
+    blocks.clear();
+    used = 0;
+    allocation_count = 0;
+  }
+
+  ArenaStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    ArenaStats stats{};
+    stats.used = used;
+    stats.allocation_count = allocation_count;
+    for (const Block &block : blocks) {
+      if (block.memory == VK_NULL_HANDLE) {
+        continue;
+      }
+      stats.block_count++;
+      stats.reserved += block.size;
+      if (mode == ArenaMode::Linear) {
+        stats.free_range_count++;
+        stats.largest_free =
+            std::max(stats.largest_free, block.size - block.head);
+        continue;
+      }
+      stats.free_range_count += block.free_ranges.size();
+      for (const auto &[offset, size] : block.free_ranges) {
+        stats.largest_free = std::max(stats.largest_free, size);
+      }
+    }
+    return stats;
+  }
+
+private:
+  struct Block {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t memory_type;
+    VkDeviceSize head;                                // Linear mode
+    std::map<VkDeviceSize, VkDeviceSize> free_ranges; // FreeList mode
+    size_t live;
+    void *mapped;
+  };
+
+  /* nonCoherentAtomSize for host visible, non-coherent types, else 0 */
+  VkDeviceSize atom_size(uint32_t memory_type) const {
+    VkMemoryPropertyFlags flags =
+        memory_properties.memoryTypes[memory_type].propertyFlags;
+    bool non_coherent = (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
+                        !(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    return non_coherent ? non_coherent_atom_size : 0;
+  }
+
+  void free_block(Block &block) {
+    if (block.mapped) {
+      vkUnmapMemory(device, block.memory);
+      block.mapped = nullptr;
+    }
+    vkFreeMemory(device, block.memory, nullptr);
+    block.memory = VK_NULL_HANDLE;
+  }
+
+  uint32_t create_block(VkDeviceSize size, uint32_t memory_type) {
+    VkMemoryAllocateInfo memory_allocate_info{
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = size,
+        .memoryTypeIndex = memory_type,
     };
+    Block block{.size = size,
+                .memory_type = memory_type,
+                .head = 0,
+                .live = 0,
+                .mapped = nullptr};
+    if (vkAllocateMemory(device, &memory_allocate_info, nullptr,
+                         &block.memory) != VK_SUCCESS) {
+      throw std::runtime_error("Failed to allocate GPU memory.");
+    }
+    if (memory_properties.memoryTypes[memory_type].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+      check(vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0,
+                        &block.mapped),
+            "Map arena block");
+    }
+    block.free_ranges.emplace(0, size);
+    SPDLOG_DEBUG("Arena block of {} bytes allocated for memory type {}", size,
+                 memory_type);
+    // Reuse the slot of a trimmed block to keep allocation indices stable
+    for (uint32_t idx = 0; idx < blocks.size(); ++idx) {
+      if (blocks[idx].memory == VK_NULL_HANDLE) {
+        blocks[idx] = std::move(block);
+        return idx;
+      }
+    }
+    blocks.push_back(std::move(block));
+    return static_cast<uint32_t>(blocks.size() - 1);
   }
 
-  VkDescriptorSetLayoutCreateInfo layoutInfo{
-      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-      .bindingCount = static_cast<uint32_t>(n_bindings),
-      .pBindings = uboLayoutBindings.data()};
+  static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
 
-  if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr,
-                                  &descriptor_set_layout) != VK_SUCCESS) {
-    throw std::runtime_error("Failed to create descriptor set layout.");
+  std::optional<VkDeviceSize> bump(Block &block, VkDeviceSize size,
+                                   VkDeviceSize alignment) {
+    VkDeviceSize offset = align_up(block.head, alignment);
+    if (offset + size > block.size) {
+      return std::nullopt;
+    }
+    block.head = offset + size;
+    return offset;
   }
 
-  pipelineLayoutInfo.setLayoutCount = 1; // number of descriptor set
-  pipelineLayoutInfo.pSetLayouts = &descriptor_set_layout;
-  VkResult result = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
-                                           &pipelineLayout);
+  std::optional<VkDeviceSize> first_fit(Block &block, VkDeviceSize size,
+                                        VkDeviceSize alignment) {
+    for (auto it = block.free_ranges.begin(); it != block.free_ranges.end();
+         ++it) {
+      auto [range_offset, range_size] = *it;
+      VkDeviceSize offset = align_up(range_offset, alignment);
+      if (offset + size > range_offset + range_size) {
+        continue;
+      }
+      block.free_ranges.erase(it);
+      if (offset > range_offset) {
+        block.free_ranges.emplace(range_offset, offset - range_offset);
+      }
+      if (offset + size < range_offset + range_size) {
+        block.free_ranges.emplace(offset + size,
+                                  range_offset + range_size - offset - size);
+      }
+      return offset;
+    }
+    return std::nullopt;
+  }
+
+  Allocation record(uint32_t idx, VkDeviceSize offset, VkDeviceSize size) {
+    Block &block = blocks[idx];
+    block.live++;
+    used += size;
+    allocation_count++;
+    return Allocation{
+        .memory = block.memory,
+        .offset = offset,
+        .size = size,
+        .memory_type = block.memory_type,
+        .block = idx,
+        .mapped = block.mapped ? static_cast<char *>(block.mapped) + offset
+                               : nullptr,
+        .non_coherent_atom_size = atom_size(block.memory_type),
+    };
+  }
+
+  VkDevice device;
+  ArenaMode mode;
+  VkDeviceSize block_size;
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  VkDeviceSize non_coherent_atom_size;
+  std::vector<Block> blocks;
+  VkDeviceSize used = 0;
+  size_t allocation_count = 0;
+  mutable std::mutex mutex;
+};
+
+/**
+ * @brief Sub-allocate memory for a buffer from an arena and bind it.
+ */
+Allocation bind_buffer(const VkDevice &device, VkBuffer &buffer,
+                       MemoryArena &arena, uint32_t memory_type) {
+  VkMemoryRequirements memory_requirements;
+  vkGetBufferMemoryRequirements(device, buffer, &memory_requirements);
+  if (!(memory_requirements.memoryTypeBits & (1u << memory_type))) {
+    throw std::runtime_error("Memory type not supported by buffer.");
+  }
 
+  Allocation allocation = arena.allocate(memory_requirements, memory_type);
+  VkResult result = vkBindBufferMemory(device, buffer, allocation.memory,
+                                       allocation.offset);
   if (result != VK_SUCCESS) {
-    throw std::runtime_error("Failed to create pipeline layout.");
+    arena.free(allocation);
+    throw std::runtime_error("Failed to bind memory to buffers.");
   }
+  return allocation;
+}
 
-  return pipelineLayout;
+enum class DType { f32, f16, i32, u32 };
+
+class DescriptorCache;
+
+size_t dtype_size(DType dtype) { return dtype == DType::f16 ? 2 : 4; }
+
+/**
+ * @brief A tensor whose shape, dtype and strides are only known at runtime.
+ *
+ * The tensor owns its buffer and the arena range it is bound to, both
+ * released when the tensor is destroyed, so it is move-only. Strides are in
+ * elements and default to a contiguous row-major layout. After track(), the
+ * descriptor sets binding the buffer are evicted from the cache on release.
+ */
+class Tensor {
+public:
+  Tensor() = default;
+  Tensor(const VkDevice &device, MemoryArena &arena, uint32_t memory_type,
+         std::vector<size_t> shape, DType dtype = DType::f32,
+         VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                    VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                    VK_BUFFER_USAGE_TRANSFER_DST_BIT)
+      : shape(std::move(shape)), dtype(dtype), device(device), arena(&arena) {
+    strides = contiguous_strides(this->shape);
+    // Owned until bound, as the destructor does not run if binding throws
+    UniqueBuffer owned(device, create_buffer_bytes(
+                                   std::max<VkDeviceSize>(bytes(), 4), device,
+                                   usage));
+    VkBuffer handle = owned;
+    allocation = bind_buffer(device, handle, arena, memory_type);
+    buffer = owned.release();
+  }
+  Tensor(const Tensor &) = delete;
+  Tensor &operator=(const Tensor &) = delete;
+  Tensor(Tensor &&other) noexcept { *this = std::move(other); }
+  Tensor &operator=(Tensor &&other) noexcept {
+    if (this != &other) {
+      release();
+      shape = std::move(other.shape);
+      strides = std::move(other.strides);
+      dtype = other.dtype;
+      buffer = std::exchange(other.buffer, VK_NULL_HANDLE);
+      allocation = other.allocation;
+      device = other.device;
+      arena = std::exchange(other.arena, nullptr);
+      descriptors = std::exchange(other.descriptors, nullptr);
+    }
+    return *this;
+  }
+  ~Tensor() { release(); }
+
+  static std::vector<size_t>
+  contiguous_strides(const std::vector<size_t> &shape) {
+    std::vector<size_t> strides(shape.size(), 1);
+    for (size_t dim = shape.size(); dim > 1; --dim) {
+      strides[dim - 2] = strides[dim - 1] * shape[dim - 1];
+    }
+    return strides;
+  }
+
+  size_t rank() const { return shape.size(); }
+  size_t numel() const {
+    size_t count = 1;
+    for (size_t extent : shape) {
+      count *= extent;
+    }
+    return count;
+  }
+  VkDeviceSize bytes() const { return numel() * dtype_size(dtype); }
+  bool is_contiguous() const { return strides == contiguous_strides(shape); }
+
+  /* Change the shape of a contiguous tensor without moving data. */
+  void reshape(std::vector<size_t> new_shape) {
+    size_t count = 1;
+    for (size_t extent : new_shape) {
+      count *= extent;
+    }
+    if (count != numel() || !is_contiguous()) {
+      throw std::runtime_error("Invalid reshape.");
+    }
+    shape = std::move(new_shape);
+    strides = contiguous_strides(shape);
+  }
+
+  VkDescriptorBufferInfo bufferinfo() const {
+    return {.buffer = buffer, .offset = 0, .range = VK_WHOLE_SIZE};
+  }
+
+  /* In place view of a host visible tensor, see mapped_span. */
+  template <typename T> MappedSpan<T> view() const {
+    if (sizeof(T) != dtype_size(dtype)) {
+      throw std::runtime_error("Tensor view element size mismatch.");
+    }
+    return mapped_span<T>(allocation, numel());
+  }
+
+  /* Evict the sets binding this tensor from `cache` when it is released.
+   * The cache must outlive the tensor. */
+  void track(DescriptorCache &cache) { descriptors = &cache; }
+
+  std::vector<size_t> shape;
+  std::vector<size_t> strides;
+  DType dtype = DType::f32;
+  VkBuffer buffer = VK_NULL_HANDLE;
+  Allocation allocation;
+
+private:
+  // Defined after DescriptorCache
+  void release();
+
+  VkDevice device = VK_NULL_HANDLE;
+  MemoryArena *arena = nullptr;
+  DescriptorCache *descriptors = nullptr;
+};
+
+void copy_to_gpu(const VkDevice &device, VkDeviceMemory &memory,
+                 const float *input, size_t count) {
+  void *data;
+  VkResult result =
+      vkMapMemory(device, memory, 0, sizeof(float) * count, 0, &data);
+  check(result, "Map data to GPU memory");
+  memcpy(data, input, sizeof(float) * count);
+  vkUnmapMemory(device, memory);
+  SPDLOG_TRACE("Memory copied successfully");
 }
 
-template <size_t n_bindings>
-VkDescriptorSetLayout create_descriptor_set_layout(VkDevice &device) {
-  std::array<VkDescriptorSetLayoutBinding, n_bindings> uboLayoutBindings{};
+template <size_t size>
+void copy_to_gpu(const VkDevice &device, VkDeviceMemory &memory,
+                 const std::array<float, size> &input) {
+  copy_to_gpu(device, memory, input.data(), input.size());
+}
+
+/**
+ * @brief A struct to hold GPU buffers, memory, and bufferinfos
+ * @tparam size
+ */
+template <size_t size> struct BufferResource {
+  BufferResource(size_t memory_type) : memory_type(memory_type), index(0) {}
+  std::array<VkBuffer, size> buffers;
+  std::array<VkDeviceMemory, size> memory;
+  std::array<VkDescriptorBufferInfo, size> bufferinfos;
+  std::array<Allocation, size> allocations{}; // set when bound from an arena
+  uint32_t memory_type;
+  uint32_t index;
+  void insert(VkBuffer buffer, VkDeviceMemory mem,
+              VkDescriptorBufferInfo bufferinfo) {
+    buffers[index] = buffer;
+    memory[index] = mem;
+    bufferinfos[index] = bufferinfo;
+    index++;
+  }
+  void insert(VkBuffer buffer, const Allocation &allocation,
+              VkDescriptorBufferInfo bufferinfo) {
+    allocations[index] = allocation;
+    insert(buffer, allocation.memory, bufferinfo);
+  }
+  /* Bind a tensor, which keeps ownership of its buffer and memory. */
+  void insert(const Tensor &tensor) {
+    insert(tensor.buffer, tensor.allocation, tensor.bufferinfo());
+  }
+};
+
+struct PipelineResource {
+  VkPipelineLayout pipeline_layout;
+  VkPipeline pipeline;
+  VkCommandBuffer command_buffer;
+};
+
+VkShaderModule create_shader_module(VkDevice &device,
+                                    const std::string &shader_file) {
+  // Read shader file
+  std::ifstream file(shader_file, std::ios::ate | std::ios::binary);
+
+  if (!file.is_open()) {
+    throw std::runtime_error("Failed to open shader file: " + shader_file);
+  }
+
+  size_t file_size = static_cast<size_t>(file.tellg());
+  std::vector<char> shader_data(file_size);
+
+  file.seekg(0);
+  file.read(shader_data.data(), file_size);
+  file.close();
+
+  // Create shader module
+  VkShaderModuleCreateInfo create_info{};
+  create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  create_info.codeSize = shader_data.size();
+  create_info.pCode = reinterpret_cast<const uint32_t *>(shader_data.data());
+
+  VkShaderModule shader_module;
+  VkResult result =
+      vkCreateShaderModule(device, &create_info, nullptr, &shader_module);
+
+  check(result, "Create shader module");
+  return shader_module;
+}
+
+VkShaderModule create_shader_module(VkDevice &device,
+                                    const ShaderCode &shader) {
+  VkShaderModuleCreateInfo create_info{
+      .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+      .codeSize = shader.size,
+      .pCode = shader.code,
+  };
+
+  VkShaderModule shader_module;
+  VkResult result =
+      vkCreateShaderModule(device, &create_info, nullptr, &shader_module);
+
+  check(result, "Create shader module");
+  return shader_module;
+}
+
+/**
+ * @brief Look up SPIR-V embedded at build time by kernel name, the
+ * shader's file name in src/ without the .glsl extension.
+ */
+const ShaderCode &find_shader(const std::string &name) {
+  for (const ShaderCode &shader : shader_registry) {
+    if (name == shader.name) {
+      return shader;
+    }
+  }
+  throw std::runtime_error("Unknown shader: " + name);
+}
+
+VkDescriptorSetLayout
+create_descriptor_set_layout(VkDevice &device, size_t n_bindings,
+                             VkDescriptorSetLayoutCreateFlags flags = 0) {
+  std::vector<VkDescriptorSetLayoutBinding> uboLayoutBindings(n_bindings);
 
   for (uint32_t idx = 0; idx < n_bindings; ++idx) {
     uboLayoutBindings[idx] = {.binding = idx,
@@ -409,6 +1523,7 @@ VkDescriptorSetLayout create_descriptor_set_layout(VkDevice &device) {
 
   VkDescriptorSetLayoutCreateInfo layoutInfo{
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .flags = flags,
       .bindingCount = static_cast<uint32_t>(n_bindings),
       .pBindings = uboLayoutBindings.data()};
 
@@ -420,6 +1535,60 @@ VkDescriptorSetLayout create_descriptor_set_layout(VkDevice &device) {
   return descriptorSetLayout;
 }
 
+template <size_t n_bindings>
+VkDescriptorSetLayout create_descriptor_set_layout(VkDevice &device) {
+  return create_descriptor_set_layout(device, n_bindings);
+}
+
+/**
+ * @brief A push constant range of a `T` at `offset`, visible to compute
+ * shaders.
+ */
+template <typename T>
+VkPushConstantRange push_constant_range(uint32_t offset = 0) {
+  return {.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+          .offset = offset,
+          .size = static_cast<uint32_t>(sizeof(T))};
+}
+
+/**
+ * @brief Create a pipeline layout with a single descriptor set and the given
+ * push constant ranges.
+ */
+VkPipelineLayout
+create_pipeline_layout(VkDevice &device, VkDescriptorSetLayout set_layout,
+                       const std::vector<VkPushConstantRange> &ranges = {}) {
+  VkPipelineLayout pipelineLayout{};
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  pipelineLayoutInfo.setLayoutCount = 1; // number of descriptor set
+  pipelineLayoutInfo.pSetLayouts = &set_layout;
+  pipelineLayoutInfo.pushConstantRangeCount =
+      static_cast<uint32_t>(ranges.size());
+  pipelineLayoutInfo.pPushConstantRanges = ranges.data();
+  VkResult result = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
+                                           &pipelineLayout);
+
+  if (result != VK_SUCCESS) {
+    throw std::runtime_error("Failed to create pipeline layout.");
+  }
+
+  return pipelineLayout;
+}
+
+VkPipelineLayout create_pipeline_layout(VkDevice &device, size_t n_bindings) {
+  // The pipeline layout does not reference the descriptor set layout after
+  // it is created, so the set layout is not kept.
+  UniqueDescriptorSetLayout descriptor_set_layout(
+      device, create_descriptor_set_layout(device, n_bindings));
+  return create_pipeline_layout(device, descriptor_set_layout.get());
+}
+
+template <size_t n_bindings>
+VkPipelineLayout create_pipeline_layout(VkDevice &device) {
+  return create_pipeline_layout(device, n_bindings);
+}
+
 VkDescriptorBufferInfo create_descriptor_buffer_info(VkBuffer &buffer) {
   VkDescriptorBufferInfo bufferInfo{
       .buffer = buffer, .offset = 0, .range = VK_WHOLE_SIZE};
@@ -427,6 +1596,25 @@ VkDescriptorBufferInfo create_descriptor_buffer_info(VkBuffer &buffer) {
   return bufferInfo;
 }
 
+std::vector<VkWriteDescriptorSet>
+create_descriptor_writes(VkDescriptorSet &descriptorSet, size_t n_bindings) {
+  std::vector<VkWriteDescriptorSet> descriptorWrites(n_bindings);
+
+  for (size_t idx = 0; idx < n_bindings; ++idx) {
+    descriptorWrites[idx] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                             .dstSet = descriptorSet,
+                             .dstBinding = static_cast<uint32_t>(idx),
+                             .dstArrayElement = 0,
+                             .descriptorCount = 1,
+                             .descriptorType =
+                                 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                             .pImageInfo = nullptr,
+                             .pTexelBufferView = nullptr};
+  }
+
+  return descriptorWrites;
+}
+
 template <size_t n_bindings>
 std::array<VkWriteDescriptorSet, n_bindings>
 create_descriptor_writes(VkDescriptorSet &descriptorSet) {
@@ -447,13 +1635,19 @@ create_descriptor_writes(VkDescriptorSet &descriptorSet) {
   return descriptorWrites;
 }
 
-VkDescriptorPool create_descriptor_pool(VkDevice &device) {
+/**
+ * @brief Create a pool of `max_sets` descriptor sets sharing
+ * `descriptor_count` storage buffer descriptors.
+ */
+VkDescriptorPool create_descriptor_pool(VkDevice &device,
+                                        uint32_t max_sets = 1,
+                                        uint32_t descriptor_count = 3) {
   VkDescriptorPoolSize poolSize{.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-                                .descriptorCount = 3};
+                                .descriptorCount = descriptor_count};
 
   VkDescriptorPoolCreateInfo poolInfo{
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-      .maxSets = 1,
+      .maxSets = max_sets,
       .poolSizeCount = 1,
       .pPoolSizes = &poolSize,
   };
@@ -466,34 +1660,227 @@ VkDescriptorPool create_descriptor_pool(VkDevice &device) {
   return descriptorPool;
 }
 
-VkPipeline create_pipeline(VkDevice &device, VkPipelineLayout &pipelineLayout,
-                           VkShaderModule &shaderModule,
-                           const std::array<uint32_t, 3> &workgroup_size) {
-  std::array<VkSpecializationMapEntry, 3> map_entries{{
-      {.constantID = 0, .offset = 0, .size = sizeof(uint32_t)},
-      {.constantID = 1, .offset = sizeof(uint32_t), .size = sizeof(uint32_t)},
-      {.constantID = 2,
-       .offset = 2 * sizeof(uint32_t),
-       .size = sizeof(uint32_t)},
-  }};
+/**
+ * @brief Pipeline cache hit/miss counts and creation times.
+ */
+struct PipelineCacheStats {
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+  uint32_t unknown = 0; // driver did not report creation feedback
+  double hit_ms = 0.0;
+  double miss_ms = 0.0;
+  double unknown_ms = 0.0;
+};
 
-  spdlog::info("Workgroup size: {} {} {}", workgroup_size[0], workgroup_size[1],
-               workgroup_size[2]);
+/**
+ * @brief A VkPipelineCache shared by all pipelines and persisted to disk.
+ *
+ * The cache blob is loaded when the cache is created and saved when it is
+ * destroyed (or with save()). The file starts with a header recording the
+ * vendor ID, device ID, driver version, pipeline cache UUID and device UUID
+ * it was produced with; a blob written by a different device or driver is
+ * ignored rather than handed to the driver. Pipeline creation reports cache
+ * hits and misses through VK_PIPELINE_CREATION_FEEDBACK on Vulkan 1.3
+ * devices, together with the creation time.
+ */
+class PipelineCache {
+public:
+  PipelineCache(VkDevice device, VkPhysicalDevice physical_device,
+                std::string path)
+      : device(device), path(std::move(path)) {
+    VkPhysicalDeviceIDProperties id_properties{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+    };
+    VkPhysicalDeviceProperties2 properties{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &id_properties,
+    };
+    vkGetPhysicalDeviceProperties2(physical_device, &properties);
+    header.vendor_id = properties.properties.vendorID;
+    header.device_id = properties.properties.deviceID;
+    header.driver_version = properties.properties.driverVersion;
+    memcpy(header.pipeline_cache_uuid, properties.properties.pipelineCacheUUID,
+           VK_UUID_SIZE);
+    memcpy(header.device_uuid, id_properties.deviceUUID, VK_UUID_SIZE);
+    feedback_supported =
+        properties.properties.apiVersion >= VK_API_VERSION_1_3;
 
-  VkSpecializationInfo specialization_info{
-      .mapEntryCount = static_cast<uint32_t>(map_entries.size()),
-      .pMapEntries = map_entries.data(),
-      .dataSize = sizeof(uint32_t) * workgroup_size.size(),
-      .pData = workgroup_size.data(),
-  };
+    std::vector<char> blob = load();
+    VkPipelineCacheCreateInfo create_info{
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = blob.size(),
+        .pInitialData = blob.empty() ? nullptr : blob.data(),
+    };
+    check(vkCreatePipelineCache(device, &create_info, nullptr, &cache),
+          "Create pipeline cache");
+  }
+  PipelineCache(const PipelineCache &) = delete;
+  PipelineCache &operator=(const PipelineCache &) = delete;
+  ~PipelineCache() {
+    try {
+      save();
+    } catch (const std::exception &e) {
+      spdlog::error("Failed to save pipeline cache: {}", e.what());
+    }
+    vkDestroyPipelineCache(device, cache, nullptr);
+  }
 
-  VkPipelineShaderStageCreateInfo shaderStageInfo{
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
-      .module = shaderModule,
-      .pName = "main",
-      .pSpecializationInfo = &specialization_info,
-  };
+  VkPipelineCache handle() const { return cache; }
+  bool creation_feedback() const { return feedback_supported; }
+
+  /* Write the cache blob, replacing the file atomically. */
+  void save() {
+    size_t size = 0;
+    check(vkGetPipelineCacheData(device, cache, &size, nullptr),
+          "Get pipeline cache size");
+    std::vector<char> blob(size);
+    check(vkGetPipelineCacheData(device, cache, &size, blob.data()),
+          "Get pipeline cache data");
+    header.data_size = size;
+
+    std::string tmp_path = path + ".tmp";
+    {
+      std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+      if (!file.is_open()) {
+        throw std::runtime_error("Failed to open pipeline cache file: " +
+                                 tmp_path);
+      }
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(blob.data(), static_cast<std::streamsize>(size));
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+      throw std::runtime_error("Failed to write pipeline cache file: " + path);
+    }
+    spdlog::info("Saved {} byte pipeline cache to {}", size, path);
+    PipelineCacheStats current = stats();
+    spdlog::info("Pipeline cache: {} hits ({:.2f} ms), {} misses ({:.2f} ms), "
+                 "{} unreported ({:.2f} ms)",
+                 current.hits, current.hit_ms, current.misses, current.miss_ms,
+                 current.unknown, current.unknown_ms);
+  }
+
+  /* Record the outcome of one pipeline creation. */
+  void record(const VkPipelineCreationFeedback &feedback, double ms) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!(feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT)) {
+      cache_stats.unknown++;
+      cache_stats.unknown_ms += ms;
+    } else if (feedback.flags &
+               VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT) {
+      cache_stats.hits++;
+      cache_stats.hit_ms += ms;
+    } else {
+      cache_stats.misses++;
+      cache_stats.miss_ms += ms;
+    }
+  }
+
+  PipelineCacheStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return cache_stats;
+  }
+
+private:
+  struct FileHeader {
+    char magic[4] = {'V', 'K', 'C', 'P'};
+    uint32_t version = 1;
+    uint32_t vendor_id = 0;
+    uint32_t device_id = 0;
+    uint32_t driver_version = 0;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE] = {};
+    uint8_t device_uuid[VK_UUID_SIZE] = {};
+    uint32_t reserved = 0; // keeps the header free of padding bytes
+    uint64_t data_size = 0;
+  };
+
+  /* Read the cache blob if the file matches this device and driver. */
+  std::vector<char> load() {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      spdlog::info("No pipeline cache at {}, starting cold", path);
+      return {};
+    }
+    FileHeader file_header{};
+    file.read(reinterpret_cast<char *>(&file_header), sizeof(file_header));
+    FileHeader expected = header;
+    expected.data_size = file_header.data_size;
+    if (!file || memcmp(&file_header, &expected, sizeof(FileHeader)) != 0) {
+      spdlog::warn("Pipeline cache {} is for another device or driver, "
+                   "ignoring it",
+                   path);
+      return {};
+    }
+    std::vector<char> blob(file_header.data_size);
+    file.read(blob.data(), static_cast<std::streamsize>(blob.size()));
+    if (!file || blob.size() < sizeof(VkPipelineCacheHeaderVersionOne)) {
+      spdlog::warn("Pipeline cache {} is truncated, ignoring it", path);
+      return {};
+    }
+    // The driver validates the blob as well, but check its own header to
+    // avoid handing it data for another device
+    VkPipelineCacheHeaderVersionOne blob_header;
+    memcpy(&blob_header, blob.data(), sizeof(blob_header));
+    if (blob_header.vendorID != header.vendor_id ||
+        blob_header.deviceID != header.device_id ||
+        memcmp(blob_header.pipelineCacheUUID, header.pipeline_cache_uuid,
+               VK_UUID_SIZE) != 0) {
+      spdlog::warn("Pipeline cache {} has a mismatched blob, ignoring it",
+                   path);
+      return {};
+    }
+    spdlog::info("Loaded {} byte pipeline cache from {}", blob.size(), path);
+    return blob;
+  }
+
+  VkDevice device;
+  std::string path;
+  FileHeader header;
+  VkPipelineCache cache = VK_NULL_HANDLE;
+  bool feedback_supported = false;
+  PipelineCacheStats cache_stats;
+  mutable std::mutex mutex;
+};
+
+/**
+ * @brief Create a compute pipeline.
+ *
+ * The workgroup size is passed as specialization constants 0, 1 and 2
+ * (`local_size_x_id` etc. in the shader). Any additional `constants` are
+ * passed as specialization constants 3, 4, ... in order. Pipelines created
+ * with a `cache` reuse and extend it, and report cache hits and timing to it.
+ */
+VkPipeline create_pipeline(VkDevice &device, VkPipelineLayout &pipelineLayout,
+                           VkShaderModule &shaderModule,
+                           const std::array<uint32_t, 3> &workgroup_size,
+                           const std::vector<uint32_t> &constants = {},
+                           PipelineCache *cache = nullptr) {
+  std::vector<uint32_t> spec_data(workgroup_size.begin(),
+                                  workgroup_size.end());
+  spec_data.insert(spec_data.end(), constants.begin(), constants.end());
+  std::vector<VkSpecializationMapEntry> map_entries(spec_data.size());
+  for (uint32_t idx = 0; idx < spec_data.size(); ++idx) {
+    map_entries[idx] = {.constantID = idx,
+                        .offset = idx * static_cast<uint32_t>(sizeof(uint32_t)),
+                        .size = sizeof(uint32_t)};
+  }
+
+  SPDLOG_DEBUG("Workgroup size: {} {} {}", workgroup_size[0], workgroup_size[1],
+               workgroup_size[2]);
+
+  VkSpecializationInfo specialization_info{
+      .mapEntryCount = static_cast<uint32_t>(map_entries.size()),
+      .pMapEntries = map_entries.data(),
+      .dataSize = sizeof(uint32_t) * spec_data.size(),
+      .pData = spec_data.data(),
+  };
+
+  VkPipelineShaderStageCreateInfo shaderStageInfo{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+      .module = shaderModule,
+      .pName = "main",
+      .pSpecializationInfo = &specialization_info,
+  };
 
   VkComputePipelineCreateInfo pipelineInfo{
       .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
@@ -501,20 +1888,50 @@ VkPipeline create_pipeline(VkDevice &device, VkPipelineLayout &pipelineLayout,
       .layout = pipelineLayout,
   };
 
-  const VkSpecializationInfo *spec_info =
-      pipelineInfo.stage.pSpecializationInfo;
-  const uint32_t *data = reinterpret_cast<const uint32_t *>(spec_info->pData);
-  spdlog::info("Check workgroup size: {} {} {}", data[0], data[1], data[2]);
+  VkPipelineCreationFeedback feedback{};
+  VkPipelineCreationFeedbackCreateInfo feedback_info{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO,
+      .pPipelineCreationFeedback = &feedback,
+      .pipelineStageCreationFeedbackCount = 0,
+  };
+  if (cache && cache->creation_feedback()) {
+    pipelineInfo.pNext = &feedback_info;
+  }
 
+  auto start = std::chrono::steady_clock::now();
   VkPipeline pipeline{};
-  VkResult result = vkCreateComputePipelines(device, VK_NULL_HANDLE, 1,
-                                             &pipelineInfo, nullptr, &pipeline);
+  VkResult result = vkCreateComputePipelines(
+      device, cache ? cache->handle() : VK_NULL_HANDLE, 1, &pipelineInfo,
+      nullptr, &pipeline);
   check(result, "Pipeline creation.");
+  if (cache) {
+    cache->record(feedback,
+                  std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count());
+  }
 
-  spdlog::info("Pipeline created successfully");
+  SPDLOG_TRACE("Pipeline created successfully");
   return pipeline;
 }
 
+/**
+ * @brief A descriptor set and the layout it was allocated with.
+ *
+ * Sets created by create_descriptor_sets own their layout and pool. Sets
+ * handed out by a DescriptorCache borrow both from the cache. With push
+ * descriptors there is no set: `buffers` are pushed when the set is bound
+ * with bind_descriptor_set.
+ */
+struct DescriptorSet {
+  UniqueDescriptorSetLayout owned_layout; // empty if the layout is cached
+  UniqueDescriptorPool pool;              // empty if the set is cached
+  VkDescriptorSetLayout layout = VK_NULL_HANDLE;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  std::vector<VkDescriptorBufferInfo> buffers; // push descriptors only
+  PFN_vkCmdPushDescriptorSetKHR push = nullptr;
+};
+
 VkDescriptorSet
 create_descriptor_set(VkDevice &device, VkDescriptorPool &pool,
                       const std::array<VkDescriptorSetLayout, 1> &layouts) {
@@ -555,6 +1972,20 @@ void gpu_alloc(const VkDevice &device, size_t size, VkBufferUsageFlags flags,
   buffers.insert(buffer, memory, bufferinfo);
 }
 
+/**
+ * @brief Allocate a buffer on the GPU, sub-allocating its memory from an
+ * arena rather than with a dedicated vkAllocateMemory.
+ */
+template <size_t n_bindings>
+void gpu_alloc(const VkDevice &device, size_t size, VkBufferUsageFlags flags,
+               BufferResource<n_bindings> &buffers, MemoryArena &arena) {
+  VkBuffer buffer = vkc::create_buffer(size, device, flags);
+  Allocation allocation =
+      vkc::bind_buffer(device, buffer, arena, buffers.memory_type);
+  buffers.insert(buffer, allocation,
+                 vkc::create_descriptor_buffer_info(buffer));
+}
+
 /**
  * @brief Create a descriptor set, updates device with descriptor writes
  * information.
@@ -563,17 +1994,20 @@ void gpu_alloc(const VkDevice &device, size_t size, VkBufferUsageFlags flags,
  * @param buffers
  */
 template <size_t n_bindings>
-VkDescriptorSet create_descriptor_sets(VkDevice &device,
-                                       BufferResource<n_bindings> &buffers) {
-  VkDescriptorSetLayout descriptor_set_layout =
-      vkc::create_descriptor_set_layout<n_bindings>(device);
-  std::array<VkDescriptorSetLayout, 1> descriptor_set_layouts = {
-      descriptor_set_layout};
-  VkDescriptorPool descriptor_pool = vkc::create_descriptor_pool(device);
-  VkDescriptorSet descriptor_set = vkc::create_descriptor_set(
-      device, descriptor_pool, descriptor_set_layouts);
+DescriptorSet create_descriptor_sets(VkDevice &device,
+                                     BufferResource<n_bindings> &buffers) {
+  DescriptorSet descriptor_set;
+  descriptor_set.owned_layout = UniqueDescriptorSetLayout(
+      device, vkc::create_descriptor_set_layout<n_bindings>(device));
+  descriptor_set.layout = descriptor_set.owned_layout;
+  descriptor_set.pool =
+      UniqueDescriptorPool(device, vkc::create_descriptor_pool(
+                                       device, 1, n_bindings));
+  VkDescriptorPool descriptor_pool = descriptor_set.pool;
+  descriptor_set.set = vkc::create_descriptor_set(
+      device, descriptor_pool, {descriptor_set.layout});
   std::array<VkWriteDescriptorSet, n_bindings> descriptorWrites =
-      vkc::create_descriptor_writes<n_bindings>(descriptor_set);
+      vkc::create_descriptor_writes<n_bindings>(descriptor_set.set);
   for (size_t i = 0; i < n_bindings; i++) {
     descriptorWrites[i].pBufferInfo = &buffers.bufferinfos[i];
   }
@@ -582,10 +2016,314 @@ VkDescriptorSet create_descriptor_sets(VkDevice &device,
   return descriptor_set;
 }
 
-VkCommandPool create_command_pool(VkDevice &device, uint32_t queueFamilyIndex) {
+/**
+ * @brief Create a descriptor set binding each buffer in `buffers` to the
+ * binding of the same index.
+ */
+DescriptorSet create_descriptor_sets(VkDevice &device,
+                                     const std::vector<VkBuffer> &buffers) {
+  DescriptorSet descriptor_set;
+  descriptor_set.owned_layout = UniqueDescriptorSetLayout(
+      device, vkc::create_descriptor_set_layout(device, buffers.size()));
+  descriptor_set.layout = descriptor_set.owned_layout;
+  descriptor_set.pool =
+      UniqueDescriptorPool(device, vkc::create_descriptor_pool(
+                                       device, 1,
+                                       static_cast<uint32_t>(buffers.size())));
+  VkDescriptorPool descriptor_pool = descriptor_set.pool;
+  descriptor_set.set = vkc::create_descriptor_set(
+      device, descriptor_pool, {descriptor_set.layout});
+  std::vector<VkDescriptorBufferInfo> bufferinfos(buffers.size());
+  std::vector<VkWriteDescriptorSet> descriptorWrites =
+      vkc::create_descriptor_writes(descriptor_set.set, buffers.size());
+  for (size_t i = 0; i < buffers.size(); i++) {
+    bufferinfos[i] = {
+        .buffer = buffers[i], .offset = 0, .range = VK_WHOLE_SIZE};
+    descriptorWrites[i].pBufferInfo = &bufferinfos[i];
+  }
+  vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()),
+                         descriptorWrites.data(), 0, nullptr);
+  return descriptor_set;
+}
+
+template <size_t n_bindings>
+DescriptorSet
+create_descriptor_sets(VkDevice &device,
+                       const std::array<VkBuffer, n_bindings> &buffers) {
+  return create_descriptor_sets(
+      device, std::vector<VkBuffer>(buffers.begin(), buffers.end()));
+}
+
+/**
+ * @brief Allocates descriptor sets from a growing list of pools.
+ *
+ * When the current pool runs out, the next one is used, and a new pool twice
+ * the size of the last (up to `max_sets_per_pool` sets) is created when none
+ * is left. Sets given back with free() are reused by later allocations of
+ * the same layout, and reset() returns every set to its pool at once.
+ */
+class DescriptorAllocator {
+public:
+  explicit DescriptorAllocator(VkDevice device, uint32_t sets_per_pool = 16,
+                               uint32_t max_sets_per_pool = 1024,
+                               uint32_t descriptors_per_set = 8)
+      : device(device), next_pool_sets(sets_per_pool),
+        max_sets_per_pool(max_sets_per_pool),
+        descriptors_per_set(descriptors_per_set) {}
+
+  DescriptorAllocator(const DescriptorAllocator &) = delete;
+  DescriptorAllocator &operator=(const DescriptorAllocator &) = delete;
+
+  VkDescriptorSet allocate(VkDescriptorSetLayout layout) {
+    std::vector<VkDescriptorSet> &reusable = free_sets[layout];
+    if (!reusable.empty()) {
+      VkDescriptorSet set = reusable.back();
+      reusable.pop_back();
+      return set;
+    }
+    while (true) {
+      if (current == pools.size()) {
+        grow();
+      }
+      VkDescriptorSetAllocateInfo allocate_info{
+          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+          .descriptorPool = pools[current],
+          .descriptorSetCount = 1,
+          .pSetLayouts = &layout,
+      };
+      VkDescriptorSet set;
+      VkResult result = vkAllocateDescriptorSets(device, &allocate_info, &set);
+      if (result == VK_ERROR_OUT_OF_POOL_MEMORY ||
+          result == VK_ERROR_FRAGMENTED_POOL) {
+        current++;
+        continue;
+      }
+      check(result, "Descriptor set allocation.");
+      return set;
+    }
+  }
+
+  /* Give back a set of `layout` no pending command buffer uses. */
+  void free(VkDescriptorSetLayout layout, VkDescriptorSet set) {
+    free_sets[layout].push_back(set);
+  }
+
+  /* Free every set allocated so far. The pools are kept for reuse. */
+  void reset() {
+    for (UniqueDescriptorPool &pool : pools) {
+      check(vkResetDescriptorPool(device, pool, 0), "Reset descriptor pool.");
+    }
+    current = 0;
+    free_sets.clear();
+  }
+
+  size_t pool_count() const { return pools.size(); }
+
+private:
+  void grow() {
+    VkDevice device_handle = device;
+    pools.emplace_back(device,
+                       create_descriptor_pool(device_handle, next_pool_sets,
+                                              next_pool_sets *
+                                                  descriptors_per_set));
+    SPDLOG_DEBUG("Descriptor pool {} of {} sets", pools.size(),
+                 next_pool_sets);
+    next_pool_sets = std::min(next_pool_sets * 2, max_sets_per_pool);
+  }
+
+  VkDevice device;
+  uint32_t next_pool_sets;
+  uint32_t max_sets_per_pool;
+  uint32_t descriptors_per_set;
+  std::vector<UniqueDescriptorPool> pools;
+  size_t current = 0; // pool allocated from, earlier pools are full
+  std::map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> free_sets;
+};
+
+/**
+ * @brief Descriptor set layouts and sets shared across kernels.
+ *
+ * Layouts are created once per binding count. Sets are cached by the buffer
+ * ranges they bind, so creating several kernels over the same buffers (or
+ * recreating one) reuses a single set, and new sets are allocated from a
+ * DescriptorAllocator rather than a pool per set. When the device has
+ * VK_KHR_push_descriptor, layouts are created for push descriptors and no
+ * sets are allocated at all; the buffers are pushed when recording.
+ *
+ * A cached set still refers to its buffers, so it must be evicted before
+ * the buffer is destroyed, as a reused handle would hit the stale set.
+ * Tensors do so on release once track()ed; for other buffers call evict(),
+ * or clear() to drop every set. Safe to use from several threads.
+ */
+class DescriptorCache {
+public:
+  DescriptorCache(VkDevice device, const DeviceCapabilities &capabilities)
+      : device(device), allocator(device) {
+    if (capabilities.push_descriptor) {
+      push = reinterpret_cast<PFN_vkCmdPushDescriptorSetKHR>(
+          vkGetDeviceProcAddr(device, "vkCmdPushDescriptorSetKHR"));
+    }
+  }
+
+  DescriptorCache(const DescriptorCache &) = delete;
+  DescriptorCache &operator=(const DescriptorCache &) = delete;
+
+  /* The set layout of `n_bindings` storage buffers. */
+  VkDescriptorSetLayout layout(size_t n_bindings) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return layout_locked(n_bindings);
+  }
+
+  /**
+   * @brief A descriptor set binding each range in `buffers` to the binding of
+   * the same index. The set is borrowed from the cache.
+   */
+  DescriptorSet bind(const std::vector<VkDescriptorBufferInfo> &buffers) {
+    std::lock_guard<std::mutex> lock(mutex);
+    DescriptorSet descriptor_set;
+    descriptor_set.layout = layout_locked(buffers.size());
+    if (push) {
+      descriptor_set.buffers = buffers;
+      descriptor_set.push = push;
+      return descriptor_set;
+    }
+
+    SetKey key;
+    for (const VkDescriptorBufferInfo &info : buffers) {
+      key.emplace_back(info.buffer, info.offset, info.range);
+    }
+    auto it = sets.find(key);
+    if (it != sets.end()) {
+      set_hits++;
+      descriptor_set.set = it->second;
+      return descriptor_set;
+    }
+
+    set_misses++;
+    descriptor_set.set = allocator.allocate(descriptor_set.layout);
+    std::vector<VkWriteDescriptorSet> writes =
+        create_descriptor_writes(descriptor_set.set, buffers.size());
+    for (size_t i = 0; i < buffers.size(); i++) {
+      writes[i].pBufferInfo = &buffers[i];
+    }
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()),
+                           writes.data(), 0, nullptr);
+    sets.emplace(std::move(key), descriptor_set.set);
+    return descriptor_set;
+  }
+
+  DescriptorSet bind(const std::vector<VkBuffer> &buffers) {
+    std::vector<VkDescriptorBufferInfo> infos;
+    for (VkBuffer buffer : buffers) {
+      infos.push_back(create_descriptor_buffer_info(buffer));
+    }
+    return bind(infos);
+  }
+
+  /**
+   * @brief Free the sets that bind `buffer` back to the allocator, to be
+   * rewritten for other buffers. No pending command buffer may use them.
+   */
+  void evict(VkBuffer buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = sets.begin(); it != sets.end();) {
+      bool binds_buffer = false;
+      for (auto &[bound, offset, range] : it->first) {
+        binds_buffer |= bound == buffer;
+      }
+      if (!binds_buffer) {
+        ++it;
+        continue;
+      }
+      allocator.free(layout_locked(it->first.size()), it->second);
+      it = sets.erase(it);
+    }
+  }
+
+  /* Free every cached set. Sets handed out earlier must no longer be used. */
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    sets.clear();
+    allocator.reset();
+  }
+
+  bool push_descriptors() const { return push != nullptr; }
+  uint64_t hits() const { return set_hits.load(std::memory_order_relaxed); }
+  uint64_t misses() const {
+    return set_misses.load(std::memory_order_relaxed);
+  }
+
+private:
+  using SetKey = std::vector<std::tuple<VkBuffer, VkDeviceSize, VkDeviceSize>>;
+
+  VkDescriptorSetLayout layout_locked(size_t n_bindings) {
+    auto it = layouts.find(n_bindings);
+    if (it == layouts.end()) {
+      VkDescriptorSetLayoutCreateFlags flags =
+          push ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0;
+      it = layouts
+               .emplace(n_bindings,
+                        UniqueDescriptorSetLayout(
+                            device, create_descriptor_set_layout(
+                                        device, n_bindings, flags)))
+               .first;
+    }
+    return it->second;
+  }
+
+  VkDevice device;
+  PFN_vkCmdPushDescriptorSetKHR push = nullptr;
+  std::map<size_t, UniqueDescriptorSetLayout> layouts;
+  // Sets are freed with the allocator's pools, so it is declared first
+  DescriptorAllocator allocator;
+  std::map<SetKey, VkDescriptorSet> sets;
+  // Atomic so hits() and misses() can be read without the mutex
+  std::atomic<uint64_t> set_hits{0};
+  std::atomic<uint64_t> set_misses{0};
+  std::mutex mutex;
+};
+
+void Tensor::release() {
+  if (arena != nullptr) {
+    if (descriptors != nullptr) {
+      descriptors->evict(buffer);
+      descriptors = nullptr;
+    }
+    vkDestroyBuffer(device, buffer, nullptr);
+    arena->free(allocation);
+    arena = nullptr;
+  }
+}
+
+/**
+ * @brief Bind `descriptor_set` to set 0 of `pipeline_layout` for compute,
+ * pushing its buffers if it uses push descriptors.
+ */
+void bind_descriptor_set(VkCommandBuffer command_buffer,
+                         VkPipelineLayout pipeline_layout,
+                         const DescriptorSet &descriptor_set) {
+  if (!descriptor_set.push) {
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            pipeline_layout, 0, 1, &descriptor_set.set, 0,
+                            nullptr);
+    return;
+  }
+  VkDescriptorSet no_set = VK_NULL_HANDLE;
+  std::vector<VkWriteDescriptorSet> writes =
+      create_descriptor_writes(no_set, descriptor_set.buffers.size());
+  for (size_t i = 0; i < writes.size(); i++) {
+    writes[i].pBufferInfo = &descriptor_set.buffers[i];
+  }
+  descriptor_set.push(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      pipeline_layout, 0,
+                      static_cast<uint32_t>(writes.size()), writes.data());
+}
+
+VkCommandPool create_command_pool(VkDevice &device, uint32_t queueFamilyIndex,
+                                  VkCommandPoolCreateFlags flags = 0) {
   VkCommandPoolCreateInfo poolInfo{
       .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-      .flags = 0, // Optional
+      .flags = flags,
       .queueFamilyIndex = queueFamilyIndex,
   };
 
@@ -614,15 +2352,2241 @@ VkCommandBuffer create_command_buffer(VkDevice &device,
   return commandBuffer;
 }
 
-template <size_t size>
-void copy_to_cpu(VkDevice &device, VkDeviceMemory &buffer,
-                 std::array<float, size> &data) {
+/**
+ * @brief Lock-free multi-producer, single-consumer queue. push() may be
+ * called from any thread; drain() takes everything pushed so far, oldest
+ * first, and must only be called by one thread at a time.
+ */
+template <typename T> class MpscQueue {
+public:
+  MpscQueue() = default;
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  ~MpscQueue() {
+    Node *node = head.load(std::memory_order_acquire);
+    while (node) {
+      Node *next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  void push(T value) {
+    Node *node =
+        new Node{std::move(value), head.load(std::memory_order_relaxed)};
+    while (!head.compare_exchange_weak(node->next, node,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+
+  /* Append every queued item to `out`, oldest first, and return how many. */
+  size_t drain(std::vector<T> &out) {
+    // Producers push onto a stack; taking it whole avoids ABA, and reversing
+    // it restores push order
+    Node *node = head.exchange(nullptr, std::memory_order_acquire);
+    size_t first = out.size();
+    while (node) {
+      out.push_back(std::move(node->value));
+      Node *next = node->next;
+      delete node;
+      node = next;
+    }
+    std::reverse(out.begin() + first, out.end());
+    return out.size() - first;
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == nullptr;
+  }
+
+private:
+  struct Node {
+    T value;
+    Node *next;
+  };
+  std::atomic<Node *> head{nullptr};
+};
+
+/**
+ * @brief A command pool per thread for one queue family, so threads record
+ * command buffers concurrently without sharing a pool (command pools are
+ * externally synchronized).
+ *
+ * acquire() takes a command buffer from the calling thread's pool, created
+ * on first use with TRANSIENT and RESET_COMMAND_BUFFER. release() may be
+ * called from any thread, e.g. by whichever thread sees the submission
+ * complete: released buffers go onto a lock-free queue and are only reused
+ * by the owning thread, whose vkBeginCommandBuffer resets them. No lock is
+ * taken except when a thread acquires for the first time.
+ *
+ * When a thread exits its pool is retired, and it is destroyed once all of
+ * its command buffers have been released and another thread creates a pool,
+ * so callers that keep spawning threads do not accumulate pools.
+ */
+class ThreadCommandPools {
+  struct ThreadPool;
+
+public:
+  /* A command buffer and the pool it returns to. */
+  struct CommandBuffer {
+    VkCommandBuffer handle = VK_NULL_HANDLE;
+    ThreadPool *pool = nullptr;
+
+    operator VkCommandBuffer() const { return handle; }
+  };
+
+  ThreadCommandPools(VkDevice device, uint32_t queue_family)
+      : device(device), queue_family(queue_family) {}
+
+  ThreadCommandPools(const ThreadCommandPools &) = delete;
+  ThreadCommandPools &operator=(const ThreadCommandPools &) = delete;
+
+  ~ThreadCommandPools() {
+    // Threads still running may hold the state, but not its pools
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->pools.clear();
+  }
+
+  CommandBuffer acquire() {
+    ThreadPool &pool = local_pool();
+    pool.outstanding.fetch_add(1, std::memory_order_relaxed);
+    pool.returned.drain(pool.free);
+    if (!pool.free.empty()) {
+      VkCommandBuffer command_buffer = pool.free.back();
+      pool.free.pop_back();
+      return {command_buffer, &pool};
+    }
+    VkCommandPool handle = pool.pool;
+    return {create_command_buffer(device, handle), &pool};
+  }
+
+  /* Return a command buffer whose submission has completed. */
+  void release(const CommandBuffer &command_buffer) {
+    command_buffer.pool->returned.push(command_buffer.handle);
+    command_buffer.pool->outstanding.fetch_sub(1, std::memory_order_release);
+  }
+
+  size_t pool_count() {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->pools.size();
+  }
+
+private:
+  struct ThreadPool {
+    UniqueCommandPool pool;
+    MpscQueue<VkCommandBuffer> returned; // released from any thread
+    std::vector<VkCommandBuffer> free;   // only touched by the owner
+    std::atomic<size_t> outstanding{0};  // acquired and not yet released
+    bool retired = false;                // owner exited, under State::mutex
+  };
+
+  // Shared with the threads' caches, which may outlive the instance
+  struct State {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadPool>> pools;
+  };
+
+  /* A thread's pools, by instance. Retires them when the thread exits. */
+  struct ThreadCache {
+    std::vector<std::pair<std::weak_ptr<State>, ThreadPool *>> entries;
+
+    ~ThreadCache() {
+      for (auto &[weak_state, pool] : entries) {
+        std::shared_ptr<State> state = weak_state.lock();
+        if (!state) {
+          continue;
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        // Pools are gone once the instance is destroyed
+        for (auto &owned : state->pools) {
+          if (owned.get() == pool) {
+            owned->retired = true;
+          }
+        }
+      }
+    }
+  };
+
+  ThreadPool &local_pool() {
+    // Keyed by the instance's state rather than `this`, which a later
+    // instance may reuse. Entries of destroyed instances are dropped here,
+    // so the cache only holds live instances.
+    thread_local ThreadCache cache;
+    ThreadPool *found = nullptr;
+    auto &entries = cache.entries;
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [&](const auto &entry) {
+                                   std::shared_ptr<State> owner =
+                                       entry.first.lock();
+                                   if (owner == state) {
+                                     found = entry.second;
+                                   }
+                                   return owner == nullptr;
+                                 }),
+                  entries.end());
+    if (found) {
+      return *found;
+    }
+    auto pool = std::make_unique<ThreadPool>();
+    pool->pool = UniqueCommandPool(
+        device, create_command_pool(
+                    device, queue_family,
+                    VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                        VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT));
+    entries.emplace_back(state, pool.get());
+    std::lock_guard<std::mutex> lock(state->mutex);
+    // Destroy the pools of exited threads once nothing is left to release
+    auto &pools = state->pools;
+    pools.erase(std::remove_if(pools.begin(), pools.end(),
+                               [](const auto &owned) {
+                                 return owned->retired &&
+                                        owned->outstanding.load(
+                                            std::memory_order_acquire) == 0;
+                               }),
+                pools.end());
+    pools.push_back(std::move(pool));
+    SPDLOG_DEBUG("Command pool {} for queue family {}", pools.size(),
+                 queue_family);
+    return *pools.back();
+  }
+
+  VkDevice device;
+  uint32_t queue_family;
+  std::shared_ptr<State> state = std::make_shared<State>();
+};
+
+void copy_to_cpu(VkDevice &device, VkDeviceMemory &buffer, float *data,
+                 size_t count) {
   void *data_ptr;
-  VkDeviceSize dataSize = sizeof(float) * data.size();
+  VkDeviceSize dataSize = sizeof(float) * count;
   vkMapMemory(device, buffer, 0, dataSize, 0, &data_ptr);
-  memcpy(data.data(), data_ptr, dataSize);
+  memcpy(data, data_ptr, dataSize);
   vkUnmapMemory(device, buffer);
-  spdlog::info("Data copied to memory");
+  SPDLOG_TRACE("Data copied to memory");
+}
+
+template <size_t size>
+void copy_to_cpu(VkDevice &device, VkDeviceMemory &buffer,
+                 std::array<float, size> &data) {
+  copy_to_cpu(device, buffer, data.data(), data.size());
+}
+
+/**
+ * @brief Recycles the command buffers, fences and staging buffers of one time
+ * submissions (run_one_time_commands and the staged copy_to_gpu/copy_to_cpu),
+ * so repeated transfers reuse them instead of creating and destroying them
+ * on every call.
+ *
+ * Staging buffers are rounded up to a power of two, kept per memory type and
+ * size, and stay mapped. Released staging buffers are cached up to
+ * `max_cached_bytes` in total and destroyed beyond that.
+ */
+class TransferPool {
+public:
+  struct StagingBuffer {
+    UniqueBuffer buffer;
+    UniqueMemory memory;
+    uint32_t memory_type = 0;
+    VkDeviceSize bytes = 0;
+    void *mapped = nullptr;
+    bool coherent = true;
+  };
+
+  TransferPool(VkDevice device, VkPhysicalDevice physical_device,
+               uint32_t queue_family,
+               VkDeviceSize max_cached_bytes = 64ull << 20)
+      : device(device), physical_device(physical_device),
+        max_cached_bytes(max_cached_bytes),
+        command_pools(device, queue_family) {}
+
+  TransferPool(const TransferPool &) = delete;
+  TransferPool &operator=(const TransferPool &) = delete;
+
+  /* A command buffer from the calling thread's command pool. */
+  ThreadCommandPools::CommandBuffer acquire_command_buffer() {
+    return command_pools.acquire();
+  }
+
+  /* Return a command buffer whose submission has completed. */
+  void release(const ThreadCommandPools::CommandBuffer &command_buffer) {
+    command_pools.release(command_buffer);
+  }
+
+  UniqueFence acquire_fence() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!fences.empty()) {
+      UniqueFence fence = std::move(fences.back());
+      fences.pop_back();
+      return fence;
+    }
+    VkFenceCreateInfo fence_info{.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    VkFence fence;
+    check(vkCreateFence(device, &fence_info, nullptr, &fence), "Create fence.");
+    return UniqueFence(device, fence);
+  }
+
+  /* Return a signalled fence, which is reset for reuse. */
+  void release(UniqueFence fence) {
+    VkFence handle = fence;
+    check(vkResetFences(device, 1, &handle), "Reset fence.");
+    std::lock_guard<std::mutex> lock(mutex);
+    fences.push_back(std::move(fence));
+  }
+
+  /**
+   * @brief A mapped staging buffer of at least `bytes` bytes in memory
+   * selected for `usage` (Upload or Readback), usable as a transfer source
+   * and destination.
+   */
+  StagingBuffer acquire_staging(VkDeviceSize bytes, MemoryUsage usage) {
+    uint32_t memory_type = query_memory_type(physical_device, usage).value();
+    VkDeviceSize size_class = 256;
+    while (size_class < bytes) {
+      size_class *= 2;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = staging.find({memory_type, size_class});
+      if (it != staging.end() && !it->second.empty()) {
+        StagingBuffer buffer = std::move(it->second.back());
+        it->second.pop_back();
+        cached_bytes -= buffer.bytes;
+        return buffer;
+      }
+    }
+
+    StagingBuffer buffer;
+    buffer.memory_type = memory_type;
+    buffer.bytes = size_class;
+    buffer.coherent = memory_type_flags(physical_device, memory_type) &
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkBuffer handle = create_buffer_bytes(size_class, device,
+                                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                              VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    buffer.buffer = UniqueBuffer(device, handle);
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, handle, &requirements);
+    VkMemoryAllocateInfo allocate_info{
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+        .memoryTypeIndex = memory_type,
+    };
+    VkDeviceMemory memory;
+    check(vkAllocateMemory(device, &allocate_info, nullptr, &memory),
+          "Allocate staging memory.");
+    buffer.memory = UniqueMemory(device, memory);
+    check(vkBindBufferMemory(device, handle, memory, 0),
+          "Bind staging memory.");
+    check(vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &buffer.mapped),
+          "Map staging memory.");
+    return buffer;
+  }
+
+  /* Return a staging buffer whose transfers have completed. */
+  void release(StagingBuffer buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cached_bytes + buffer.bytes > max_cached_bytes) {
+      return; // destroyed
+    }
+    cached_bytes += buffer.bytes;
+    staging[{buffer.memory_type, buffer.bytes}].push_back(std::move(buffer));
+  }
+
+private:
+  VkDevice device;
+  VkPhysicalDevice physical_device;
+  VkDeviceSize max_cached_bytes;
+  VkDeviceSize cached_bytes = 0;
+  ThreadCommandPools command_pools;
+  std::vector<UniqueFence> fences;
+  std::map<std::pair<uint32_t, VkDeviceSize>, std::vector<StagingBuffer>>
+      staging;
+  std::mutex mutex;
+};
+
+/**
+ * @brief A device together with the queue and command pool used to submit
+ * work to it.
+ */
+struct DeviceResource {
+  VkInstance instance;
+  VkPhysicalDevice physical_device;
+  VkDevice device;
+  uint32_t queue_family;
+  VkQueue queue;
+  VkCommandPool command_pool;
+  DeviceCapabilities capabilities;
+  // Queues are externally synchronized. Every submission to `queue`, from
+  // an AsyncQueue or run_one_time_commands, holds this mutex.
+  std::shared_ptr<std::mutex> queue_mutex = std::make_shared<std::mutex>();
+  // Created on first use by transfer_pool() and descriptor_cache()
+  std::shared_ptr<TransferPool> transfer_pool_ptr;
+  std::shared_ptr<DescriptorCache> descriptor_cache_ptr;
+};
+
+TransferPool &transfer_pool(DeviceResource &resource) {
+  if (!resource.transfer_pool_ptr) {
+    resource.transfer_pool_ptr = std::make_shared<TransferPool>(
+        resource.device, resource.physical_device, resource.queue_family);
+  }
+  return *resource.transfer_pool_ptr;
+}
+
+DescriptorCache &descriptor_cache(DeviceResource &resource) {
+  if (!resource.descriptor_cache_ptr) {
+    resource.descriptor_cache_ptr = std::make_shared<DescriptorCache>(
+        resource.device, resource.capabilities);
+  }
+  return *resource.descriptor_cache_ptr;
+}
+
+/**
+ * @brief Record commands with `record` into a one time command buffer, submit
+ * it and wait for it to complete.
+ */
+template <typename Fn>
+void run_one_time_commands(DeviceResource &resource, Fn &&record) {
+  TransferPool &pool = transfer_pool(resource);
+  ThreadCommandPools::CommandBuffer pooled = pool.acquire_command_buffer();
+  VkCommandBuffer command_buffer = pooled;
+  VkCommandBufferBeginInfo begin_info{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  check(vkBeginCommandBuffer(command_buffer, &begin_info),
+        "Begin one time command buffer.");
+  record(command_buffer);
+  check(vkEndCommandBuffer(command_buffer), "End one time command buffer.");
+
+  UniqueFence fence = pool.acquire_fence();
+  VkFence fence_handle = fence;
+  VkSubmitInfo submit_info{
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &command_buffer,
+  };
+  {
+    std::lock_guard<std::mutex> lock(*resource.queue_mutex);
+    check(vkQueueSubmit(resource.queue, 1, &submit_info, fence_handle),
+          "Submit one time command buffer.");
+  }
+  check(vkWaitForFences(resource.device, 1, &fence_handle, VK_TRUE,
+                        UINT64_MAX),
+        "Wait for one time command buffer.");
+  pool.release(std::move(fence));
+  pool.release(pooled);
+}
+
+/**
+ * @brief Handle to work submitted through an AsyncQueue, shared by copies.
+ *
+ * Completion can be polled with ready(), waited on with wait(), chained on
+ * the host with then(), or passed to AsyncQueue::submit as a dependency of
+ * later work, which the GPU waits on without blocking the host when
+ * timeline semaphores are available.
+ */
+class Submission {
+public:
+  Submission() = default;
+
+  bool valid() const { return state != nullptr; }
+
+  /* Whether the submission has completed, without blocking */
+  bool ready() const { return wait(0); }
+
+  /**
+   * @brief Block until the submission completes or `timeout` nanoseconds
+   * pass. Returns whether it completed.
+   */
+  bool wait(uint64_t timeout = UINT64_MAX) const {
+    if (!state) {
+      return false;
+    }
+    // The wait itself runs unlocked, so waiting on a submission does not
+    // block others (e.g. AsyncQueue::poll) from checking it. `waiters` keeps
+    // poll() from recycling the fence meanwhile.
+    VkSemaphore timeline;
+    uint64_t value;
+    VkFence fence;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (state->complete) {
+        return true;
+      }
+      timeline = state->timeline;
+      value = state->value;
+      fence = state->fence;
+      state->waiters++;
+    }
+    VkResult result;
+    if (timeline != VK_NULL_HANDLE) {
+      VkSemaphoreWaitInfo wait_info{
+          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+          .semaphoreCount = 1,
+          .pSemaphores = &timeline,
+          .pValues = &value,
+      };
+      result = vkWaitSemaphores(state->device, &wait_info, timeout);
+    } else if (timeout == 0) {
+      result = vkGetFenceStatus(state->device, fence);
+    } else {
+      result = vkWaitForFences(state->device, 1, &fence, VK_TRUE, timeout);
+    }
+    std::vector<std::function<void()>> continuations;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->waiters--;
+      if (result == VK_TIMEOUT || result == VK_NOT_READY) {
+        return state->complete;
+      }
+      check(result, "Wait for submission.");
+      if (state->complete) {
+        return true; // another thread took the continuations
+      }
+      state->complete = true;
+      continuations.swap(state->continuations);
+    }
+    for (auto &continuation : continuations) {
+      continuation();
+    }
+    return true;
+  }
+
+  /**
+   * @brief Run `fn` on the host once the submission completes.
+   *
+   * Continuations run on the thread that observes completion through
+   * ready(), wait() or AsyncQueue::poll(), or immediately if the submission
+   * has already completed.
+   */
+  void then(std::function<void()> fn) const {
+    if (!state) {
+      throw std::logic_error("Continuation on an empty submission.");
+    }
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (!state->complete) {
+        state->continuations.push_back(std::move(fn));
+        return;
+      }
+    }
+    fn();
+  }
+
+private:
+  friend class AsyncQueue;
+
+  struct State {
+    VkDevice device;
+    VkSemaphore timeline = VK_NULL_HANDLE; // owned by the AsyncQueue
+    uint64_t value = 0;
+    VkFence fence = VK_NULL_HANDLE; // without timeline semaphores
+    std::mutex mutex;
+    bool complete = false;
+    int waiters = 0; // threads blocked in wait()
+    std::vector<std::function<void()>> continuations;
+  };
+
+  explicit Submission(std::shared_ptr<State> state)
+      : state(std::move(state)) {}
+
+  std::shared_ptr<State> state;
+};
+
+/**
+ * @brief Asynchronous submission to a queue.
+ *
+ * Each submit returns a Submission instead of blocking, so the next batch
+ * can be recorded and submitted while the GPU works on the previous one.
+ * Completion is tracked with a timeline semaphore, signalled with an
+ * increasing value per submission, when the device supports it and with a
+ * recycled fence per submission otherwise.
+ */
+class AsyncQueue {
+public:
+  AsyncQueue(DeviceResource &resource)
+      : AsyncQueue(resource.device, resource.queue,
+                   resource.capabilities.timeline_semaphore,
+                   resource.queue_mutex) {}
+
+  /* `queue_mutex` is held for each vkQueueSubmit. Everything else submitting
+   * to `queue` must share it. */
+  AsyncQueue(VkDevice device, VkQueue queue, bool timeline_semaphore,
+             std::shared_ptr<std::mutex> queue_mutex =
+                 std::make_shared<std::mutex>())
+      : device(device), queue(queue), queue_mutex(std::move(queue_mutex)) {
+    if (timeline_semaphore) {
+      VkSemaphoreTypeCreateInfo type_info{
+          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+          .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+          .initialValue = 0,
+      };
+      VkSemaphoreCreateInfo create_info{
+          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+          .pNext = &type_info,
+      };
+      check(vkCreateSemaphore(device, &create_info, nullptr, &timeline),
+            "Create timeline semaphore.");
+    }
+    SPDLOG_DEBUG("Async queue tracking completion with {}",
+                 timeline != VK_NULL_HANDLE ? "a timeline semaphore"
+                                            : "fences");
+  }
+
+  AsyncQueue(const AsyncQueue &) = delete;
+  AsyncQueue &operator=(const AsyncQueue &) = delete;
+
+  ~AsyncQueue() {
+    wait_idle();
+    for (VkFence fence : free_fences) {
+      vkDestroyFence(device, fence, nullptr);
+    }
+    if (timeline != VK_NULL_HANDLE) {
+      vkDestroySemaphore(device, timeline, nullptr);
+    }
+  }
+
+  /**
+   * @brief Submit command buffers to run after `dependencies` complete.
+   *
+   * With timeline semaphores the GPU waits on the dependencies. Fences
+   * cannot be waited on by the GPU, so without them the host waits for
+   * dependencies that have not completed before submitting.
+   */
+  Submission submit(const std::vector<VkCommandBuffer> &command_buffers,
+                    const std::vector<Submission> &dependencies = {}) {
+    poll();
+
+    std::vector<VkSemaphore> wait_semaphores;
+    std::vector<uint64_t> wait_values;
+    std::vector<VkPipelineStageFlags> wait_stages;
+    for (const Submission &dependency : dependencies) {
+      if (!dependency.valid() || dependency.ready()) {
+        continue;
+      }
+      if (dependency.state->timeline != VK_NULL_HANDLE) {
+        wait_semaphores.push_back(dependency.state->timeline);
+        wait_values.push_back(dependency.state->value);
+        wait_stages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+      } else {
+        dependency.wait();
+      }
+    }
+
+    auto state = std::make_shared<Submission::State>();
+    state->device = device;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    VkSubmitInfo submit_info{
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .waitSemaphoreCount = static_cast<uint32_t>(wait_semaphores.size()),
+        .pWaitSemaphores = wait_semaphores.data(),
+        .pWaitDstStageMask = wait_stages.data(),
+        .commandBufferCount = static_cast<uint32_t>(command_buffers.size()),
+        .pCommandBuffers = command_buffers.data(),
+    };
+    VkTimelineSemaphoreSubmitInfo timeline_info{
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = static_cast<uint32_t>(wait_values.size()),
+        .pWaitSemaphoreValues = wait_values.data(),
+        .signalSemaphoreValueCount = 1,
+    };
+    VkFence fence = VK_NULL_HANDLE;
+    if (timeline != VK_NULL_HANDLE) {
+      state->timeline = timeline;
+      state->value = ++timeline_value;
+      timeline_info.pSignalSemaphoreValues = &state->value;
+      submit_info.signalSemaphoreCount = 1;
+      submit_info.pSignalSemaphores = &timeline;
+      submit_info.pNext = &timeline_info;
+    } else {
+      fence = acquire_fence();
+      state->fence = fence;
+    }
+    {
+      std::lock_guard<std::mutex> queue_lock(*queue_mutex);
+      check(vkQueueSubmit(queue, 1, &submit_info, fence),
+            "Submit command buffers.");
+    }
+
+    in_flight.push_back(Submission(state));
+    return in_flight.back();
+  }
+
+  Submission submit(VkCommandBuffer command_buffer,
+                    const std::vector<Submission> &dependencies = {}) {
+    return submit(std::vector<VkCommandBuffer>{command_buffer}, dependencies);
+  }
+
+  /**
+   * @brief Retire completed submissions, running their continuations, and
+   * return the number still in flight.
+   */
+  size_t poll() {
+    std::vector<Submission> pending;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.assign(in_flight.begin(), in_flight.end());
+    }
+    // Continuations may submit more work, so they run without the lock held
+    for (const Submission &submission : pending) {
+      submission.ready();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto retired = std::stable_partition(
+        in_flight.begin(), in_flight.end(),
+        [](const Submission &submission) {
+          // A fence still being waited on is recycled by a later poll
+          std::lock_guard<std::mutex> state_lock(submission.state->mutex);
+          return !submission.state->complete ||
+                 submission.state->waiters > 0;
+        });
+    for (auto it = retired; it != in_flight.end(); ++it) {
+      std::lock_guard<std::mutex> state_lock(it->state->mutex);
+      if (it->state->fence != VK_NULL_HANDLE) {
+        check(vkResetFences(device, 1, &it->state->fence), "Reset fence.");
+        free_fences.push_back(it->state->fence);
+        it->state->fence = VK_NULL_HANDLE;
+      }
+    }
+    in_flight.erase(retired, in_flight.end());
+    return in_flight.size();
+  }
+
+  /* Wait for everything submitted through this queue to complete */
+  void wait_idle() {
+    std::vector<Submission> pending;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.assign(in_flight.begin(), in_flight.end());
+    }
+    for (const Submission &submission : pending) {
+      submission.wait();
+    }
+    poll();
+  }
+
+private:
+  VkFence acquire_fence() {
+    if (!free_fences.empty()) {
+      VkFence fence = free_fences.back();
+      free_fences.pop_back();
+      return fence;
+    }
+    VkFenceCreateInfo fence_info{.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    VkFence fence;
+    check(vkCreateFence(device, &fence_info, nullptr, &fence),
+          "Create fence.");
+    return fence;
+  }
+
+  VkDevice device;
+  VkQueue queue;
+  std::shared_ptr<std::mutex> queue_mutex;
+  VkSemaphore timeline = VK_NULL_HANDLE;
+  uint64_t timeline_value = 0;
+  std::vector<Submission> in_flight;
+  std::vector<VkFence> free_fences;
+  std::mutex mutex;
+};
+
+/**
+ * @brief Map host visible `memory` at `memory_offset`, returning the mapped
+ * pointer to that offset. The mapping starts at `memory_offset` rounded down
+ * to nonCoherentAtomSize and runs to the end of the memory, which `*begin` is
+ * set to, so the range `[*begin, VK_WHOLE_SIZE)` can be flushed or
+ * invalidated even in non-coherent memory.
+ */
+void *map_memory_at(DeviceResource &resource, VkDeviceMemory memory,
+                    VkDeviceSize memory_offset, VkDeviceSize *begin) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(resource.physical_device, &properties);
+  const VkDeviceSize atom =
+      std::max<VkDeviceSize>(properties.limits.nonCoherentAtomSize, 1);
+  *begin = memory_offset / atom * atom;
+  void *mapped;
+  check(vkMapMemory(resource.device, memory, *begin, VK_WHOLE_SIZE, 0,
+                    &mapped),
+        "Map GPU memory");
+  return static_cast<char *>(mapped) + (memory_offset - *begin);
+}
+
+/**
+ * @brief Copy `bytes` bytes from the host to a buffer.
+ *
+ * Host visible memory (including device-local memory on unified memory
+ * devices) is mapped at `memory_offset`, the offset the buffer is bound at,
+ * and written directly. Otherwise the data is written to a
+ * temporary host visible staging buffer and copied with vkCmdCopyBuffer, in
+ * which case `buffer` needs VK_BUFFER_USAGE_TRANSFER_DST_BIT.
+ */
+void copy_to_gpu(DeviceResource &resource, VkBuffer &buffer,
+                 VkDeviceMemory &memory, uint32_t memory_type,
+                 const void *data, VkDeviceSize bytes,
+                 VkDeviceSize memory_offset = 0) {
+  VkMemoryPropertyFlags flags =
+      memory_type_flags(resource.physical_device, memory_type);
+  if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    VkDeviceSize begin;
+    void *mapped = map_memory_at(resource, memory, memory_offset, &begin);
+    memcpy(mapped, data, bytes);
+    if (!(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+      VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                                .memory = memory,
+                                .offset = begin,
+                                .size = VK_WHOLE_SIZE};
+      check(vkFlushMappedMemoryRanges(resource.device, 1, &range),
+            "Flush mapped memory");
+    }
+    vkUnmapMemory(resource.device, memory);
+    return;
+  }
+
+  TransferPool &pool = transfer_pool(resource);
+  TransferPool::StagingBuffer staging =
+      pool.acquire_staging(bytes, MemoryUsage::Upload);
+  memcpy(staging.mapped, data, bytes);
+  if (!staging.coherent) {
+    VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                              .memory = staging.memory,
+                              .offset = 0,
+                              .size = VK_WHOLE_SIZE};
+    check(vkFlushMappedMemoryRanges(resource.device, 1, &range),
+          "Flush staging memory");
+  }
+  run_one_time_commands(resource, [&](VkCommandBuffer &command_buffer) {
+    VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = bytes};
+    vkCmdCopyBuffer(command_buffer, staging.buffer, buffer, 1, &region);
+  });
+  pool.release(std::move(staging));
+}
+
+/**
+ * @brief Copy `bytes` bytes from a buffer to the host, through a temporary
+ * host cached staging buffer if the buffer memory is not host visible (in
+ * which case `buffer` needs VK_BUFFER_USAGE_TRANSFER_SRC_BIT).
+ */
+void copy_to_cpu(DeviceResource &resource, VkBuffer &buffer,
+                 VkDeviceMemory &memory, uint32_t memory_type, void *data,
+                 VkDeviceSize bytes, VkDeviceSize memory_offset = 0) {
+  VkMemoryPropertyFlags flags =
+      memory_type_flags(resource.physical_device, memory_type);
+  if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    VkDeviceSize begin;
+    void *mapped = map_memory_at(resource, memory, memory_offset, &begin);
+    if (!(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+      VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                                .memory = memory,
+                                .offset = begin,
+                                .size = VK_WHOLE_SIZE};
+      check(vkInvalidateMappedMemoryRanges(resource.device, 1, &range),
+            "Invalidate mapped memory");
+    }
+    memcpy(data, mapped, bytes);
+    vkUnmapMemory(resource.device, memory);
+    return;
+  }
+
+  TransferPool &pool = transfer_pool(resource);
+  TransferPool::StagingBuffer staging =
+      pool.acquire_staging(bytes, MemoryUsage::Readback);
+  run_one_time_commands(resource, [&](VkCommandBuffer &command_buffer) {
+    VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = bytes};
+    vkCmdCopyBuffer(command_buffer, buffer, staging.buffer, 1, &region);
+  });
+  if (!staging.coherent) {
+    VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                              .memory = staging.memory,
+                              .offset = 0,
+                              .size = VK_WHOLE_SIZE};
+    check(vkInvalidateMappedMemoryRanges(resource.device, 1, &range),
+          "Invalidate staging memory");
+  }
+  memcpy(data, staging.mapped, bytes);
+  pool.release(std::move(staging));
+}
+
+template <size_t size>
+void copy_to_gpu(DeviceResource &resource, VkBuffer &buffer,
+                 VkDeviceMemory &memory, uint32_t memory_type,
+                 const std::array<float, size> &input) {
+  copy_to_gpu(resource, buffer, memory, memory_type, input.data(),
+              sizeof(float) * input.size());
+}
+
+template <size_t size>
+void copy_to_cpu(DeviceResource &resource, VkBuffer &buffer,
+                 VkDeviceMemory &memory, uint32_t memory_type,
+                 std::array<float, size> &data) {
+  copy_to_cpu(resource, buffer, memory, memory_type, data.data(),
+              sizeof(float) * data.size());
+}
+
+/**
+ * @brief Copy `bytes` bytes from the host to a buffer bound to an arena
+ * allocation, writing through the persistent mapping if it has one and only
+ * flushing the bytes written.
+ */
+void copy_to_gpu(DeviceResource &resource, VkBuffer &buffer,
+                 const Allocation &allocation, const void *data,
+                 VkDeviceSize bytes) {
+  if (allocation.mapped) {
+    memcpy(allocation.mapped, data, bytes);
+    flush_allocation(resource.device, allocation, 0, bytes);
+    return;
+  }
+  VkDeviceMemory memory = allocation.memory;
+  copy_to_gpu(resource, buffer, memory, allocation.memory_type, data, bytes,
+              allocation.offset);
+}
+
+void copy_to_cpu(DeviceResource &resource, VkBuffer &buffer,
+                 const Allocation &allocation, void *data,
+                 VkDeviceSize bytes) {
+  if (allocation.mapped) {
+    invalidate_allocation(resource.device, allocation, 0, bytes);
+    memcpy(data, allocation.mapped, bytes);
+    return;
+  }
+  VkDeviceMemory memory = allocation.memory;
+  copy_to_cpu(resource, buffer, memory, allocation.memory_type, data, bytes,
+              allocation.offset);
+}
+
+/**
+ * @brief Copy host data into a tensor, staging it if the tensor is not host
+ * visible. The element type must match the tensor dtype size.
+ */
+template <typename T>
+void copy_to_gpu(DeviceResource &resource, Tensor &tensor, const T *data,
+                 size_t count) {
+  if (sizeof(T) != dtype_size(tensor.dtype) || count > tensor.numel()) {
+    throw std::runtime_error("Copy does not match tensor.");
+  }
+  copy_to_gpu(resource, tensor.buffer, tensor.allocation, data,
+              sizeof(T) * count);
+}
+
+template <typename T>
+void copy_to_gpu(DeviceResource &resource, Tensor &tensor,
+                 const std::vector<T> &data) {
+  copy_to_gpu(resource, tensor, data.data(), data.size());
+}
+
+template <typename T, size_t size>
+void copy_to_gpu(DeviceResource &resource, Tensor &tensor,
+                 const std::array<T, size> &data) {
+  copy_to_gpu(resource, tensor, data.data(), data.size());
+}
+
+/**
+ * @brief Copy a tensor to the host, resizing `data` to the tensor size.
+ */
+template <typename T>
+void copy_to_cpu(DeviceResource &resource, Tensor &tensor,
+                 std::vector<T> &data) {
+  if (sizeof(T) != dtype_size(tensor.dtype)) {
+    throw std::runtime_error("Copy does not match tensor.");
+  }
+  data.resize(tensor.numel());
+  copy_to_cpu(resource, tensor.buffer, tensor.allocation, data.data(),
+              tensor.bytes());
+}
+
+/**
+ * @brief Record `params` as the compute push constants at `offset`. `T` must
+ * match the shader's push_constant block and a range of the pipeline layout.
+ */
+template <typename T>
+void push_constants(VkCommandBuffer command_buffer,
+                    VkPipelineLayout pipeline_layout, const T &params,
+                    uint32_t offset = 0) {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Push constants are copied byte for byte.");
+  // The minimum maxPushConstantsSize every device supports
+  static_assert(sizeof(T) <= 128, "Push constants are limited to 128 bytes.");
+  vkCmdPushConstants(command_buffer, pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, offset, sizeof(T), &params);
+}
+
+/**
+ * @brief Insert a barrier making compute shader writes visible to compute
+ * shader reads of subsequent dispatches in the same command buffer.
+ */
+void compute_barrier(VkCommandBuffer &command_buffer) {
+  VkMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+}
+
+/**
+ * @brief Insert a barrier making device writes visible to host reads once the
+ * submission completes, e.g. for compute output in mapped memory.
+ */
+void host_read_barrier(
+    VkCommandBuffer &command_buffer,
+    VkPipelineStageFlags src_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VkAccessFlags src_access = VK_ACCESS_SHADER_WRITE_BIT) {
+  VkMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = src_access,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+  };
+  vkCmdPipelineBarrier(command_buffer, src_stage, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                       1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+/**
+ * @brief Record a copy of host written input in `src` to `dst`, with the
+ * barrier needed for compute shaders to read `dst`.
+ */
+void record_upload(VkCommandBuffer &command_buffer, VkBuffer &src,
+                   VkBuffer &dst, VkDeviceSize bytes) {
+  VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = bytes};
+  vkCmdCopyBuffer(command_buffer, src, dst, 1, &region);
+  VkMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+}
+
+/**
+ * @brief Record a copy of compute shader output in `src` to `dst`, with the
+ * barriers needed to read `dst` on the host once the submission completes.
+ */
+void record_readback(VkCommandBuffer &command_buffer, VkBuffer &src,
+                     VkBuffer &dst, VkDeviceSize bytes) {
+  VkMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+  VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = bytes};
+  vkCmdCopyBuffer(command_buffer, src, dst, 1, &region);
+  host_read_barrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT);
+}
+
+/**
+ * @brief Record one half of a queue family ownership transfer of `buffer`:
+ * the release on the `src_family` queue (with `dst_stage`/`dst_access` of
+ * BOTTOM_OF_PIPE/0) or the acquire on the `dst_family` queue (with
+ * `src_stage`/`src_access` of TOP_OF_PIPE/0). The two halves must use the
+ * same families, and the acquire must be ordered after the release by a
+ * semaphore.
+ */
+void record_ownership_transfer(VkCommandBuffer command_buffer, VkBuffer buffer,
+                               uint32_t src_family, uint32_t dst_family,
+                               VkPipelineStageFlags src_stage,
+                               VkAccessFlags src_access,
+                               VkPipelineStageFlags dst_stage,
+                               VkAccessFlags dst_access) {
+  VkBufferMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = src_access,
+      .dstAccessMask = dst_access,
+      .srcQueueFamilyIndex = src_family,
+      .dstQueueFamilyIndex = dst_family,
+      .buffer = buffer,
+      .offset = 0,
+      .size = VK_WHOLE_SIZE,
+  };
+  vkCmdPipelineBarrier(command_buffer, src_stage, dst_stage, 0, 0, nullptr, 1,
+                       &barrier, 0, nullptr);
+}
+
+/**
+ * @brief The compute and transfer queues of a device, each behind an
+ * AsyncQueue.
+ *
+ * Every queue of the compute family is used. compute() gives each calling
+ * thread its own queue, assigned round robin on first use, so worker threads
+ * do not serialize on one vkQueueSubmit. Uploads and downloads go through the
+ * dedicated transfer family when the device has one, so they run on the DMA
+ * engine concurrently with compute, and through the last compute queue
+ * otherwise.
+ *
+ * Buffers keep VK_SHARING_MODE_EXCLUSIVE. Between the transfer and compute
+ * families they are handed off with a queue family ownership transfer: a
+ * release barrier submitted on one queue and an acquire barrier submitted on
+ * the other, waiting on the first through a semaphore dependency.
+ *
+ * The device must have been created with `families` (see
+ * create_logical_device). compute(0) is `resource.queue` and shares
+ * `resource.queue_mutex`, so it may be used alongside copy_to_gpu,
+ * copy_to_cpu and other AsyncQueues over `resource`.
+ */
+class QueueManager {
+public:
+  QueueManager(DeviceResource &resource, const QueueFamilies &families)
+      : device(resource.device), families(families),
+        compute_pool(resource.device, resource.physical_device,
+                     families.compute) {
+    bool timeline = resource.capabilities.timeline_semaphore;
+    for (uint32_t idx = 0; idx < families.compute_count; ++idx) {
+      VkQueue queue;
+      vkGetDeviceQueue(device, families.compute, idx, &queue);
+      compute_queues.push_back(std::make_unique<AsyncQueue>(
+          device, queue, timeline,
+          queue == resource.queue ? resource.queue_mutex
+                                  : std::make_shared<std::mutex>()));
+    }
+    if (families.transfer) {
+      transfer_pool = std::make_unique<TransferPool>(
+          device, resource.physical_device, families.transfer.value());
+      VkQueue queue;
+      vkGetDeviceQueue(device, families.transfer.value(), 0, &queue);
+      transfer_queue = std::make_unique<AsyncQueue>(device, queue, timeline);
+    }
+  }
+
+  QueueManager(const QueueManager &) = delete;
+  QueueManager &operator=(const QueueManager &) = delete;
+
+  ~QueueManager() {
+    // Destroying a queue waits for it and runs the continuations returning
+    // buffers to the pools, so the queues go before the pools
+    transfer_queue.reset();
+    compute_queues.clear();
+  }
+
+  size_t compute_count() const { return compute_queues.size(); }
+  AsyncQueue &compute(size_t idx) { return *compute_queues.at(idx); }
+
+  /* The calling thread's compute queue. */
+  AsyncQueue &compute() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = thread_queues.find(std::this_thread::get_id());
+    if (it == thread_queues.end()) {
+      size_t idx = thread_queues.size() % compute_queues.size();
+      it = thread_queues.emplace(std::this_thread::get_id(), idx).first;
+    }
+    return *compute_queues[it->second];
+  }
+
+  /* The queue uploads and downloads are submitted to. */
+  AsyncQueue &transfer() {
+    return transfer_queue ? *transfer_queue : *compute_queues.back();
+  }
+
+  bool dedicated_transfer() const { return transfer_queue != nullptr; }
+
+  /**
+   * @brief Copy `bytes` bytes from the host to a buffer once `dependencies`
+   * complete, without blocking. The data is copied to a staging buffer
+   * before returning.
+   *
+   * The returned submission completes when compute shaders on any compute
+   * queue can read the buffer; pass it as a dependency of that work. With a
+   * dedicated transfer family, the buffer's previous contents are discarded,
+   * so no ownership transfer back from the compute family is needed. Buffers
+   * in host visible memory are written directly, after waiting for
+   * `dependencies`, and an empty submission is returned.
+   */
+  Submission upload(VkBuffer buffer, const Allocation &allocation,
+                    const void *data, VkDeviceSize bytes,
+                    const std::vector<Submission> &dependencies = {}) {
+    if (allocation.mapped) {
+      for (const Submission &dependency : dependencies) {
+        dependency.wait();
+      }
+      memcpy(allocation.mapped, data, bytes);
+      flush_allocation(device, allocation, 0, bytes);
+      return Submission();
+    }
+
+    TransferPool &pool = copy_pool();
+    auto staging = std::make_shared<TransferPool::StagingBuffer>(
+        pool.acquire_staging(bytes, MemoryUsage::Upload));
+    memcpy(staging->mapped, data, bytes);
+    if (!staging->coherent) {
+      VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                                .memory = staging->memory,
+                                .offset = 0,
+                                .size = VK_WHOLE_SIZE};
+      check(vkFlushMappedMemoryRanges(device, 1, &range),
+            "Flush staging memory");
+    }
+
+    auto copy = record(pool, [&](VkCommandBuffer command_buffer) {
+      VkBuffer src = staging->buffer;
+      VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = bytes};
+      vkCmdCopyBuffer(command_buffer, src, buffer, 1, &region);
+      if (dedicated_transfer()) {
+        record_ownership_transfer(
+            command_buffer, buffer, families.transfer.value(),
+            families.compute, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0);
+      } else {
+        VkMemoryBarrier barrier{
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        };
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &barrier, 0, nullptr, 0, nullptr);
+      }
+    });
+    Submission copied = transfer().submit(copy, dependencies);
+    release_on_completion(copied, pool, copy, staging);
+    if (!dedicated_transfer()) {
+      return copied;
+    }
+
+    auto acquire = record(compute_pool, [&](VkCommandBuffer command_buffer) {
+          record_ownership_transfer(
+              command_buffer, buffer, families.transfer.value(),
+              families.compute, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+        });
+    Submission acquired = compute().submit(acquire, {copied});
+    release_on_completion(acquired, compute_pool, acquire, nullptr);
+    return acquired;
+  }
+
+  Submission upload(Tensor &tensor, const void *data, VkDeviceSize bytes,
+                    const std::vector<Submission> &dependencies = {}) {
+    if (bytes > tensor.bytes()) {
+      throw std::runtime_error("Copy does not match tensor.");
+    }
+    return upload(tensor.buffer, tensor.allocation, data, bytes, dependencies);
+  }
+
+  /**
+   * @brief Copy `bytes` bytes of a buffer written by compute shaders to the
+   * host once `dependencies` complete, blocking until the copy is done.
+   *
+   * With a dedicated transfer family the buffer is owned by that family
+   * afterwards, so compute shaders should only overwrite it (as outputs
+   * are) or get it back through upload().
+   */
+  void download(VkBuffer buffer, const Allocation &allocation, void *data,
+                VkDeviceSize bytes,
+                const std::vector<Submission> &dependencies = {}) {
+    if (allocation.mapped) {
+      for (const Submission &dependency : dependencies) {
+        dependency.wait();
+      }
+      invalidate_allocation(device, allocation, 0, bytes);
+      memcpy(data, allocation.mapped, bytes);
+      return;
+    }
+
+    std::vector<Submission> waits = dependencies;
+    if (dedicated_transfer()) {
+      auto release = record(compute_pool, [&](VkCommandBuffer command_buffer) {
+            record_ownership_transfer(
+                command_buffer, buffer, families.compute,
+                families.transfer.value(),
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_ACCESS_SHADER_WRITE_BIT,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+          });
+      Submission released = compute().submit(release, dependencies);
+      release_on_completion(released, compute_pool, release, nullptr);
+      waits = {released};
+    }
+
+    TransferPool &pool = copy_pool();
+    TransferPool::StagingBuffer staging =
+        pool.acquire_staging(bytes, MemoryUsage::Readback);
+    auto copy = record(pool, [&](VkCommandBuffer command_buffer) {
+      if (dedicated_transfer()) {
+        record_ownership_transfer(
+            command_buffer, buffer, families.compute,
+            families.transfer.value(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+      } else {
+        VkMemoryBarrier barrier{
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        };
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0,
+                             nullptr, 0, nullptr);
+      }
+      VkBuffer dst = staging.buffer;
+      VkBufferCopy region{.srcOffset = 0, .dstOffset = 0, .size = bytes};
+      vkCmdCopyBuffer(command_buffer, buffer, dst, 1, &region);
+      host_read_barrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_ACCESS_TRANSFER_WRITE_BIT);
+    });
+    transfer().submit(copy, waits).wait();
+    pool.release(copy);
+
+    if (!staging.coherent) {
+      VkMappedMemoryRange range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                                .memory = staging.memory,
+                                .offset = 0,
+                                .size = VK_WHOLE_SIZE};
+      check(vkInvalidateMappedMemoryRanges(device, 1, &range),
+            "Invalidate staging memory");
+    }
+    memcpy(data, staging.mapped, bytes);
+    pool.release(std::move(staging));
+  }
+
+  void download(Tensor &tensor, void *data, VkDeviceSize bytes,
+                const std::vector<Submission> &dependencies = {}) {
+    if (bytes > tensor.bytes()) {
+      throw std::runtime_error("Copy does not match tensor.");
+    }
+    download(tensor.buffer, tensor.allocation, data, bytes, dependencies);
+  }
+
+private:
+  TransferPool &copy_pool() {
+    return transfer_pool ? *transfer_pool : compute_pool;
+  }
+
+  /* Record a one time command buffer from the calling thread's pool. */
+  template <typename Fn>
+  ThreadCommandPools::CommandBuffer record(TransferPool &pool, Fn &&fn) {
+    ThreadCommandPools::CommandBuffer command_buffer =
+        pool.acquire_command_buffer();
+    VkCommandBufferBeginInfo begin_info{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    check(vkBeginCommandBuffer(command_buffer, &begin_info),
+          "Begin transfer command buffer.");
+    fn(command_buffer);
+    check(vkEndCommandBuffer(command_buffer), "End transfer command buffer.");
+    return command_buffer;
+  }
+
+  /* Return the command buffer and staging buffer of `submission` to `pool`
+   * once it completes. */
+  void release_on_completion(
+      const Submission &submission, TransferPool &pool,
+      ThreadCommandPools::CommandBuffer command_buffer,
+      std::shared_ptr<TransferPool::StagingBuffer> staging) {
+    submission.then([&pool, command_buffer, staging] {
+      pool.release(command_buffer);
+      if (staging) {
+        pool.release(std::move(*staging));
+      }
+    });
+  }
+
+  VkDevice device;
+  QueueFamilies families;
+  TransferPool compute_pool;
+  std::unique_ptr<TransferPool> transfer_pool;
+  std::vector<std::unique_ptr<AsyncQueue>> compute_queues;
+  std::unique_ptr<AsyncQueue> transfer_queue;
+  std::map<std::thread::id, size_t> thread_queues;
+  std::mutex mutex;
+};
+
+/**
+ * @brief Aggregate GPU time of one named kernel across profiled submissions.
+ * Percentiles are over the most recent samples, see Profiler.
+ */
+struct KernelStats {
+  std::string name;
+  size_t count = 0;
+  double total_ns = 0;
+  double min_ns = 0;
+  double mean_ns = 0;
+  double p50_ns = 0;
+  double p99_ns = 0;
+  double max_ns = 0;
+  uint64_t bytes = 0; // total bytes moved over all samples
+  // Achieved bandwidth in bytes per ns, i.e. GB/s
+  double bandwidth() const { return total_ns > 0 ? bytes / total_ns : 0; }
+};
+
+/**
+ * @brief GPU timestamp profiler for the dispatches in a command buffer.
+ *
+ * begin_frame() records a reset of the profiler's query pool at the start of
+ * a command buffer, and each begin()/end() pair around a dispatch writes a
+ * timestamp once earlier compute work has finished and another after the
+ * dispatch, so the scopes of consecutive dispatches do not overlap. Once a
+ * submission of the command buffer has completed, collect() reads the
+ * timestamps back, converts ticks to ns with
+ * VkPhysicalDeviceLimits::timestampPeriod and adds one sample per scope to
+ * the scope's kernel. A command buffer recorded once can be resubmitted and
+ * collected any number of times. Each profiler has a single query pool, so
+ * command buffers in flight at the same time need a profiler each.
+ *
+ * Percentiles are computed over the `max_samples` most recent samples of a
+ * kernel; counts, totals and bandwidth cover all samples. If the queue family
+ * does not support timestamps the profiler records nothing.
+ */
+class Profiler {
+public:
+  Profiler(VkDevice device, VkPhysicalDevice physical_device,
+           uint32_t queue_family, uint32_t max_scopes = 256,
+           size_t max_samples = 4096)
+      : device(device), max_scopes(max_scopes), max_samples(max_samples) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    timestamp_period = properties.limits.timestampPeriod;
+
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device,
+                                             &queue_family_count, nullptr);
+    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        physical_device, &queue_family_count, queue_families.data());
+    uint32_t valid_bits = queue_families.at(queue_family).timestampValidBits;
+    if (valid_bits == 0) {
+      spdlog::warn("Queue family {} does not support timestamps, profiling "
+                   "disabled",
+                   queue_family);
+      return;
+    }
+    timestamp_mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+
+    VkQueryPoolCreateInfo create_info{
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 2 * max_scopes,
+    };
+    check(vkCreateQueryPool(device, &create_info, nullptr, &query_pool),
+          "Create timestamp query pool.");
+  }
+
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  ~Profiler() {
+    if (query_pool != VK_NULL_HANDLE) {
+      vkDestroyQueryPool(device, query_pool, nullptr);
+    }
+  }
+
+  bool enabled() const { return query_pool != VK_NULL_HANDLE; }
+
+  /* Start recording scopes into a command buffer, replacing earlier ones. */
+  void begin_frame(VkCommandBuffer &command_buffer) {
+    scopes.clear();
+    if (enabled()) {
+      vkCmdResetQueryPool(command_buffer, query_pool, 0, 2 * max_scopes);
+    }
+  }
+
+  /**
+   * @brief Write a timestamp starting scope `name`, moving `bytes` bytes, and
+   * return the scope index to pass to end().
+   */
+  uint32_t begin(VkCommandBuffer &command_buffer, const std::string &name,
+                 uint64_t bytes = 0) {
+    uint32_t scope = static_cast<uint32_t>(scopes.size());
+    if (!enabled() || scope >= max_scopes) {
+      return UINT32_MAX;
+    }
+    scopes.push_back({name, bytes});
+    // A TOP_OF_PIPE stamp may be written while the previous dispatch still
+    // runs, so scopes would overlap and their sum exceed the wall time.
+    // Stamping once earlier compute work has finished keeps them disjoint.
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        query_pool, 2 * scope);
+    return scope;
+  }
+
+  void end(VkCommandBuffer &command_buffer, uint32_t scope) {
+    if (scope >= scopes.size()) {
+      return;
+    }
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        query_pool, 2 * scope + 1);
+  }
+
+  /**
+   * @brief Read back the timestamps of a completed submission and add them
+   * to the per-kernel samples.
+   */
+  void collect() {
+    if (!enabled() || scopes.empty()) {
+      return;
+    }
+    std::vector<uint64_t> timestamps(2 * scopes.size());
+    check(vkGetQueryPoolResults(
+              device, query_pool, 0, static_cast<uint32_t>(timestamps.size()),
+              timestamps.size() * sizeof(uint64_t), timestamps.data(),
+              sizeof(uint64_t),
+              VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT),
+          "Get timestamp query results.");
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t scope = 0; scope < scopes.size(); ++scope) {
+      uint64_t ticks =
+          (timestamps[2 * scope + 1] - timestamps[2 * scope]) & timestamp_mask;
+      double ns = static_cast<double>(ticks) * timestamp_period;
+      Samples &samples = kernels[scopes[scope].name];
+      if (samples.recent.size() < max_samples) {
+        samples.recent.push_back(ns);
+      } else {
+        samples.recent[samples.count % max_samples] = ns;
+      }
+      samples.min_ns = samples.count ? std::min(samples.min_ns, ns) : ns;
+      samples.max_ns = samples.count ? std::max(samples.max_ns, ns) : ns;
+      samples.count++;
+      samples.total_ns += ns;
+      samples.bytes += scopes[scope].bytes;
+    }
+  }
+
+  /* Per-kernel statistics, ordered by kernel name. */
+  std::vector<KernelStats> stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<KernelStats> result;
+    for (const auto &[name, samples] : kernels) {
+      std::vector<double> sorted = samples.recent;
+      std::sort(sorted.begin(), sorted.end());
+      auto percentile = [&](double p) {
+        size_t idx = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted[idx];
+      };
+      result.push_back({
+          .name = name,
+          .count = samples.count,
+          .total_ns = samples.total_ns,
+          .min_ns = samples.min_ns,
+          .mean_ns = samples.total_ns / samples.count,
+          .p50_ns = percentile(0.50),
+          .p99_ns = percentile(0.99),
+          .max_ns = samples.max_ns,
+          .bytes = samples.bytes,
+      });
+    }
+    return result;
+  }
+
+  /* Drop all samples collected so far. */
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    kernels.clear();
+  }
+
+  std::string to_json() const {
+    std::string json = fmt::format(
+        "{{\"timestamp_period_ns\": {}, \"kernels\": [", timestamp_period);
+    std::vector<KernelStats> kernel_stats = stats();
+    for (size_t idx = 0; idx < kernel_stats.size(); ++idx) {
+      const KernelStats &kernel = kernel_stats[idx];
+      json += fmt::format(
+          "{}\n  {{\"name\": \"{}\", \"count\": {}, \"total_ns\": {:.1f}, "
+          "\"min_ns\": {:.1f}, \"mean_ns\": {:.1f}, \"p50_ns\": {:.1f}, "
+          "\"p99_ns\": {:.1f}, \"max_ns\": {:.1f}, \"bytes\": {}, "
+          "\"bandwidth_gbps\": {:.3f}}}",
+          idx ? "," : "", kernel.name, kernel.count, kernel.total_ns,
+          kernel.min_ns, kernel.mean_ns, kernel.p50_ns, kernel.p99_ns,
+          kernel.max_ns, kernel.bytes, kernel.bandwidth());
+    }
+    return json + "\n]}\n";
+  }
+
+  std::string to_csv() const {
+    std::string csv = "name,count,total_ns,min_ns,mean_ns,p50_ns,p99_ns,"
+                      "max_ns,bytes,bandwidth_gbps\n";
+    for (const KernelStats &kernel : stats()) {
+      csv += fmt::format("{},{},{:.1f},{:.1f},{:.1f},{:.1f},{:.1f},{:.1f},{},"
+                         "{:.3f}\n",
+                         kernel.name, kernel.count, kernel.total_ns,
+                         kernel.min_ns, kernel.mean_ns, kernel.p50_ns,
+                         kernel.p99_ns, kernel.max_ns, kernel.bytes,
+                         kernel.bandwidth());
+    }
+    return csv;
+  }
+
+  /* Write to_csv() if `path` ends in .csv and to_json() otherwise. */
+  void write(const std::string &path) const {
+    bool csv =
+        path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    std::ofstream file(path);
+    if (!file.is_open()) {
+      throw std::runtime_error("Failed to open profile output: " + path);
+    }
+    file << (csv ? to_csv() : to_json());
+    spdlog::info("Wrote GPU profile to {}", path);
+  }
+
+  /* Log one line per kernel. */
+  void log() const {
+    for (const KernelStats &kernel : stats()) {
+      spdlog::info("{}: {} samples, p50 {:.1f} us, p99 {:.1f} us, {:.2f} GB/s",
+                   kernel.name, kernel.count, kernel.p50_ns / 1e3,
+                   kernel.p99_ns / 1e3, kernel.bandwidth());
+    }
+  }
+
+private:
+  struct Scope {
+    std::string name;
+    uint64_t bytes;
+  };
+  struct Samples {
+    std::vector<double> recent; // ring of the most recent max_samples
+    size_t count = 0;
+    double total_ns = 0;
+    double min_ns = 0;
+    double max_ns = 0;
+    uint64_t bytes = 0;
+  };
+
+  VkDevice device;
+  VkQueryPool query_pool = VK_NULL_HANDLE;
+  uint32_t max_scopes;
+  size_t max_samples;
+  float timestamp_period = 1.0f;
+  uint64_t timestamp_mask = ~0ull;
+  std::vector<Scope> scopes; // scopes of the recorded command buffer
+  std::map<std::string, Samples> kernels;
+  mutable std::mutex mutex;
+};
+
+/**
+ * @brief Clamp a 1-D workgroup size to the device limits and round it down to
+ * a power of two, as required by the shared memory tree reductions.
+ */
+uint32_t clamp_workgroup_size(VkPhysicalDevice &physical_device,
+                              uint32_t workgroup_size) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  workgroup_size =
+      std::min({workgroup_size, properties.limits.maxComputeWorkGroupSize[0],
+                properties.limits.maxComputeWorkGroupInvocations});
+  uint32_t pow2_size = 1;
+  while (pow2_size * 2 <= workgroup_size) {
+    pow2_size *= 2;
+  }
+  return pow2_size;
+}
+
+/**
+ * @brief Elementwise ops fused into the softmax kernels, see
+ * src/include/elementwise.glsl.
+ *
+ * The `prologue` ops are applied to each input element before the softmax,
+ * in bit order: x * scale, x + bias, x + bias_vector[col] and x + mask[i].
+ * The `epilogue` ops (Scale and Bias only) are applied to each output
+ * element: y * output_scale + output_bias. Every op runs inside the softmax
+ * kernels, so the fused chain costs no extra pass over memory.
+ *
+ * Ops and scalars are specialization constants 3-8, so unused ops are
+ * compiled out. `bias_vector` holds one value per column of the row softmax
+ * (per element for the multi-pass softmax). `mask` is additive and laid out
+ * like the input, so -inf excludes an element.
+ */
+struct SoftmaxFusion {
+  enum Op : uint32_t {
+    Scale = 1,
+    Bias = 2,
+    BiasVector = 4,
+    Mask = 8,
+  };
+  uint32_t prologue = 0;
+  float scale = 1.0f;
+  float bias = 0.0f;
+  VkBuffer bias_vector = VK_NULL_HANDLE;
+  VkBuffer mask = VK_NULL_HANDLE;
+  uint32_t epilogue = 0;
+  float output_scale = 1.0f;
+  float output_bias = 0.0f;
+
+  /* Specialization constants 3, 4, ... for create_pipeline. */
+  std::vector<uint32_t> constants() const {
+    if (((prologue & BiasVector) && bias_vector == VK_NULL_HANDLE) ||
+        ((prologue & Mask) && mask == VK_NULL_HANDLE) ||
+        (epilogue & ~(Scale | Bias))) {
+      throw std::invalid_argument("Invalid softmax fusion.");
+    }
+    auto bits = [](float value) {
+      uint32_t word;
+      std::memcpy(&word, &value, sizeof(word));
+      return word;
+    };
+    return {prologue,         bits(scale),        bits(bias),
+            epilogue,         bits(output_scale), bits(output_bias)};
+  }
+
+  /* Buffers for the fusion bindings, `input` standing in for unused ones. */
+  std::array<VkBuffer, 2> buffers(VkBuffer input) const {
+    return {bias_vector != VK_NULL_HANDLE ? bias_vector : input,
+            mask != VK_NULL_HANDLE ? mask : input};
+  }
+};
+
+/**
+ * @brief Softmax variant, see src/include/softmax_mode.glsl.
+ *
+ * `Log` computes log-softmax. `Causal` and `Lengths` mask the trailing
+ * columns of each row of the row softmax. With Causal, rows are grouped
+ * into [cols, cols] blocks and row r of a block keeps columns 0..r. With
+ * Lengths, row r keeps its first lengths[r] columns (one uint32 per row in
+ * `lengths`). Masked columns are not read or exponentiated. Their outputs
+ * are set to 0 (-inf for log-softmax), or left unwritten with `KeepMasked`.
+ *
+ * The flags are specialization constant 9. Temperature scaling is a push
+ * constant instead, see SoftmaxParams.
+ */
+struct SoftmaxMode {
+  enum Flag : uint32_t {
+    Log = 1,
+    Causal = 2,
+    Lengths = 4,
+    KeepMasked = 8,
+  };
+  uint32_t flags = 0;
+  VkBuffer lengths = VK_NULL_HANDLE;
+
+  /* Specialization constant 9, following SoftmaxFusion::constants(). */
+  uint32_t constant(bool rows) const {
+    if (flags & ~(Log | Causal | Lengths | KeepMasked)) {
+      throw std::invalid_argument("Invalid softmax mode.");
+    }
+    if (!rows && (flags & (Causal | Lengths))) {
+      throw std::invalid_argument("Masks need the row softmax.");
+    }
+    if ((flags & Lengths) && lengths == VK_NULL_HANDLE) {
+      throw std::invalid_argument("Length mask without a lengths buffer.");
+    }
+    return flags;
+  }
+};
+
+/**
+ * @brief Pipelines and scratch resources for the multi-pass softmax.
+ *
+ * The softmax runs as three dispatches sharing one descriptor set:
+ * softmax_reduce computes a (max, sum) pair per workgroup, softmax_combine
+ * folds those into a single global pair, and softmax_normalize writes
+ * exp(x - max) / sum. Each pass grid-strides over the input so the workgroup
+ * count stays bounded for arbitrarily long vectors.
+ *
+ * The length and temperature are push constants, so the pipelines do not
+ * depend on the input size and one resource can be recorded for any length
+ * up to `size`. bind_softmax binds other buffers to the same pipelines.
+ */
+struct SoftmaxResource {
+  UniquePipelineLayout pipeline_layout;
+  UniquePipeline reduce;
+  UniquePipeline combine;
+  UniquePipeline normalize;
+  DescriptorSet descriptor_set;
+  Tensor partials;
+  uint32_t n_workgroups = 0;   // partial results the partials buffer holds
+  uint32_t workgroup_size = 0;
+  size_t size = 0;             // elements
+  float temperature = 1.0f;    // softmax(x / temperature)
+  SoftmaxFusion fusion;
+  SoftmaxMode mode;            // Log only
+};
+
+/* Push constants of the softmax passes, see softmax_reduce.glsl. */
+struct SoftmaxParams {
+  uint32_t n;
+  uint32_t n_partials;
+  float temperature;
+};
+
+/**
+ * @brief Partials buffer and descriptor set running the pipelines of a
+ * SoftmaxResource over one pair of buffers.
+ */
+struct SoftmaxBinding {
+  DescriptorSet descriptor_set;
+  Tensor partials;
+};
+
+/**
+ * @brief Bind buffer_in and buffer_out, of at most softmax.size floats, to
+ * the pipelines of `softmax`, so several pairs of buffers can share them.
+ * The partials buffer is allocated from `arena` in `memory_type`. Pass the
+ * `descriptors` the softmax was created with, if any.
+ */
+SoftmaxBinding bind_softmax(VkDevice &device, const SoftmaxResource &softmax,
+                            VkBuffer buffer_in, VkBuffer buffer_out,
+                            MemoryArena &arena, uint32_t memory_type,
+                            DescriptorCache *descriptors = nullptr) {
+  SoftmaxBinding binding;
+  // One (max, sum) pair per workgroup plus a final slot for the global pair
+  binding.partials =
+      Tensor(device, arena, memory_type, {2 * (softmax.n_workgroups + 1)},
+             DType::f32, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  if (descriptors != nullptr) {
+    // Every set of the binding binds its partials, so this frees them too
+    binding.partials.track(*descriptors);
+  }
+
+  auto [bias_vector, mask] = softmax.fusion.buffers(buffer_in);
+  std::vector<VkBuffer> bindings = {buffer_in, buffer_out,
+                                    binding.partials.buffer, bias_vector,
+                                    mask};
+  binding.descriptor_set = descriptors
+                               ? descriptors->bind(bindings)
+                               : create_descriptor_sets(device, bindings);
+  return binding;
+}
+
+/**
+ * @brief Create the pipelines, partials buffer and descriptor set for a
+ * multi-pass softmax of `size` floats from buffer_in into buffer_out. The
+ * partials buffer is allocated from `arena` in `memory_type`.
+ *
+ * @param workgroup_size clamped with clamp_workgroup_size.
+ * @param max_workgroups upper bound on the number of partial results; larger
+ * inputs are covered by each invocation striding over more elements.
+ * @param descriptors if given, the descriptor set is borrowed from it rather
+ * than created with its own layout and pool.
+ * @param fusion elementwise ops applied to the input and output in the
+ * same passes.
+ * @param mode softmax or log-softmax; masks need create_softmax_rows.
+ */
+SoftmaxResource create_softmax(VkDevice &device,
+                               VkPhysicalDevice &physical_device,
+                               VkBuffer &buffer_in, VkBuffer &buffer_out,
+                               size_t size, MemoryArena &arena,
+                               uint32_t memory_type,
+                               uint32_t workgroup_size = 256,
+                               uint32_t max_workgroups = 1024,
+                               PipelineCache *cache = nullptr,
+                               DescriptorCache *descriptors = nullptr,
+                               const SoftmaxFusion &fusion = {},
+                               const SoftmaxMode &mode = {}) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  workgroup_size = clamp_workgroup_size(physical_device, workgroup_size);
+  max_workgroups =
+      std::min(max_workgroups, properties.limits.maxComputeWorkGroupCount[0]);
+
+  SoftmaxResource softmax{};
+  softmax.size = size;
+  softmax.workgroup_size = workgroup_size;
+  softmax.fusion = fusion;
+  softmax.mode = mode;
+  std::vector<uint32_t> constants = fusion.constants();
+  constants.push_back(mode.constant(false));
+  softmax.n_workgroups = static_cast<uint32_t>(std::clamp<size_t>(
+      (size + workgroup_size - 1) / workgroup_size, 1, max_workgroups));
+  SPDLOG_DEBUG("Softmax of {} elements: {} workgroups of {}", size,
+               softmax.n_workgroups, workgroup_size);
+
+  SoftmaxBinding binding = bind_softmax(device, softmax, buffer_in,
+                                        buffer_out, arena, memory_type,
+                                        descriptors);
+  softmax.descriptor_set = std::move(binding.descriptor_set);
+  softmax.partials = std::move(binding.partials);
+  VkPipelineLayout pipeline_layout =
+      create_pipeline_layout(device, softmax.descriptor_set.layout,
+                             {push_constant_range<SoftmaxParams>()});
+  softmax.pipeline_layout = UniquePipelineLayout(device, pipeline_layout);
+
+  std::array<uint32_t, 3> workgroup_dims = {workgroup_size, 1, 1};
+  // softmax_combine only sees the partials and is not specialized
+  std::array<std::tuple<UniquePipeline *, const char *, bool>, 3> passes = {{
+      {&softmax.reduce, "softmax_reduce", true},
+      {&softmax.combine, "softmax_combine", false},
+      {&softmax.normalize, "softmax_normalize", true},
+  }};
+  for (auto &[pipeline, kernel, fused] : passes) {
+    UniqueShaderModule shader(
+        device, create_shader_module(device, find_shader(kernel)));
+    VkShaderModule shader_module = shader;
+    *pipeline = UniquePipeline(
+        device, create_pipeline(device, pipeline_layout, shader_module,
+                                workgroup_dims,
+                                fused ? constants : std::vector<uint32_t>{},
+                                cache));
+  }
+
+  return softmax;
+}
+
+/**
+ * @brief Multi-pass softmax over every element of a contiguous tensor.
+ */
+SoftmaxResource create_softmax(VkDevice &device,
+                               VkPhysicalDevice &physical_device,
+                               Tensor &input, Tensor &output,
+                               MemoryArena &arena, uint32_t memory_type,
+                               PipelineCache *cache = nullptr,
+                               DescriptorCache *descriptors = nullptr,
+                               const SoftmaxFusion &fusion = {},
+                               const SoftmaxMode &mode = {}) {
+  if (input.numel() != output.numel() || input.dtype != DType::f32 ||
+      output.dtype != DType::f32) {
+    throw std::runtime_error("Softmax input and output must match.");
+  }
+  return create_softmax(device, physical_device, input.buffer, output.buffer,
+                        input.numel(), arena, memory_type, 256, 1024, cache,
+                        descriptors, fusion, mode);
+}
+
+/**
+ * @brief Record the three softmax passes over the first `size` (at most
+ * softmax.size) elements of the buffers `descriptor_set` binds, see
+ * bind_softmax, and the barriers between them. With a `profiler`, each pass
+ * is timed as its own kernel.
+ */
+void record_softmax(VkCommandBuffer &command_buffer,
+                    const SoftmaxResource &softmax,
+                    const DescriptorSet &descriptor_set, size_t size,
+                    float temperature, Profiler *profiler = nullptr) {
+  if (size == 0 || size > softmax.size) {
+    throw std::invalid_argument("Softmax length exceeds its buffers.");
+  }
+  SoftmaxParams params{
+      .n = static_cast<uint32_t>(size),
+      .n_partials = static_cast<uint32_t>(std::min<size_t>(
+          (size + softmax.workgroup_size - 1) / softmax.workgroup_size,
+          softmax.n_workgroups)),
+      .temperature = temperature,
+  };
+  const uint64_t bytes = size * sizeof(float);
+  const uint64_t partial_bytes = 2 * sizeof(float) * params.n_partials;
+  auto dispatch = [&](VkPipeline pipeline, const char *name,
+                      uint32_t n_workgroups, uint64_t bytes) {
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      pipeline);
+    uint32_t scope =
+        profiler ? profiler->begin(command_buffer, name, bytes) : 0;
+    vkCmdDispatch(command_buffer, n_workgroups, 1, 1);
+    if (profiler) {
+      profiler->end(command_buffer, scope);
+    }
+  };
+
+  bind_descriptor_set(command_buffer, softmax.pipeline_layout,
+                      descriptor_set);
+  push_constants(command_buffer, softmax.pipeline_layout, params);
+  dispatch(softmax.reduce, "softmax_reduce", params.n_partials,
+           bytes + partial_bytes);
+  compute_barrier(command_buffer);
+  dispatch(softmax.combine, "softmax_combine", 1, 2 * partial_bytes);
+  compute_barrier(command_buffer);
+  dispatch(softmax.normalize, "softmax_normalize", params.n_partials,
+           2 * bytes);
+}
+
+/* Record the softmax over the first `size` elements of its own buffers. */
+void record_softmax(VkCommandBuffer &command_buffer,
+                    const SoftmaxResource &softmax, size_t size,
+                    float temperature, Profiler *profiler = nullptr) {
+  record_softmax(command_buffer, softmax, softmax.descriptor_set, size,
+                 temperature, profiler);
+}
+
+/* Record the softmax over all softmax.size elements. */
+void record_softmax(VkCommandBuffer &command_buffer,
+                    const SoftmaxResource &softmax,
+                    Profiler *profiler = nullptr) {
+  record_softmax(command_buffer, softmax, softmax.size, softmax.temperature,
+                 profiler);
+}
+
+/**
+ * @brief Pipeline and descriptor set for a batched row-wise softmax over a
+ * row-major [rows, cols] buffer, see softmax_rows.glsl.
+ */
+struct SoftmaxRowsResource {
+  UniquePipelineLayout pipeline_layout;
+  UniquePipeline pipeline;
+  DescriptorSet descriptor_set;
+  uint32_t n_workgroups = 0;
+  bool subgroups = false; // softmax_rows_online.glsl
+  size_t rows = 0;
+  size_t cols = 0;
+  size_t row_stride = 0;    // elements
+  float temperature = 1.0f; // softmax(x / temperature)
+  SoftmaxFusion fusion;
+  SoftmaxMode mode;
+};
+
+/* Push constants of softmax_rows.glsl and softmax_rows_online.glsl. */
+struct SoftmaxRowsParams {
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t row_stride;
+  float temperature;
+};
+
+/* The buffers bound by softmax_rows.glsl, in binding order. */
+std::vector<VkBuffer> softmax_rows_bindings(const SoftmaxRowsResource &softmax,
+                                            VkBuffer buffer_in,
+                                            VkBuffer buffer_out) {
+  auto [bias_vector, mask] = softmax.fusion.buffers(buffer_in);
+  VkBuffer lengths = softmax.mode.lengths;
+  return {buffer_in, buffer_out, bias_vector, mask,
+          lengths != VK_NULL_HANDLE ? lengths : buffer_in};
+}
+
+/**
+ * @brief Create a batched softmax computing each of `rows` rows of `cols`
+ * elements independently in a single dispatch.
+ *
+ * The row count, column count and row stride (in elements, defaulting to
+ * `cols`) are push constants, so the pipeline can be recorded for other
+ * shapes over the same buffers with SoftmaxRowsParams. Each
+ * workgroup owns one row at a time; rows beyond the device workgroup count
+ * limit are covered by workgroups striding over rows. When `capabilities`
+ * reports subgroup arithmetic support the online subgroup variant
+ * softmax_rows_online.glsl is used instead of the shared memory tree.
+ * `mode` selects log-softmax and causal or per-row length masks.
+ */
+SoftmaxRowsResource
+create_softmax_rows(VkDevice &device, VkPhysicalDevice &physical_device,
+                    const DeviceCapabilities &capabilities,
+                    VkBuffer &buffer_in, VkBuffer &buffer_out, uint32_t rows,
+                    uint32_t cols, uint32_t row_stride = 0,
+                    uint32_t workgroup_size = 256,
+                    PipelineCache *cache = nullptr,
+                    DescriptorCache *descriptors = nullptr,
+                    const SoftmaxFusion &fusion = {},
+                    const SoftmaxMode &mode = {}) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  if (row_stride == 0) {
+    row_stride = cols;
+  }
+  // Avoid idle invocations on short rows
+  uint32_t cols_pow2 = 1;
+  while (cols_pow2 < cols && cols_pow2 < workgroup_size) {
+    cols_pow2 *= 2;
+  }
+  workgroup_size = clamp_workgroup_size(physical_device, cols_pow2);
+  const bool use_subgroups = capabilities.subgroup_arithmetic;
+
+  SoftmaxRowsResource softmax{};
+  softmax.subgroups = use_subgroups;
+  softmax.rows = rows;
+  softmax.cols = cols;
+  softmax.row_stride = row_stride;
+  softmax.fusion = fusion;
+  softmax.mode = mode;
+  std::vector<uint32_t> constants = fusion.constants();
+  constants.push_back(mode.constant(true));
+  softmax.n_workgroups = std::max(
+      1u, std::min(rows, properties.limits.maxComputeWorkGroupCount[0]));
+  SPDLOG_DEBUG("Row softmax of [{}, {}] (stride {}): {} workgroups of {}{}",
+               rows, cols, row_stride, softmax.n_workgroups, workgroup_size,
+               use_subgroups ? ", subgroup reduction" : "");
+
+  std::vector<VkBuffer> bindings =
+      softmax_rows_bindings(softmax, buffer_in, buffer_out);
+  softmax.descriptor_set = descriptors
+                               ? descriptors->bind(bindings)
+                               : create_descriptor_sets(device, bindings);
+  VkPipelineLayout pipeline_layout =
+      create_pipeline_layout(device, softmax.descriptor_set.layout,
+                             {push_constant_range<SoftmaxRowsParams>()});
+  softmax.pipeline_layout = UniquePipelineLayout(device, pipeline_layout);
+
+  UniqueShaderModule shader(
+      device,
+      create_shader_module(device, find_shader(use_subgroups
+                                                   ? "softmax_rows_online"
+                                                   : "softmax_rows")));
+  VkShaderModule shader_module = shader;
+  softmax.pipeline = UniquePipeline(
+      device,
+      create_pipeline(device, pipeline_layout, shader_module,
+                      {workgroup_size, 1, 1}, constants, cache));
+
+  return softmax;
+}
+
+/**
+ * @brief Batched softmax over the last dimension of a tensor, treating all
+ * leading dimensions as rows. The last dimension must be contiguous.
+ */
+SoftmaxRowsResource
+create_softmax_rows(VkDevice &device, VkPhysicalDevice &physical_device,
+                    const DeviceCapabilities &capabilities, Tensor &input,
+                    Tensor &output, PipelineCache *cache = nullptr,
+                    DescriptorCache *descriptors = nullptr,
+                    const SoftmaxFusion &fusion = {},
+                    const SoftmaxMode &mode = {}) {
+  if (input.rank() == 0 || input.shape != output.shape ||
+      input.strides != output.strides || input.strides.back() != 1 ||
+      input.dtype != DType::f32 || output.dtype != DType::f32) {
+    throw std::runtime_error("Unsupported softmax tensor layout.");
+  }
+  // Leading dimensions must collapse into rows of a single stride
+  for (size_t dim = 0; dim + 2 < input.rank(); ++dim) {
+    if (input.strides[dim] != input.strides[dim + 1] * input.shape[dim + 1]) {
+      throw std::runtime_error("Unsupported softmax tensor layout.");
+    }
+  }
+  uint32_t cols = static_cast<uint32_t>(input.shape.back());
+  uint32_t rows = static_cast<uint32_t>(input.numel() / std::max(cols, 1u));
+  uint32_t row_stride = input.rank() > 1
+                            ? static_cast<uint32_t>(input.strides.rbegin()[1])
+                            : cols;
+  return create_softmax_rows(device, physical_device, capabilities,
+                             input.buffer, output.buffer, rows, cols,
+                             row_stride, 256, cache, descriptors, fusion,
+                             mode);
+}
+
+/**
+ * @brief Point `softmax` at other input and output buffers, keeping its
+ * pipeline, e.g. after growing them. `descriptors` must be the cache the
+ * softmax was created with, whose set layouts the pipeline layout uses.
+ */
+void rebind_softmax_rows(SoftmaxRowsResource &softmax,
+                         DescriptorCache &descriptors, VkBuffer buffer_in,
+                         VkBuffer buffer_out) {
+  softmax.descriptor_set =
+      descriptors.bind(softmax_rows_bindings(softmax, buffer_in, buffer_out));
+}
+
+/**
+ * @brief Record the batched softmax dispatch for the shape in `params`, which
+ * must fit in the buffers the softmax was created for.
+ */
+void record_softmax_rows(VkCommandBuffer &command_buffer,
+                         const SoftmaxRowsResource &softmax,
+                         const SoftmaxRowsParams &params,
+                         Profiler *profiler = nullptr) {
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    softmax.pipeline);
+  bind_descriptor_set(command_buffer, softmax.pipeline_layout,
+                      softmax.descriptor_set);
+  push_constants(command_buffer, softmax.pipeline_layout, params);
+  // Bytes moved counts each element read and written once
+  uint32_t scope = profiler ? profiler->begin(
+                                  command_buffer,
+                                  softmax.subgroups ? "softmax_rows_online"
+                                                    : "softmax_rows",
+                                  2 * sizeof(float) * params.rows *
+                                      params.cols)
+                            : 0;
+  vkCmdDispatch(command_buffer,
+                std::max(1u, std::min(params.rows, softmax.n_workgroups)), 1,
+                1);
+  if (profiler) {
+    profiler->end(command_buffer, scope);
+  }
+}
+
+/* Record the batched softmax for the shape it was created with. */
+void record_softmax_rows(VkCommandBuffer &command_buffer,
+                         const SoftmaxRowsResource &softmax,
+                         Profiler *profiler = nullptr) {
+  SoftmaxRowsParams params{
+      .rows = static_cast<uint32_t>(softmax.rows),
+      .cols = static_cast<uint32_t>(softmax.cols),
+      .row_stride = static_cast<uint32_t>(softmax.row_stride),
+      .temperature = softmax.temperature,
+  };
+  record_softmax_rows(command_buffer, softmax, params, profiler);
+}
+
+/**
+ * @brief Pipeline and descriptor set for a softmax over a ragged batch of
+ * rows packed back to back, delimited by an offsets table, see
+ * softmax_ragged.glsl.
+ */
+struct SoftmaxRaggedResource {
+  UniquePipelineLayout pipeline_layout;
+  UniquePipeline pipeline;
+  DescriptorSet descriptor_set;
+  uint32_t n_workgroups = 0;
+  size_t max_rows = 0;      // offsets table holds max_rows + 1 entries
+  float temperature = 1.0f; // softmax(x / temperature)
+};
+
+/* Push constants of softmax_ragged.glsl. */
+struct SoftmaxRaggedParams {
+  uint32_t rows;
+  float temperature;
+};
+
+/**
+ * @brief Create a softmax over up to `max_rows` rows of different lengths in
+ * a single dispatch. Row r is elements offsets[r] to offsets[r + 1] of
+ * `buffer_in`, where `offsets` is a buffer of uint32 with one more entry than
+ * there are rows. The row count is a push constant, so one pipeline serves
+ * every batch that fits the buffers.
+ */
+SoftmaxRaggedResource
+create_softmax_ragged(VkDevice &device, VkPhysicalDevice &physical_device,
+                      VkBuffer &buffer_in, VkBuffer &buffer_out,
+                      VkBuffer &offsets, uint32_t max_rows,
+                      uint32_t workgroup_size = 128,
+                      PipelineCache *cache = nullptr,
+                      DescriptorCache *descriptors = nullptr) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  workgroup_size = clamp_workgroup_size(physical_device, workgroup_size);
+
+  SoftmaxRaggedResource softmax{};
+  softmax.max_rows = max_rows;
+  softmax.n_workgroups = std::max(
+      1u, std::min(max_rows, properties.limits.maxComputeWorkGroupCount[0]));
+  SPDLOG_DEBUG("Ragged softmax of up to {} rows: {} workgroups of {}",
+               max_rows, softmax.n_workgroups, workgroup_size);
+
+  std::vector<VkBuffer> bindings = {buffer_in, buffer_out, offsets};
+  softmax.descriptor_set = descriptors
+                               ? descriptors->bind(bindings)
+                               : create_descriptor_sets(device, bindings);
+  VkPipelineLayout pipeline_layout =
+      create_pipeline_layout(device, softmax.descriptor_set.layout,
+                             {push_constant_range<SoftmaxRaggedParams>()});
+  softmax.pipeline_layout = UniquePipelineLayout(device, pipeline_layout);
+
+  UniqueShaderModule shader(
+      device, create_shader_module(device, find_shader("softmax_ragged")));
+  VkShaderModule shader_module = shader;
+  softmax.pipeline = UniquePipeline(
+      device, create_pipeline(device, pipeline_layout, shader_module,
+                              {workgroup_size, 1, 1}, {}, cache));
+  return softmax;
+}
+
+/**
+ * @brief Record the ragged softmax over the first `rows` rows of the offsets
+ * table, holding `elements` elements in total (only used by the profiler).
+ */
+void record_softmax_ragged(VkCommandBuffer &command_buffer,
+                           const SoftmaxRaggedResource &softmax,
+                           uint32_t rows, uint64_t elements,
+                           Profiler *profiler = nullptr) {
+  SoftmaxRaggedParams params{
+      .rows = rows,
+      .temperature = softmax.temperature,
+  };
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    softmax.pipeline);
+  bind_descriptor_set(command_buffer, softmax.pipeline_layout,
+                      softmax.descriptor_set);
+  push_constants(command_buffer, softmax.pipeline_layout, params);
+  uint32_t scope =
+      profiler ? profiler->begin(command_buffer, "softmax_ragged",
+                                 2 * sizeof(float) * elements +
+                                     sizeof(uint32_t) * (rows + 1))
+               : 0;
+  vkCmdDispatch(command_buffer,
+                std::max(1u, std::min(rows, softmax.n_workgroups)), 1, 1);
+  if (profiler) {
+    profiler->end(command_buffer, scope);
+  }
 }
 
 } // namespace vkc
@@ -0,0 +1,134 @@
+
+#define VK_ENABLE_BETA_EXTENSIONS // VK_KHR_portability_subset
+#include <vulkan/vulkan.hpp>
+#include <vulkan/vulkan_beta.h>
+#include <vulkan/vulkan_macos.h>
+
+#include "spdlog/spdlog.h"
+
+#include <random>
+#include <string>
+
+#include "cpu_softmax.hpp"
+#include "multi_device.hpp"
+#include "vkcompute.hpp"
+
+/*
+ * Checks shard_rows and MultiDeviceSoftmax against the CPU backend
+ * (CpuSoftmax). The sharded softmax lists the device selected by
+ * VKCOMPUTE_DEVICE (see select_physical_device) N times, so the sharding is
+ * covered on a machine with a single GPU or on lavapipe.
+ *
+ * Usage: vkcompute_multi_device_test [N = 3]
+ *
+ * Exits 1 if a check fails and 77 (skipped, for CTest) if there is no
+ * Vulkan device to run on.
+ */
+
+using Ranges = std::vector<std::pair<uint32_t, uint32_t>>;
+
+// Largest difference from CpuSoftmax accepted, results are probabilities
+constexpr float tolerance = 1e-5f;
+constexpr int skipped = 77;
+
+int failures = 0;
+
+void expect(bool condition, const std::string &what) {
+  if (!condition) {
+    spdlog::error("FAILED: {}", what);
+    failures++;
+  }
+}
+
+void test_shard_rows() {
+  expect(vkc::shard_rows(10, 3) == Ranges{{0, 4}, {4, 3}, {7, 3}},
+         "10 rows in 3 shards differ by at most one row");
+  expect(vkc::shard_rows(7, 1) == Ranges{{0, 7}}, "one shard has every row");
+  expect(vkc::shard_rows(2, 5) == Ranges{{0, 1}, {1, 1}},
+         "fewer rows than shards gives no empty shard");
+  expect(vkc::shard_rows(0, 3).empty(), "no rows gives no shards");
+  expect(vkc::shard_rows(10, 0).empty(), "0 shards gives no shards");
+}
+
+std::vector<float> random_input(size_t size) {
+  std::mt19937 generator(42);
+  std::normal_distribution<float> distribution(0.0f, 4.0f);
+  std::vector<float> input(size);
+  for (float &x : input) {
+    x = distribution(generator);
+  }
+  return input;
+}
+
+void test_sharded_softmax(VkInstance instance,
+                          const std::vector<VkPhysicalDevice> &devices,
+                          uint32_t rows, uint32_t cols,
+                          float temperature = 1.0f) {
+  std::string config = fmt::format("rows={} cols={} shards={}", rows, cols,
+                                   devices.size());
+  vkc::MultiDeviceSoftmax softmax(instance, devices, rows, cols, temperature);
+  expect(softmax.shard_ranges() == vkc::shard_rows(rows, devices.size()),
+         config + ": shards cover the rows from shard_rows");
+
+  std::vector<float> input = random_input(size_t(rows) * cols);
+  float error = vkc::max_abs_error(
+      softmax.run(input),
+      vkc::CpuSoftmax(rows, cols, temperature).run(input));
+  spdlog::info("{}: max_abs_error {}", config, error);
+  expect(error <= tolerance,
+         fmt::format("{}: max_abs_error {} within {}", config, error,
+                     tolerance));
+}
+
+int main(int argc, char **argv) {
+  vkc::setup_logging({.level = spdlog::level::info});
+  size_t n_shards = argc > 1 ? std::stoull(argv[1]) : 3;
+  if (n_shards == 0) {
+    spdlog::error("Usage: {} [shards > 0]", argv[0]);
+    return 1;
+  }
+
+  test_shard_rows();
+
+  VkInstance instance = VK_NULL_HANDLE;
+  VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+  try {
+    instance = vkc::create_vulkan_instance(VK_MAKE_API_VERSION(1, 3, 236, 0));
+    physical_device = vkc::select_physical_device(instance);
+  } catch (const std::exception &e) {
+    spdlog::warn("No Vulkan device ({}), sharded softmax not tested",
+                 e.what());
+    if (instance != VK_NULL_HANDLE) {
+      vkDestroyInstance(instance, nullptr);
+    }
+    return failures > 0 ? 1 : skipped;
+  }
+  vkc::UniqueInstance instance_owner(instance);
+
+  std::vector<VkPhysicalDevice> devices(n_shards, physical_device);
+  try {
+    // Rows that do not split evenly, rows longer than a workgroup, fewer
+    // rows than shards and a temperature
+    test_sharded_softmax(instance, devices, 37, 100);
+    test_sharded_softmax(instance, devices, 16, 1000);
+    test_sharded_softmax(instance, devices, 2, 64);
+    test_sharded_softmax(instance, devices, 33, 128, 0.5f);
+  } catch (const std::exception &e) {
+    expect(false, fmt::format("sharded softmax threw: {}", e.what()));
+  }
+
+  bool threw = false;
+  try {
+    vkc::MultiDeviceSoftmax softmax(instance, {}, 4, 4);
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  expect(threw, "no devices is rejected");
+
+  if (failures > 0) {
+    spdlog::error("{} checks failed", failures);
+    return 1;
+  }
+  spdlog::info("All checks passed");
+  return 0;
+}